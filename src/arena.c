@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+void arena_init(arena_t *arena)
+{
+    arena->mapping = NULL;
+    arena->base = NULL;
+    arena->capacity = 0;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->mapped = 0;
+    arena->huge_pages = 0;
+}
+
+static void arena_unmap(arena_t *arena)
+{
+    if (arena->mapping) {
+        munmap(arena->mapping, arena->mapped);
+    }
+
+    arena->mapping = NULL;
+    arena->base = NULL;
+    arena->capacity = 0;
+    arena->mapped = 0;
+    arena->huge_pages = 0;
+}
+
+int arena_try_reserve(arena_t *arena, size_t capacity)
+{
+    // a mapping that is large enough is kept, so a batch of images maps memory only when it grows
+    if (capacity <= arena->capacity) {
+        return 1;
+    }
+
+    if (arena->used) {
+        fprintf(stderr, "ARENA ERROR: << Cannot grow an arena that is in use >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    arena_unmap(arena);
+
+    capacity = (capacity + ARENA_HUGE_PAGE_SIZE - 1) & ~((size_t)ARENA_HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+    // explicit huge pages only work if the administrator reserved some (vm.nr_hugepages)
+    void *mapping = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mapping != MAP_FAILED) {
+        arena->mapping = mapping;
+        arena->base = mapping;
+        arena->capacity = capacity;
+        arena->mapped = capacity;
+        arena->huge_pages = 1;
+        return 1;
+    }
+#endif
+
+    // otherwise map a 2 MB aligned region and ask for transparent huge pages
+    size_t mapped = capacity + ARENA_HUGE_PAGE_SIZE;
+    char *region = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        return 0;
+    }
+
+    arena->mapping = region;
+    arena->mapped = mapped;
+    arena->base = (char *)(((uintptr_t)region + ARENA_HUGE_PAGE_SIZE - 1) & ~((uintptr_t)ARENA_HUGE_PAGE_SIZE - 1));
+    arena->capacity = capacity;
+
+#ifdef MADV_HUGEPAGE
+    arena->huge_pages = madvise(arena->base, capacity, MADV_HUGEPAGE) == 0 ? 2 : 0;
+#endif
+
+    return 1;
+}
+
+void arena_reserve(arena_t *arena, size_t capacity)
+{
+    if (!arena_try_reserve(arena, capacity)) {
+        fprintf(stderr, "ARENA ERROR: << Could not map %zu bytes >> \n", capacity + ARENA_HUGE_PAGE_SIZE);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    size = ARENA_ALIGN(size);
+
+    if (arena->used + size > arena->capacity) {
+        fprintf(stderr, "ARENA ERROR: << Out of space (%zu of %zu bytes used, %zu requested) >> \n", arena->used, arena->capacity, size);
+        exit(EXIT_FAILURE);
+    }
+
+    void *ptr = arena->base + arena->used;
+    arena->used += size;
+
+    if (arena->used > arena->peak) {
+        arena->peak = arena->used;
+    }
+
+    return ptr;
+}
+
+size_t arena_mark(arena_t *arena)
+{
+    return arena->used;
+}
+
+void arena_release(arena_t *arena, size_t mark)
+{
+    arena->used = mark;
+}
+
+void arena_reset(arena_t *arena)
+{
+    arena->used = 0;
+}
+
+void arena_destroy(arena_t *arena)
+{
+    arena_unmap(arena);
+    arena->used = 0;
+}
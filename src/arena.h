@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_ALIGNMENT 64
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// rounds a request up so every allocation starts on a cache line
+#define ARENA_ALIGN(size) (((size) + ARENA_ALIGNMENT - 1) & ~((size_t)ARENA_ALIGNMENT - 1))
+
+// one mapping per arena, bump-allocated and released all at once
+typedef struct {
+    char *mapping;
+    char *base;
+    size_t capacity;
+    size_t used;
+    size_t peak;
+    size_t mapped;
+    int huge_pages;  // 0 = regular pages, 1 = MAP_HUGETLB, 2 = transparent huge pages advised
+} arena_t;
+
+void arena_init(arena_t *arena);
+void arena_reserve(arena_t *arena, size_t capacity);
+// the same, but 0 instead of exiting when the memory can't be mapped, leaving the arena empty
+int arena_try_reserve(arena_t *arena, size_t capacity);
+void *arena_alloc(arena_t *arena, size_t size);
+size_t arena_mark(arena_t *arena);
+void arena_release(arena_t *arena, size_t mark);
+void arena_reset(arena_t *arena);
+void arena_destroy(arena_t *arena);
+
+#endif
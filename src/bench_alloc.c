@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include "image_io.h"
+#include "compression.h"
+
+#define DEFAULT_N_CLUSTERS 8
+#define DEFAULT_MAX_ITERATIONS 150
+#define DEFAULT_N_THREADS 2
+#define DEFAULT_N_RUNS 10
+#define MAX_IMAGES 64
+
+// glibc's own entry points, so the counting wrappers below can forward to them
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static long n_allocations = 0;
+static int counting = 0;
+
+static void count_allocation(void)
+{
+    if (counting) {
+        __atomic_add_fetch(&n_allocations, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void *malloc(size_t size)
+{
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    count_allocation();
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    count_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    count_allocation();
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : 12;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    count_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+int main(int argc, char **argv)
+{
+    kmeans_config_t config;
+    config.n_clusters = DEFAULT_N_CLUSTERS;
+    config.max_iterations = DEFAULT_MAX_ITERATIONS;
+    config.n_threads = DEFAULT_N_THREADS;
+    config.schedule = SCHEDULE_STATIC;
+
+    int n_runs = DEFAULT_N_RUNS;
+
+    // Parse arguments and optional parameters
+    char optchar;
+    while ((optchar = getopt(argc, argv, "k:m:n:t:wh")) != -1) {
+        switch (optchar)
+        {
+        case 'k':
+            config.n_clusters = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            config.max_iterations = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            n_runs = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            config.n_threads = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            config.schedule = SCHEDULE_TILES;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-k clusters] [-m iterations] [-n runs] [-t threads] [-w] image...\n", argv[0]);
+            exit(EXIT_FAILURE);
+            break;
+        }
+    }
+
+    int n_images = argc - optind;
+    if (n_images < 1 || n_images > MAX_IMAGES) {
+        fprintf(stderr, "INPUT ERROR: << Expected between 1 and %d images >> \n", MAX_IMAGES);
+        exit(EXIT_FAILURE);
+    }
+
+    // Load every image once and keep the originals, the runs work on a copy
+    byte_t *images[MAX_IMAGES];
+    int widths[MAX_IMAGES], heights[MAX_IMAGES], channels[MAX_IMAGES];
+    size_t max_size = 0;
+
+    for (int i = 0; i < n_images; i++) {
+        images[i] = img_load(argv[optind + i], &widths[i], &heights[i], &channels[i]);
+
+        size_t size = (size_t)widths[i] * heights[i] * channels[i];
+        if (size > max_size) {
+            max_size = size;
+        }
+    }
+
+    byte_t *data = malloc(max_size);
+    kmeans_context_t *ctx = kmeans_context_create(&config);
+    kmeans_result_t result;
+
+    // Warm up: the workspace grows to the largest image and the OpenMP threads are started
+    for (int i = 0; i < n_images; i++) {
+        memcpy(data, images[i], (size_t)widths[i] * heights[i] * channels[i]);
+        kmeans_context_compress(ctx, data, widths[i], heights[i], channels[i], &result);
+    }
+    size_t warm_workspace = result.stats.workspace_bytes;
+
+    // Steady state: nothing may touch the heap any more
+    srand(0);
+    counting = 1;
+    double start_time = omp_get_wtime();
+
+    for (int run = 0; run < n_runs; run++) {
+        for (int i = 0; i < n_images; i++) {
+            memcpy(data, images[i], (size_t)widths[i] * heights[i] * channels[i]);
+            kmeans_context_compress(ctx, data, widths[i], heights[i], channels[i], &result);
+        }
+    }
+
+    double execution_time = omp_get_wtime() - start_time;
+    counting = 0;
+
+    printf("Images: %d x %d runs\n", n_images, n_runs);
+    printf("Execution time: %f (%.2f images/s)\n", execution_time, n_images * n_runs / execution_time);
+    printf("Workspace: %zu bytes (%s)\n", result.stats.workspace_bytes, result.stats.workspace_bytes == warm_workspace ? "stable" : "grew");
+    printf("Steady-state heap allocations: %ld\n", n_allocations);
+
+    kmeans_context_report(ctx, stdout);
+    kmeans_context_destroy(ctx);
+
+    for (int i = 0; i < n_images; i++) {
+        free(images[i]);
+    }
+    free(data);
+
+    return n_allocations == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,19 @@
+#!/usr/bin/env bash
+
+# Execution time of the static OpenMP, tile and parallel STL schedules of main_omp (built with -DWITH_PSTL)
+threads=${THREADS:-"1 2 4 8 16"}
+images=${IMAGES:-"../imgs/input/bear_small.jpg ../imgs/input/bear_medium.jpg ../imgs/input/bear_large.jpg"}
+out=${OUT:-"/tmp/bench_backends.jpg"}
+
+printf "%-32s %8s %10s %10s %10s\n" "image" "threads" "omp" "tiles" "pstl"
+
+for image in $images; do
+    for t in $threads; do
+        times=""
+        for flag in "" "-w" "-p"; do
+            time=$(OMP_NUM_THREADS=$t ${RUN} ./main_omp $image -o $out -t $t -s 42 $flag | awk '/Execution time/ {print $3}')
+            times="$times $time"
+        done
+        printf "%-32s %8s %10s %10s %10s\n" "$(basename $image)" $t $times
+    done
+done
@@ -0,0 +1,33 @@
+#!/usr/bin/env bash
+
+# Execution time of main_gpu on the whole CPU device, on its sub-devices per affinity domain (-F) and of
+# main_omp with as many threads, averaged over a few seeds
+seeds=${SEEDS:-"1 2 3"}
+domains=${DOMAINS:-"numa l3"}
+device=${DEVICE:-"cpu"}
+threads=${THREADS:-$(nproc)}
+images=${IMAGES:-"../imgs/input/bear_small.jpg ../imgs/input/bear_medium.jpg ../imgs/input/bear_large.jpg"}
+out=${OUT:-"/tmp/bench_fission.jpg"}
+
+mean_time() {
+    for s in $seeds; do
+        ${RUN} "$@" -s $s
+    done | awk '/Execution time/ {t += $3; n++} END {if (n) printf "%.4f", t / n}'
+}
+
+printf "%-32s %10s" "image" "device"
+for domain in $domains; do
+    printf " %10s" "-F $domain"
+done
+printf " %10s\n" "omp"
+
+for image in $images; do
+    times="$(mean_time ./main_gpu $image -o $out -d $device $FLAGS)"
+    for domain in $domains; do
+        times="$times $(mean_time ./main_gpu $image -o $out -d $device -F $domain $FLAGS)"
+    done
+    times="$times $(mean_time ./main_omp $image -o $out -t $threads)"
+
+    printf "%-32s %10s" "$(basename $image)" $times
+    printf "\n"
+done
@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+
+#include "image_io.h"
+#include "compression.h"
+#include "daemon_protocol.h"
+#include "shared_buffer.h"
+#include "percentile.h"
+
+#define DEFAULT_N_CLUSTERS 8
+#define DEFAULT_MAX_ITERATIONS 20
+#define DEFAULT_N_THREADS 2
+#define DEFAULT_N_RUNS 10
+#define DEFAULT_SEED 1
+// a 4K frame
+#define FRAME_WIDTH 3840
+#define FRAME_HEIGHT 2160
+#define FRAME_IN_PATH "/tmp/kmeans_frame_in.png"
+#define FRAME_OUT_PATH "/tmp/kmeans_frame_out.png"
+
+// how a frame gets from the caller to the engine and back
+#define PATH_POINTER 0        // in-process, the result written to the caller's output buffer
+#define PATH_FILE 1           // in-process, the frame encoded to a file, loaded, compressed, saved and loaded again
+#define PATH_MEMFD 2          // the daemon maps the caller's memfd
+#define PATH_PIXELS 3         // the pixels copied over the socket and back
+#define PATH_DAEMON_FILE 4    // the daemon loads and saves the files
+#define N_PATHS 5
+
+static const char *path_names[N_PATHS] = {"pointer", "file", "daemon_memfd", "daemon_pixels", "daemon_file"};
+
+typedef struct {
+    kmeans_context_t *ctx;
+    const char *socket_path;
+    int n_clusters;
+    int max_iterations;
+    int seed;
+    int n_channels;
+    byte_t *frame;
+    byte_t *out;
+    shared_buffer_t shared;   // the frame in its first half, the result in its second
+} bench_t;
+
+// the frame scaled to 4K by nearest neighbour, so any input makes a frame of the same size
+static byte_t *scale_frame(const byte_t *image, int width, int height, int n_channels)
+{
+    byte_t *frame = malloc((size_t) FRAME_WIDTH * FRAME_HEIGHT * n_channels);
+
+    for (int y = 0; y < FRAME_HEIGHT; y++) {
+        const byte_t *row = image + (size_t) (y * height / FRAME_HEIGHT) * width * n_channels;
+        for (int x = 0; x < FRAME_WIDTH; x++) {
+            memcpy(frame + ((size_t) y * FRAME_WIDTH + x) * n_channels, row + (size_t) (x * width / FRAME_WIDTH) * n_channels, n_channels);
+        }
+    }
+
+    return frame;
+}
+
+static int daemon_job(bench_t *bench, int type)
+{
+    size_t size = (size_t) FRAME_WIDTH * FRAME_HEIGHT * bench->n_channels;
+
+    daemon_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.magic = DAEMON_MAGIC;
+    request.type = type;
+    request.width = FRAME_WIDTH;
+    request.height = FRAME_HEIGHT;
+    request.n_channels = bench->n_channels;
+    request.n_clusters = bench->n_clusters;
+    request.max_iterations = bench->max_iterations;
+    request.seed = bench->seed;
+
+    const char paths[] = FRAME_IN_PATH "\0" FRAME_OUT_PATH;
+    const void *payload;
+    byte_t *result = NULL;
+    int passed_fd = -1;
+
+    if (type == DAEMON_JOB_SHARED) {
+        request.shared_bytes = bench->shared.size;
+        request.output_offset = size;
+        request.payload_bytes = 1;
+        payload = "";
+        passed_fd = bench->shared.fd;
+    } else if (type == DAEMON_JOB_PIXELS) {
+        // the socket path compresses in place, so the frame goes out of a copy like the caller's own
+        memcpy(bench->out, bench->frame, size);
+        request.payload_bytes = size;
+        payload = bench->out;
+        result = bench->out;
+    } else {
+        request.payload_bytes = sizeof(paths);
+        payload = paths;
+    }
+
+    daemon_reply_t reply;
+    int status = daemon_submit(bench->socket_path, &request, payload, passed_fd, result, &reply);
+    if (status != DAEMON_OK) {
+        return -1;
+    }
+
+    // the file job's result is only useful to the caller once it's back in memory
+    if (type == DAEMON_JOB_FILE) {
+        int width, height, n_channels;
+        free(img_load(FRAME_OUT_PATH, &width, &height, &n_channels));
+    }
+
+    return reply.iterations;
+}
+
+// one frame through a path; the iterations, -1 on failure
+static int run_path(bench_t *bench, int path)
+{
+    kmeans_result_t result;
+
+    switch (path) {
+    case PATH_POINTER:
+        kmeans_context_seed(bench->ctx, bench->seed);
+        if (!kmeans_context_compress_to(bench->ctx, bench->frame, bench->out, FRAME_WIDTH, FRAME_HEIGHT, bench->n_channels, &result)) {
+            return -1;
+        }
+        return result.stats.iterations;
+    case PATH_FILE: {
+        int width, height, n_channels;
+        img_save(FRAME_IN_PATH, bench->frame, FRAME_WIDTH, FRAME_HEIGHT, bench->n_channels);
+        byte_t *data = img_load(FRAME_IN_PATH, &width, &height, &n_channels);
+
+        kmeans_context_seed(bench->ctx, bench->seed);
+        int ok = kmeans_context_compress(bench->ctx, data, width, height, n_channels, &result);
+        img_save(FRAME_OUT_PATH, data, width, height, n_channels);
+        free(data);
+        if (!ok) {
+            return -1;
+        }
+
+        free(img_load(FRAME_OUT_PATH, &width, &height, &n_channels));
+        return result.stats.iterations;
+    }
+    case PATH_MEMFD:
+        return daemon_job(bench, DAEMON_JOB_SHARED);
+    case PATH_PIXELS:
+        return daemon_job(bench, DAEMON_JOB_PIXELS);
+    default:
+        // the daemon reads the frame from the file the caller wrote
+        img_save(FRAME_IN_PATH, bench->frame, FRAME_WIDTH, FRAME_HEIGHT, bench->n_channels);
+        return daemon_job(bench, DAEMON_JOB_FILE);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    kmeans_config_t config;
+    config.n_clusters = DEFAULT_N_CLUSTERS;
+    config.max_iterations = DEFAULT_MAX_ITERATIONS;
+    config.n_threads = DEFAULT_N_THREADS;
+    config.schedule = SCHEDULE_STATIC;
+
+    const char *socket_path = NULL;
+    int n_runs = DEFAULT_N_RUNS;
+
+    // Parse arguments and optional parameters
+    char optchar;
+    while ((optchar = getopt(argc, argv, "k:m:n:t:S:h")) != -1) {
+        switch (optchar)
+        {
+        case 'k':
+            config.n_clusters = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            config.max_iterations = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            n_runs = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            config.n_threads = strtol(optarg, NULL, 10);
+            break;
+        case 'S':
+            socket_path = optarg;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-k clusters] [-m iterations] [-n runs] [-t threads] [-S daemon_socket] image\n", argv[0]);
+            exit(EXIT_FAILURE);
+            break;
+        }
+    }
+
+    if (argc - optind != 1 || n_runs < 1) {
+        fprintf(stderr, "INPUT ERROR: << Expected one image and at least one run >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    int width, height;
+    bench_t bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.socket_path = socket_path;
+    bench.n_clusters = config.n_clusters;
+    bench.max_iterations = config.max_iterations;
+    bench.seed = DEFAULT_SEED;
+
+    byte_t *image = img_load(argv[optind], &width, &height, &bench.n_channels);
+    bench.frame = scale_frame(image, width, height, bench.n_channels);
+    free(image);
+
+    size_t size = (size_t) FRAME_WIDTH * FRAME_HEIGHT * bench.n_channels;
+    bench.out = malloc(size);
+    bench.ctx = kmeans_context_create(&config);
+
+    // The frame is copied into the shared memory once, where a caller that owns it would have decoded it
+    if (!shared_buffer_create(&bench.shared, 2 * size)) {
+        fprintf(stderr, "[!] Can't create the shared memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(bench.shared.data, bench.frame, size);
+
+    printf("Frame: %dx%d, %d channels, %zu bytes\n", FRAME_WIDTH, FRAME_HEIGHT, bench.n_channels, size);
+    printf("Runs: %d per path\n", n_runs);
+
+    double *latencies = malloc(n_runs * sizeof(double));
+    double pointer_p50 = 0;
+    int n_paths = socket_path ? N_PATHS : PATH_MEMFD;
+
+    for (int path = 0; path < n_paths; path++) {
+        // Warm up: the workspace, the OpenMP threads and the daemon's worker
+        int iterations = run_path(&bench, path);
+        if (iterations < 0 && path < PATH_MEMFD) {
+            printf("[+] %s: failed, the frame's workspace can't be mapped\n", path_names[path]);
+            continue;
+        }
+        if (iterations < 0) {
+            printf("[+] %s: failed, is the daemon running on %s?\n", path_names[path], socket_path);
+            continue;
+        }
+
+        double sum = 0;
+        for (int run = 0; run < n_runs; run++) {
+            double start_time = omp_get_wtime();
+            run_path(&bench, path);
+            latencies[run] = omp_get_wtime() - start_time;
+            sum += latencies[run];
+        }
+
+        qsort(latencies, n_runs, sizeof(double), compare_doubles);
+        double p50 = percentile(latencies, n_runs, 50);
+        if (path == PATH_POINTER) {
+            pointer_p50 = p50;
+        }
+
+        printf("[+] %s: %d iterations\n", path_names[path], iterations);
+        printf("\t[+] latency: p50 %f, mean %f, max %f\n", p50, sum / n_runs, latencies[n_runs - 1]);
+        printf("\t[+] overhead: %f (%.1f%%)\n", p50 - pointer_p50, 100.0 * (p50 - pointer_p50) / pointer_p50);
+    }
+
+    if (!socket_path) {
+        printf("[+] No daemon socket (-S), the daemon's paths were skipped\n");
+    }
+
+    unlink(FRAME_IN_PATH);
+    unlink(FRAME_OUT_PATH);
+
+    shared_buffer_release(&bench.shared);
+    kmeans_context_destroy(bench.ctx);
+    free(latencies);
+    free(bench.frame);
+    free(bench.out);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,25 @@
+#!/usr/bin/env bash
+
+# Iterations to convergence and seeding time of main_gpu's random, k-means++ and k-means|| seeding,
+# averaged over a few seeds
+seeds=${SEEDS:-"1 2 3 4 5"}
+clusters=${CLUSTERS:-"8 32"}
+images=${IMAGES:-"../imgs/input/bear_small.jpg ../imgs/input/bear_medium.jpg ../imgs/input/bear_large.jpg"}
+out=${OUT:-"/tmp/bench_seeding.jpg"}
+
+printf "%-32s %8s %10s %10s %10s %12s %12s %12s\n" "image" "clusters" "random" "kmeans++" "parallel" "seed_random" "seed_pp" "seed_par"
+
+for image in $images; do
+    for k in $clusters; do
+        iterations=""
+        seeding=""
+        for method in random kmeans++ parallel; do
+            result=$(for s in $seeds; do
+                ${RUN} ./main_gpu $image -o $out -k $k -s $s -i $method $FLAGS
+            done | awk '/\[\+\] iterations:/ {i += $3; n++} /seeding_time:/ {t += $3} END {if (n) printf "%.1f %.4f", i / n, t / n}')
+            iterations="$iterations ${result% *}"
+            seeding="$seeding ${result#* }"
+        done
+        printf "%-32s %8s %10s %10s %10s %12s %12s %12s\n" "$(basename $image)" $k $iterations $seeding
+    done
+done
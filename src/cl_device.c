@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "cl_device.h"
+
+typedef struct {
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_device_type type;
+    char name[256];
+} device_entry_t;
+
+const char *cl_error_string(cl_int status)
+{
+    switch (status) {
+    case 0: return "CL_SUCCESS";
+    case -1: return "CL_DEVICE_NOT_FOUND";
+    case -2: return "CL_DEVICE_NOT_AVAILABLE";
+    case -3: return "CL_COMPILER_NOT_AVAILABLE";
+    case -4: return "CL_MEM_OBJECT_ALLOCATION_FAILURE";
+    case -5: return "CL_OUT_OF_RESOURCES";
+    case -6: return "CL_OUT_OF_HOST_MEMORY";
+    case -7: return "CL_PROFILING_INFO_NOT_AVAILABLE";
+    case -11: return "CL_BUILD_PROGRAM_FAILURE";
+    case -14: return "CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST";
+    case -18: return "CL_DEVICE_PARTITION_FAILED";
+    case -30: return "CL_INVALID_VALUE";
+    case -32: return "CL_INVALID_PLATFORM";
+    case -33: return "CL_INVALID_DEVICE";
+    case -34: return "CL_INVALID_CONTEXT";
+    case -36: return "CL_INVALID_COMMAND_QUEUE";
+    case -37: return "CL_INVALID_HOST_PTR";
+    case -38: return "CL_INVALID_MEM_OBJECT";
+    case -42: return "CL_INVALID_BINARY";
+    case -44: return "CL_INVALID_PROGRAM";
+    case -45: return "CL_INVALID_PROGRAM_EXECUTABLE";
+    case -46: return "CL_INVALID_KERNEL_NAME";
+    case -48: return "CL_INVALID_KERNEL";
+    case -49: return "CL_INVALID_ARG_INDEX";
+    case -50: return "CL_INVALID_ARG_VALUE";
+    case -51: return "CL_INVALID_ARG_SIZE";
+    case -52: return "CL_INVALID_KERNEL_ARGS";
+    case -53: return "CL_INVALID_WORK_DIMENSION";
+    case -54: return "CL_INVALID_WORK_GROUP_SIZE";
+    case -55: return "CL_INVALID_WORK_ITEM_SIZE";
+    case -56: return "CL_INVALID_GLOBAL_OFFSET";
+    case -58: return "CL_INVALID_EVENT";
+    case -59: return "CL_INVALID_OPERATION";
+    case -61: return "CL_INVALID_BUFFER_SIZE";
+    case -63: return "CL_INVALID_GLOBAL_WORK_SIZE";
+    case -1001: return "CL_PLATFORM_NOT_FOUND_KHR";
+    default: return "unknown error";
+    }
+}
+
+void cl_check(cl_int status, const char *call, const char *file, int line)
+{
+    if (status != CL_SUCCESS) {
+        fprintf(stderr, "OPENCL ERROR: << %s failed with %s (%d) at %s:%d >> \n", call, cl_error_string(status), status, file, line);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static const char *device_type_name(cl_device_type type)
+{
+    if (type & CL_DEVICE_TYPE_GPU) {
+        return "gpu";
+    }
+    if (type & CL_DEVICE_TYPE_CPU) {
+        return "cpu";
+    }
+    if (type & CL_DEVICE_TYPE_ACCELERATOR) {
+        return "accelerator";
+    }
+    return "other";
+}
+
+// every device of every platform, in the order cl_list_devices numbers them
+static int enumerate_devices(device_entry_t *entries)
+{
+    cl_uint num_platforms = 0;
+    if (clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS || num_platforms == 0) {
+        return 0;
+    }
+
+    cl_platform_id *platforms = malloc(num_platforms * sizeof(cl_platform_id));
+    CL_CHECK(clGetPlatformIDs(num_platforms, platforms, NULL));
+
+    int n_entries = 0;
+    for (cl_uint p = 0; p < num_platforms && n_entries < CL_MAX_DEVICES; p++) {
+        cl_device_id devices[CL_MAX_DEVICES];
+        cl_uint num_devices = 0;
+
+        // a platform without devices reports CL_DEVICE_NOT_FOUND, that's not an error here
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, CL_MAX_DEVICES, devices, &num_devices) != CL_SUCCESS) {
+            continue;
+        }
+
+        for (cl_uint d = 0; d < num_devices && d < CL_MAX_DEVICES && n_entries < CL_MAX_DEVICES; d++) {
+            device_entry_t *entry = &entries[n_entries++];
+            entry->platform = platforms[p];
+            entry->device = devices[d];
+            CL_CHECK(clGetDeviceInfo(devices[d], CL_DEVICE_TYPE, sizeof(cl_device_type), &entry->type, NULL));
+            CL_CHECK(clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(entry->name), entry->name, NULL));
+        }
+    }
+
+    free(platforms);
+    return n_entries;
+}
+
+static int find_type(device_entry_t *entries, int n_entries, cl_device_type type)
+{
+    for (int i = 0; i < n_entries; i++) {
+        if (entries[i].type & type) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int contains_ignore_case(const char *haystack, const char *needle)
+{
+    size_t length = strlen(needle);
+
+    for (; *haystack; haystack++) {
+        if (strncasecmp(haystack, needle, length) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+cl_device_id cl_select_device(const char *spec)
+{
+    device_entry_t entries[CL_MAX_DEVICES];
+    int n_entries = enumerate_devices(entries);
+
+    if (n_entries == 0) {
+        fprintf(stderr, "OPENCL ERROR: << No OpenCL devices found >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (spec == NULL || *spec == '\0') {
+        spec = "gpu";
+    }
+
+    int selected = -1;
+    int is_index = 1;
+    for (const char *p = spec; *p; p++) {
+        is_index &= isdigit((unsigned char)*p) != 0;
+    }
+
+    if (is_index) {
+        selected = atoi(spec);
+        if (selected >= n_entries) {
+            selected = -1;
+        }
+    } else if (strcasecmp(spec, "all") == 0) {
+        selected = 0;
+    } else if (strcasecmp(spec, "cpu") == 0) {
+        selected = find_type(entries, n_entries, CL_DEVICE_TYPE_CPU);
+    } else if (strcasecmp(spec, "accelerator") == 0) {
+        selected = find_type(entries, n_entries, CL_DEVICE_TYPE_ACCELERATOR);
+    } else if (strcasecmp(spec, "gpu") == 0) {
+        selected = find_type(entries, n_entries, CL_DEVICE_TYPE_GPU);
+
+        // machines without a GPU still run the engine, e.g. on PoCL
+        if (selected < 0) {
+            selected = find_type(entries, n_entries, CL_DEVICE_TYPE_CPU);
+            if (selected < 0) {
+                selected = 0;
+            }
+            fprintf(stderr, "[!] No OpenCL GPU found, falling back to %s (%s)\n", entries[selected].name, device_type_name(entries[selected].type));
+        }
+    } else {
+        for (int i = 0; i < n_entries && selected < 0; i++) {
+            if (contains_ignore_case(entries[i].name, spec)) {
+                selected = i;
+            }
+        }
+    }
+
+    if (selected < 0) {
+        fprintf(stderr, "INPUT ERROR: << No OpenCL device matches '%s' >> \n", spec);
+        cl_list_devices(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    return entries[selected].device;
+}
+
+void cl_describe_device(cl_device_id device, FILE *out)
+{
+    char name[256];
+    char version[256];
+    cl_device_type type;
+    cl_uint compute_units;
+    size_t max_work_group_size;
+    cl_ulong global_mem_size;
+    cl_ulong max_alloc_size;
+
+    CL_CHECK(clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL));
+    CL_CHECK(clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(version), version, NULL));
+    CL_CHECK(clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL));
+    CL_CHECK(clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL));
+    CL_CHECK(clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_work_group_size), &max_work_group_size, NULL));
+    CL_CHECK(clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem_size), &global_mem_size, NULL));
+    CL_CHECK(clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc_size), &max_alloc_size, NULL));
+
+    fprintf(out, "%s [%s, %s] %u CUs, max workgroup %zu, %llu MB (max alloc %llu MB)\n", name, device_type_name(type), version, compute_units,
+            max_work_group_size, (unsigned long long)(global_mem_size >> 20), (unsigned long long)(max_alloc_size >> 20));
+}
+
+int cl_create_sub_devices(cl_device_id device, const char *domain, cl_device_id *sub_devices, int max_sub_devices)
+{
+    static const struct {
+        const char *name;
+        cl_device_affinity_domain domain;
+    } domains[] = {
+        { "numa", CL_DEVICE_AFFINITY_DOMAIN_NUMA },
+        { "l4", CL_DEVICE_AFFINITY_DOMAIN_L4_CACHE },
+        { "l3", CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE },
+        { "l2", CL_DEVICE_AFFINITY_DOMAIN_L2_CACHE },
+        { "l1", CL_DEVICE_AFFINITY_DOMAIN_L1_CACHE },
+        { "next", CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE },
+    };
+
+    cl_device_affinity_domain affinity = 0;
+    for (size_t i = 0; i < sizeof(domains) / sizeof(domains[0]); i++) {
+        if (strcasecmp(domain, domains[i].name) == 0) {
+            affinity = domains[i].domain;
+        }
+    }
+
+    if (!affinity) {
+        fprintf(stderr, "INPUT ERROR: << Unknown affinity domain '%s' >> \n", domain);
+        exit(EXIT_FAILURE);
+    }
+
+    cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, (cl_device_partition_property) affinity, 0 };
+    cl_uint n_sub_devices = 0;
+
+    // a device that isn't partitionable (most GPUs) or lacks the domain is not an error for the caller
+    cl_int status = clCreateSubDevices(device, properties, 0, NULL, &n_sub_devices);
+    if (status != CL_SUCCESS || n_sub_devices == 0) {
+        fprintf(stderr, "[!] The device can't be split by affinity domain '%s': %s (%d)\n", domain, cl_error_string(status), status);
+        return 0;
+    }
+
+    if ((int) n_sub_devices > max_sub_devices) {
+        fprintf(stderr, "[!] The device splits into %u sub-devices, more than %d\n", n_sub_devices, max_sub_devices);
+        return 0;
+    }
+
+    CL_CHECK(clCreateSubDevices(device, properties, n_sub_devices, sub_devices, NULL));
+
+    return (int) n_sub_devices;
+}
+
+void cl_list_devices(FILE *out)
+{
+    device_entry_t entries[CL_MAX_DEVICES];
+    int n_entries = enumerate_devices(entries);
+
+    fprintf(out, "[+] OpenCL devices: \n");
+    for (int i = 0; i < n_entries; i++) {
+        char platform[256];
+        CL_CHECK(clGetPlatformInfo(entries[i].platform, CL_PLATFORM_NAME, sizeof(platform), platform, NULL));
+
+        fprintf(out, "\t%d: (%s) ", i, platform);
+        cl_describe_device(entries[i].device, out);
+    }
+}
+
+size_t cl_kernel_local_size(cl_kernel kernel, cl_device_id device, size_t wanted, int power_of_two)
+{
+    size_t max_size;
+    size_t multiple;
+
+    CL_CHECK(clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max_size, NULL));
+    CL_CHECK(clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &multiple, NULL));
+
+    size_t size = wanted < max_size ? wanted : max_size;
+
+    if (power_of_two) {
+        size_t pow2 = 1;
+        while (pow2 * 2 <= size) {
+            pow2 *= 2;
+        }
+        return pow2;
+    }
+
+    if (multiple > 0 && size >= multiple) {
+        size -= size % multiple;
+    }
+
+    return size > 0 ? size : 1;
+}
+
+int cl_device_has_extension(cl_device_id device, const char *extension)
+{
+    size_t size;
+    CL_CHECK(clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &size));
+
+    char *extensions = malloc(size + 1);
+    CL_CHECK(clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, size, extensions, NULL));
+    extensions[size] = '\0';
+
+    // space separated names, so a name must not match only a prefix of a longer one
+    size_t length = strlen(extension);
+    int found = 0;
+
+    for (char *match = strstr(extensions, extension); match && !found; match = strstr(match + 1, extension)) {
+        found = (match == extensions || match[-1] == ' ') && (match[length] == ' ' || match[length] == '\0');
+    }
+
+    free(extensions);
+
+    return found;
+}
+
+cl_mem cl_create_buffer(cl_context context, cl_mem_flags flags, size_t size, void *host_ptr)
+{
+    cl_int status;
+    cl_mem buffer = clCreateBuffer(context, flags, size, host_ptr, &status);
+    CL_CHECK(status);
+
+    return buffer;
+}
+
+cl_kernel cl_create_kernel(cl_program program, const char *name)
+{
+    cl_int status;
+    cl_kernel kernel = clCreateKernel(program, name, &status);
+
+    if (status != CL_SUCCESS) {
+        fprintf(stderr, "OPENCL ERROR: << clCreateKernel(%s) failed with %s (%d) >> \n", name, cl_error_string(status), status);
+        exit(EXIT_FAILURE);
+    }
+
+    return kernel;
+}
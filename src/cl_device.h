@@ -0,0 +1,35 @@
+#ifndef CL_DEVICE_H
+#define CL_DEVICE_H
+
+#include <stdio.h>
+#include <CL/cl.h>
+
+#define CL_MAX_DEVICES 64
+
+// exits with the name of the failed call and the error when status isn't CL_SUCCESS
+#define CL_CHECK(status) cl_check((status), #status, __FILE__, __LINE__)
+
+void cl_check(cl_int status, const char *call, const char *file, int line);
+const char *cl_error_string(cl_int status);
+
+// spec: "gpu", "cpu", "accelerator", "all", an index from cl_list_devices, or part of a device
+// name; NULL means "gpu". A missing GPU falls back to a CPU device, then to any device.
+cl_device_id cl_select_device(const char *spec);
+void cl_list_devices(FILE *out);
+
+// device fission by affinity domain: "numa", "l4", "l3", "l2", "l1" or "next" (the next partitionable
+// one); returns the number of sub-devices, 0 when the device can't be split that way
+int cl_create_sub_devices(cl_device_id device, const char *domain, cl_device_id *sub_devices, int max_sub_devices);
+void cl_describe_device(cl_device_id device, FILE *out);
+
+// largest local size the kernel accepts on the device, at most wanted: a power of two for
+// kernels with tree reductions, otherwise a multiple of the preferred size multiple
+size_t cl_kernel_local_size(cl_kernel kernel, cl_device_id device, size_t wanted, int power_of_two);
+
+// whether the name is in the device's CL_DEVICE_EXTENSIONS
+int cl_device_has_extension(cl_device_id device, const char *extension);
+
+cl_mem cl_create_buffer(cl_context context, cl_mem_flags flags, size_t size, void *host_ptr);
+cl_kernel cl_create_kernel(cl_program program, const char *name);
+
+#endif
@@ -1,8 +1,141 @@
 #ifndef COMPRESSION_H
 #define COMPRESSION_H
 
+#include <stddef.h>
+#include <stdio.h>
+
+#include "arena.h"
+
+// work distribution of the CPU engine
+#define SCHEDULE_STATIC 0
+#define SCHEDULE_TILES 1
+#define SCHEDULE_PSTL 2
+
+#define KMEANS_MAX_CHANNELS 4
+
+// initial centers of the OpenCL engine
+#define SEEDING_RANDOM 0
+#define SEEDING_KMEANSPP 1
+#define SEEDING_PARALLEL 2
+
+typedef struct {
+    int n_clusters;
+    int max_iterations;
+    int n_threads;
+    int schedule;
+} kmeans_config_t;
+
+typedef struct {
+    int iterations;
+    double initialise_centers_time;
+    double assign_pixels_time;
+    double update_centers_time;
+    double update_data_time;
+    size_t workspace_bytes;
+} kmeans_stats_t;
+
+// palette and labels are owned by the context and stay valid until its next run
+typedef struct {
+    byte_t *palette;
+    int *labels;
+    int n_clusters;
+    int n_channels;
+    int n_pixels;
+    kmeans_stats_t stats;
+} kmeans_result_t;
+
+// reusable OpenMP engine: owns the workspace, the tile pool and the configuration
+typedef struct kmeans_context kmeans_context_t;
+
 void kmeans_compression(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations);
-void kmeans_compression_omp(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations, int n_threads);
-void kmeans_compression_gpu(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations);
+size_t kmeans_workspace_size_omp(int width, int height, int n_channels, int n_clusters, int n_threads);
+void kmeans_compression_omp(arena_t *arena, byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations, int n_threads, int schedule, kmeans_stats_t *stats);
+// NULL if the context can't be allocated
+kmeans_context_t *kmeans_context_create(const kmeans_config_t *config);
+// 0 if the image has more than KMEANS_MAX_CHANNELS channels or its workspace can't be mapped, the
+// context stays usable for other images
+int kmeans_context_compress(kmeans_context_t *ctx, byte_t *data, int width, int height, int n_channels, kmeans_result_t *result);
+// the compressed pixels go to out instead, data is only read; out == data is the same as kmeans_context_compress
+int kmeans_context_compress_to(kmeans_context_t *ctx, byte_t *data, byte_t *out, int width, int height, int n_channels, kmeans_result_t *result);
+// the next run draws its initial centers with rand_r from seed instead of rand(), so the result of
+// contexts running on several threads at once depends on their seeds alone
+void kmeans_context_seed(kmeans_context_t *ctx, unsigned int seed);
+void kmeans_context_report(kmeans_context_t *ctx, FILE *out);
+void kmeans_context_destroy(kmeans_context_t *ctx);
+
+typedef struct {
+    int resident_iterations;  // 0 syncs with the host after every kernel, N enqueues N iterations per batch
+    int fused;                // 1 assign_accumulate, 0 assign_pixels + accumulate_centers, -1 as the device's profile says
+    const char *device;       // see cl_select_device, NULL picks a GPU and falls back to a CPU device
+    int zero_copy;            // pixels in host memory mapped by the device instead of copied
+    int palette;              // read back palette indices (4 bits up to 16 clusters, else 8) and the palette instead of the pixels
+    int precision;            // 32 int kernels, 64 double/long kernels, 0 as the device's extensions allow
+    const char *fission;      // affinity domain to split a CPU device by (see cl_create_sub_devices), NULL for the whole device
+    long slab_pixels;         // 0 tiles only images the device can't hold in one piece, N streams slabs of N pixels
+    const char *trace;        // Chrome trace JSON of every device command and a profile summary, NULL doesn't profile
+    int seeding;              // SEEDING_RANDOM pixels picked on the host, SEEDING_KMEANSPP or SEEDING_PARALLEL (k-means||) on the device
+} gpu_options_t;
+
+void kmeans_compression_gpu(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations, const gpu_options_t *options);
+// a slab of pixels per sub-device with its own queue and buffers, the slabs' sums merged on the host
+void kmeans_compression_fission(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations, const gpu_options_t *options);
+
+typedef struct {
+    double setup_time;        // device, context, program and queues of the batch
+    double time;              // whole batch, setup included
+    long iterations;          // summed over the images
+    double *latencies;        // n_images entries provided by the caller: bind to readback of every image
+} gpu_batch_stats_t;
+
+// compresses the images in place on n_queues in-order queues of one context and program, an image per
+// queue at a time, so uploads and readbacks of some images overlap the iterations of others; reuse = 0
+// creates and releases the context and program for every image instead, like a process per image
+void kmeans_batch_gpu(byte_t **images, const int *widths, const int *heights, const int *channels, int n_images, int n_clusters, int max_iterations,
+                      int n_queues, int reuse, const gpu_options_t *options, gpu_batch_stats_t *stats);
+
+typedef struct {
+    gpu_options_t gpu;        // device and kernel variant of the device's share
+    int n_threads;            // OpenMP threads of the CPU's share
+    double device_share;      // initial fraction of the pixels on the device, 0 CPU only, 1 device only
+    int rebalance;            // move the split towards the measured rates after every iteration
+} hybrid_options_t;
+
+typedef struct {
+    int iterations;
+    int rebalances;
+    int split;                // final split: the device has the pixels before it, the CPU the rest
+    double device_share;
+    double device_time;       // summed per-iteration times of both sides, which run at the same time
+    double cpu_time;
+    double merge_time;        // merging the partial sums, new centers and reseeding on the host
+    double loop_time;
+    double device_rate;       // pixels per second of either side in the last measured iteration
+    double cpu_rate;
+} hybrid_stats_t;
+
+// splits the pixels between an OpenCL device and the OpenMP threads, merging their partial center
+// sums every iteration
+void kmeans_compression_hybrid(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations, const hybrid_options_t *options, hybrid_stats_t *stats);
+
+typedef struct {
+    int n_ranks;
+    int iterations;
+    int slab_rows;            // rows of the largest slab
+    double scatter_time;      // centers broadcast, slabs scattered
+    double compute_time;      // assign and partial sums on the slowest rank, summed over the iterations
+    double comm_time;         // allreduce and reseeding on the rank that waited longest, summed likewise
+    double gather_time;       // compressed slabs back to the root
+    double loop_time;
+    double *iteration_compute;  // max_iterations entries provided by the caller, per-iteration maximum over the ranks; may be NULL
+    double *iteration_comm;
+} mpi_stats_t;
+
+// row slabs of the image on every rank of MPI_COMM_WORLD, each runs the OpenMP kernels on its own and
+// the ranks allreduce their partial sums every iteration; collective, data and the image size are only
+// read on rank 0, where the compressed image ends up and stats are filled in
+void kmeans_compression_mpi(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations, int n_threads, mpi_stats_t *stats);
+
+// sweeps the launch parameters on a calibration image and stores the fastest in the device's profile
+void kmeans_autotune_gpu(byte_t *data, int width, int height, int n_channels, int n_clusters, const gpu_options_t *options);
 
 #endif
\ No newline at end of file
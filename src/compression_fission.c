@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <omp.h>
+#include <CL/cl.h>
+
+#include "image_io.h"
+#include "compression.h"
+#include "cl_device.h"
+#include "gpu_engine.h"
+
+#define FISSION_MAX_SUB_DEVICES 64
+
+void kmeans_compression_fission(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations, const gpu_options_t *options)
+{
+    int n_pixels = width * height;
+    int n_values = n_clusters * n_channels;
+
+    // Device, split into one sub-device per affinity domain (e.g. a socket); a device that can't be
+    // split runs as a single slab, which is the plain engine with the merge on the host
+    cl_device_id device = cl_select_device(options->device);
+    cl_device_id sub_devices[FISSION_MAX_SUB_DEVICES];
+    int n_slabs = cl_create_sub_devices(device, options->fission, sub_devices, FISSION_MAX_SUB_DEVICES);
+    int fissioned = n_slabs > 0;
+    if (!fissioned) {
+        sub_devices[0] = device;
+        n_slabs = 1;
+    }
+
+    printf("[+] Device: ");
+    cl_describe_device(device, stdout);
+    printf("[+] Fission: %d sub-devices by affinity domain '%s'\n", fissioned ? n_slabs : 0, options->fission);
+
+    long *centers = malloc(n_values * sizeof(long));
+    long *sums = malloc(n_values * sizeof(long));
+    int *counts = malloc(n_clusters * sizeof(int));
+    long *slab_sums = malloc(n_slabs * n_values * sizeof(long));
+    int *slab_counts = malloc(n_slabs * n_clusters * sizeof(int));
+    cl_long *rings = malloc(n_slabs * RING_FIELDS * sizeof(cl_long));
+    double *distances = malloc(n_pixels * sizeof(double));
+    double *slab_time = calloc(n_slabs, sizeof(double));
+    int *first = malloc((n_slabs + 1) * sizeof(int));
+    gpu_engine_t *engines = malloc(n_slabs * sizeof(gpu_engine_t));
+    cl_event *first_events = malloc(n_slabs * sizeof(cl_event));
+    cl_event *last_events = malloc(n_slabs * sizeof(cl_event));
+
+    gpu_initialise_centers(data, centers, n_pixels, n_channels, n_clusters);
+
+    // every sub-device gets a contiguous slab of pixels, a queue and buffers of its own
+    double transfer_data_time = omp_get_wtime();
+    for (int slab = 0; slab <= n_slabs; slab++) {
+        first[slab] = (int) ((long) n_pixels * slab / n_slabs);
+    }
+
+    for (int slab = 0; slab < n_slabs; slab++) {
+        gpu_engine_t *engine = &engines[slab];
+        gpu_engine_init_device(engine, sub_devices[slab], options->precision, CL_QUEUE_PROFILING_ENABLE);
+
+        gpu_tuning_t tuning = engine->tuning;
+        tuning.fused = 1;
+        gpu_engine_tune(engine, &tuning);
+
+        engine->host_reduce = 1;
+        gpu_engine_bind(engine, &data[(size_t) first[slab] * n_channels], centers, first[slab + 1] - first[slab], n_channels, n_clusters, 1);
+    }
+    transfer_data_time = omp_get_wtime() - transfer_data_time;
+
+    double merge_time = 0;
+    double loop_time = omp_get_wtime();
+    int iterations = 0;
+
+    for (int i = 0; i < max_iterations; i++) {
+        iterations++;
+
+        // all slabs assign and accumulate at the same time
+        for (int slab = 0; slab < n_slabs; slab++) {
+            gpu_engine_t *engine = &engines[slab];
+            cl_long zero = 0;
+
+            gpu_engine_write_centers(engine, centers);
+            CL_CHECK(clEnqueueFillBuffer(engine->queue, engine->ring, &zero, sizeof(cl_long), 0, RING_FIELDS * sizeof(cl_long), 0, NULL, NULL));
+            gpu_enqueue_assign(engine, 0, &first_events[slab]);
+            gpu_enqueue_read_partials(engine, &slab_sums[slab * n_values], &slab_counts[slab * n_clusters], &rings[slab * RING_FIELDS], &last_events[slab]);
+        }
+
+        // the sub-devices have contexts of their own, so their events are waited for one by one
+        long changed = 0;
+        for (int slab = 0; slab < n_slabs; slab++) {
+            CL_CHECK(clWaitForEvents(1, &last_events[slab]));
+            slab_time[slab] += gpu_event_span(first_events[slab], last_events[slab]);
+            changed += rings[slab * RING_FIELDS];
+
+            clReleaseEvent(first_events[slab]);
+            clReleaseEvent(last_events[slab]);
+        }
+
+        // if clusters haven't changed, they won't change in the next iteration as well, so just stop early
+        if (!changed) {
+            break;
+        }
+
+        // Merge the slabs' sums and compute the new centers
+        double start_time = omp_get_wtime();
+        int empty = 0;
+        for (int j = 0; j < n_values; j++) {
+            sums[j] = 0;
+        }
+        for (int cluster = 0; cluster < n_clusters; cluster++) {
+            counts[cluster] = 0;
+        }
+        for (int slab = 0; slab < n_slabs; slab++) {
+            for (int j = 0; j < n_values; j++) {
+                sums[j] += slab_sums[slab * n_values + j];
+            }
+            for (int cluster = 0; cluster < n_clusters; cluster++) {
+                counts[cluster] += slab_counts[slab * n_clusters + cluster];
+            }
+        }
+        for (int cluster = 0; cluster < n_clusters; cluster++) {
+            empty += counts[cluster] == 0;
+        }
+
+        // reseeding needs every distance, which is rare enough to read them back
+        if (empty) {
+            for (int slab = 0; slab < n_slabs; slab++) {
+                gpu_engine_read_distances(&engines[slab], &distances[first[slab]]);
+            }
+        }
+        gpu_host_centers(data, centers, sums, counts, distances, n_pixels, n_channels, n_clusters);
+        merge_time += omp_get_wtime() - start_time;
+    }
+    loop_time = omp_get_wtime() - loop_time;
+
+    // Write the compressed pixels, every slab its own
+    double update_data_time = omp_get_wtime();
+    for (int slab = 0; slab < n_slabs; slab++) {
+        gpu_engine_write_centers(&engines[slab], centers);
+        gpu_enqueue_update_data(&engines[slab], NULL);
+        CL_CHECK(clFlush(engines[slab].queue));
+    }
+    for (int slab = 0; slab < n_slabs; slab++) {
+        gpu_engine_read_data(&engines[slab], &data[(size_t) first[slab] * n_channels]);
+    }
+    update_data_time = omp_get_wtime() - update_data_time;
+
+    program_cache_info_t *build_info = &engines[0].build_info;
+    printf("[+] Printing times: \n");
+    printf("\t[+] build_program_time: %f (%s)\n", build_info->build_time, build_info->hit ? "cached binary" : build_info->stored ? "compiled, cached" : "compiled");
+    printf("\t[+] transfer_data_time: %f\n", transfer_data_time);
+    printf("\t[+] merge_time: %f\n", merge_time);
+    printf("\t[+] update_data_time: %f\n", update_data_time);
+    printf("\t[+] loop_time: %f\n", loop_time);
+    printf("\t[+] iterations: %d\n", iterations);
+    printf("\t[+] throughput: %.2f Mpixels/s (%d-bit kernels)\n", loop_time > 0 ? (double)n_pixels * iterations / loop_time / 1e6 : 0, engines[0].precision);
+    for (int slab = 0; slab < n_slabs; slab++) {
+        printf("\t[+] slab %d: %d pixels, busy %f\n", slab, first[slab + 1] - first[slab], slab_time[slab]);
+    }
+    fflush(stdout);
+
+    for (int slab = 0; slab < n_slabs; slab++) {
+        gpu_engine_release(&engines[slab]);
+        if (fissioned) {
+            CL_CHECK(clReleaseDevice(sub_devices[slab]));
+        }
+    }
+
+    free(last_events);
+    free(first_events);
+    free(engines);
+    free(first);
+    free(slab_time);
+    free(distances);
+    free(rings);
+    free(slab_counts);
+    free(slab_sums);
+    free(counts);
+    free(sums);
+    free(centers);
+}
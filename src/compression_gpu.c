@@ -7,323 +7,427 @@
 
 #include "image_io.h"
 #include "compression.h"
+#include "cl_device.h"
+#include "gpu_engine.h"
 
-#define MAX_SOURCE_SIZE	(16384)
 #define BINS 256
-#define WORKGROUP_SIZE  (1024)
+#define TUNE_RUNS 5
+// k-means|| rounds and candidates per round per cluster
+#define SEED_ROUNDS 5
+#define SEED_OVERSAMPLING 2
 
-void initialise_centers(byte_t *data, long *centers, int n_pixels, int n_channels, int n_clusters);
+int kmeans_compression_tiled(gpu_engine_t *engine, byte_t *data, long n_pixels, int n_channels, int n_clusters, int max_iterations, const long *initial_centers, const gpu_options_t *options);
 
-void kmeans_compression_gpu(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations) {
+// -f overrides whatever strategy the device's profile picked
+static void override_tuning(gpu_engine_t *engine, const gpu_options_t *options)
+{
+    if (options->fused >= 0) {
+        gpu_tuning_t tuning = engine->tuning;
+        tuning.fused = options->fused;
+        gpu_engine_tune(engine, &tuning);
+    }
+}
 
-    double start_time = 0;
-    int n_pixels = width * height;
-    int *labels = (int*) malloc(n_pixels * sizeof(int));
-    long *centers = (long*) malloc(n_clusters * n_channels * sizeof(long));
-    double *distances = (double*) malloc(n_pixels * sizeof(double));
-    int *counts = (int*) malloc(n_clusters * sizeof(int));
-    int changed = 0;
-
-    initialise_centers(data, centers, n_pixels, n_channels, n_clusters);
-
-    // printf("[+] Reading the kernel...\n");
-    // fflush(stdout);
-    FILE *kernel_fp = fopen("kernel_gpu.cl", "r");
-    if (!kernel_fp)
-    {
-        fprintf(stderr, "\t [-] Error loading the kernel\n");
-        exit(1);
+// the timeline of every command and where the device time went per iteration
+static void report_trace(gpu_trace_t *trace, const gpu_options_t *options, int iterations)
+{
+    if (options->trace) {
+        gpu_trace_summary(trace, iterations, stdout);
+        if (gpu_trace_write_chrome(trace, options->trace)) {
+            printf("[+] Trace: %s\n", options->trace);
+        }
+        fflush(stdout);
     }
 
-    char *source_str = (char*)malloc(MAX_SOURCE_SIZE);
-    size_t source_size = fread(source_str, 1, MAX_SOURCE_SIZE, kernel_fp);
-    source_str[source_size] = '\0';
-
-    fclose(kernel_fp);
-
-    // Get platforms
-    cl_uint num_platforms;
-    cl_int clStatus = clGetPlatformIDs(0, NULL, &num_platforms);
-    cl_platform_id *platforms = (cl_platform_id *)malloc(sizeof(cl_platform_id)*num_platforms);
-    clStatus = clGetPlatformIDs(num_platforms, platforms, NULL);
-
-    //Get platform devices
-    cl_uint num_devices;
-    clStatus = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 0, NULL, &num_devices);
-    num_devices = 1; // limit to one device
-    cl_device_id *devices = (cl_device_id *)malloc(sizeof(cl_device_id)*num_devices);
-    clStatus = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, num_devices, devices, NULL);
-
-    // Context
-    cl_context context = clCreateContext(NULL, num_devices, devices, NULL, NULL, &clStatus);
-
-    // Command queue
-    cl_command_queue command_queue = clCreateCommandQueue(context, devices[0], 0, &clStatus);
-
-    // Create and build a program
-    // printf("[+] Creating and building the program: ");
-    // fflush(stdout);
-    cl_program program = clCreateProgramWithSource(context,	1, (const char **)&source_str, NULL, &clStatus);
-    clStatus = clBuildProgram(program, 1, devices, NULL, NULL, NULL);
-    // printf("%s\n", clStatus);
-    // fflush(stdout);
-
-    // Log
-    size_t build_log_len;
-    clStatus = clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &build_log_len);
-    if (build_log_len > 2)
-    {
-        char *build_log =(char *)malloc(sizeof(char)*(build_log_len+1));
-        clStatus = clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG,
-                                         build_log_len, build_log, NULL);
-        printf("%s", build_log);
-        free(build_log);
+    gpu_trace_release(trace);
+}
+
+void kmeans_compression_gpu(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations, const gpu_options_t *options) {
+
+    // NUMA-local slabs on the sub-devices of a CPU device
+    if (options->fission) {
+        kmeans_compression_fission(data, width, height, n_channels, n_clusters, max_iterations, options);
         return;
     }
 
-    // Divide work
-    size_t local_item_size = WORKGROUP_SIZE;
-    size_t num_groups = ((n_pixels - 1) / local_item_size + 1);
-    size_t global_item_size = num_groups * local_item_size;
+    double start_time = 0;
+    long n_pixels = (long) width * height;
+    long *centers = (long*) malloc(n_clusters * n_channels * sizeof(long));
+
+    // resident mode enqueues a batch of iterations without waiting, two batches can be in flight
+    int batch_size = options->resident_iterations > 0 ? options->resident_iterations : 1;
+    int ring_slots = 2 * batch_size;
+    cl_long *ring = (cl_long*) calloc(ring_slots * RING_FIELDS, sizeof(cl_long));
+
+    gpu_initialise_centers(data, centers, n_pixels, n_channels, n_clusters);
+
+    // the wall-clock times below include queueing and launches, the trace has the device's own timestamps
+    gpu_trace_t trace;
+    gpu_trace_init(&trace);
+
+    gpu_engine_t engine;
+    gpu_engine_init(&engine, options->device, options->precision, options->trace ? CL_QUEUE_PROFILING_ENABLE : 0);
+    engine.trace = options->trace ? &trace : NULL;
+    printf("[+] Device: ");
+    cl_describe_device(engine.device, stdout);
+    printf("[+] Kernels: %s\n", engine.precision == GPU_PRECISION_INT32 ? "int32 distances, emulated 64-bit atomics" : "double distances, 64-bit atomics");
+    override_tuning(&engine, options);
+
+    // images beyond the device's allocation limits are streamed through it in slabs
+    if (options->slab_pixels > 0 || !gpu_engine_fits(&engine, n_pixels, n_channels)) {
+        int iterations = kmeans_compression_tiled(&engine, data, n_pixels, n_channels, n_clusters, max_iterations, centers, options);
+        report_trace(&trace, options, iterations);
+        gpu_engine_release(&engine);
+        free(ring);
+        free(centers);
+        return;
+    }
+    int fused = engine.tuning.fused;
 
     // Transfer data from host
-    start_time = omp_get_wtime();
-    cl_mem data_ = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, n_pixels * n_channels * sizeof(byte_t), data, &clStatus);
-    cl_mem centers_ = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR , n_clusters * n_channels * sizeof(long), centers, &clStatus);
-    cl_mem labels_ = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR , n_pixels * sizeof(int), labels, &clStatus);
-    cl_mem distances_ = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR , n_pixels * sizeof(double), distances, &clStatus);
-    cl_mem changed_ = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR , sizeof(int), &changed, &clStatus);
-    cl_mem counts_ = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR , n_clusters * sizeof(int), counts, &clStatus);
-
-    // printf("[+] Creating kernels:\n");
-    // printf("\t[+] Creating assign_pixels kernel: ");
-    // fflush(stdout);
-    cl_kernel assign_pixels_kernel = clCreateKernel(program, "assign_pixels", &clStatus);
-    clStatus = clSetKernelArg(assign_pixels_kernel, 0, sizeof(cl_mem), (void *) &data_);
-    clStatus |= clSetKernelArg(assign_pixels_kernel, 1, sizeof(cl_mem), (void *) &centers_);
-    clStatus |= clSetKernelArg(assign_pixels_kernel, 2, sizeof(cl_mem), (void *) &labels_);
-    clStatus |= clSetKernelArg(assign_pixels_kernel, 3, sizeof(cl_mem), (void *) &distances_);
-    clStatus |= clSetKernelArg(assign_pixels_kernel, 4, sizeof(cl_mem), (void *) &changed_);
-    clStatus |= clSetKernelArg(assign_pixels_kernel, 5, sizeof(cl_int), (void *) &n_pixels);
-    clStatus |= clSetKernelArg(assign_pixels_kernel, 6, sizeof(cl_int), (void *) &n_channels);
-    clStatus |= clSetKernelArg(assign_pixels_kernel, 7, sizeof(cl_int), (void *) &n_clusters);
-    // printf("%s\n", clStatus);
-    // fflush(stdout);
-
-    // printf("\t[+] Creating partial_sum_centers kernel: ");
-    // fflush(stdout);
-    cl_kernel partial_sum_centers_kernel = clCreateKernel(program, "partial_sum_centers", &clStatus);
-    clStatus = clSetKernelArg(partial_sum_centers_kernel, 0, sizeof(cl_mem), (void *) &data_);
-    clStatus |= clSetKernelArg(partial_sum_centers_kernel, 1, sizeof(cl_mem), (void *) &centers_);
-    clStatus |= clSetKernelArg(partial_sum_centers_kernel, 2, sizeof(cl_mem), (void *) &labels_);
-    clStatus |= clSetKernelArg(partial_sum_centers_kernel, 3, sizeof(cl_mem), (void *) &distances_);
-    clStatus |= clSetKernelArg(partial_sum_centers_kernel, 4, sizeof(cl_int), (void *) &n_pixels);
-    clStatus |= clSetKernelArg(partial_sum_centers_kernel, 5, sizeof(cl_int), (void *) &n_channels);
-    clStatus |= clSetKernelArg(partial_sum_centers_kernel, 6, sizeof(cl_int), (void *) &n_clusters);
-	clStatus |= clSetKernelArg(partial_sum_centers_kernel, 7, sizeof(cl_mem), (void *) &counts_);
-    // printf("%s\n", clStatus);
-    // fflush(stdout);
-
-    // Divide work - partial_sum_centers_new
-    size_t local_item_size_partial_sum_centers = WORKGROUP_SIZE - (WORKGROUP_SIZE % ((n_channels + 1) * n_clusters));
-    size_t num_groups_partial_sum_centers = ((n_pixels * (n_channels + 1) * n_clusters - 1) / local_item_size_partial_sum_centers + 1);
-    size_t global_item_size_partial_sum_centers = num_groups_partial_sum_centers * local_item_size_partial_sum_centers;
-
-    // printf("\t[+] Creating partial_sum_centers_new kernel: ");
-    // fflush(stdout);
-    cl_kernel partial_sum_centers_kernel_new = clCreateKernel(program, "partial_sum_centers_new", &clStatus);
-    clStatus = clSetKernelArg(partial_sum_centers_kernel_new, 0, sizeof(cl_mem), (void *) &data_);
-    clStatus |= clSetKernelArg(partial_sum_centers_kernel_new, 1, sizeof(cl_mem), (void *) &centers_);
-    clStatus |= clSetKernelArg(partial_sum_centers_kernel_new, 2, sizeof(cl_mem), (void *) &labels_);
-    clStatus |= clSetKernelArg(partial_sum_centers_kernel_new, 3, sizeof(cl_mem), (void *) &distances_);
-    clStatus |= clSetKernelArg(partial_sum_centers_kernel_new, 4, sizeof(cl_int), (void *) &n_pixels);
-    clStatus |= clSetKernelArg(partial_sum_centers_kernel_new, 5, sizeof(cl_int), (void *) &n_channels);
-    clStatus |= clSetKernelArg(partial_sum_centers_kernel_new, 6, sizeof(cl_int), (void *) &n_clusters);
-	clStatus |= clSetKernelArg(partial_sum_centers_kernel_new, 7, sizeof(cl_mem), (void *) &counts_);
-    // LOCAL
-	clStatus |= clSetKernelArg(partial_sum_centers_kernel_new, 8, local_item_size_partial_sum_centers * sizeof(int), NULL);
-    // printf("%s\n", clStatus);
-    // fflush(stdout);
-
-    // printf("\t[+] Creating centers_mean kernel: ");
-    // fflush(stdout);
-    cl_kernel centers_mean_kernel = clCreateKernel(program, "centers_mean", &clStatus);
-    clStatus = clSetKernelArg(centers_mean_kernel, 0, sizeof(cl_mem), (void *) &data_);
-    clStatus |= clSetKernelArg(centers_mean_kernel, 1, sizeof(cl_mem), (void *) &centers_);
-    clStatus |= clSetKernelArg(centers_mean_kernel, 2, sizeof(cl_mem), (void *) &distances_);
-	clStatus |= clSetKernelArg(centers_mean_kernel, 3, sizeof(cl_mem), (void *) &counts_);
-    clStatus |= clSetKernelArg(centers_mean_kernel, 4, sizeof(cl_int), (void *) &n_pixels);
-    clStatus |= clSetKernelArg(centers_mean_kernel, 5, sizeof(cl_int), (void *) &n_channels);
-    clStatus |= clSetKernelArg(centers_mean_kernel, 6, sizeof(cl_int), (void *) &n_clusters);
-    // LOCAL
-    // clStatus |= clSetKernelArg(centers_mean_kernel, 7, local_item_size * sizeof(double), NULL);
-    // clStatus |= clSetKernelArg(centers_mean_kernel, 8, local_item_size * sizeof(int), NULL);
-    // printf("%s\n", clStatus);
-    // fflush(stdout);
-
-    // printf("\t[+] Creating centers_mean_new kernel: ");
-    // fflush(stdout);
-    // cl_kernel centers_mean_kernel_new = clCreateKernel(program, "centers_mean_new", &clStatus);
-    // clStatus = clSetKernelArg(centers_mean_kernel_new, 0, sizeof(cl_mem), (void *) &data_);
-    // clStatus |= clSetKernelArg(centers_mean_kernel_new, 1, sizeof(cl_mem), (void *) &centers_);
-    // clStatus |= clSetKernelArg(centers_mean_kernel_new, 2, sizeof(cl_mem), (void *) &distances_);
-	// clStatus |= clSetKernelArg(centers_mean_kernel_new, 3, sizeof(cl_mem), (void *) &counts_);
-    // clStatus |= clSetKernelArg(centers_mean_kernel_new, 4, sizeof(cl_int), (void *) &n_pixels);
-    // clStatus |= clSetKernelArg(centers_mean_kernel_new, 5, sizeof(cl_int), (void *) &n_channels);
-    // clStatus |= clSetKernelArg(centers_mean_kernel_new, 6, sizeof(cl_int), (void *) &n_clusters);
-    // printf("%s\n", clStatus);
-    // fflush(stdout);
-
-    // printf("\t[+] Creating update_data kernel: ");
-    // fflush(stdout);
-    cl_kernel update_data_kernel = clCreateKernel(program, "update_data", &clStatus);
-    clStatus = clSetKernelArg(update_data_kernel, 0, sizeof(cl_mem), (void *) &data_);
-    clStatus |= clSetKernelArg(update_data_kernel, 1, sizeof(cl_mem), (void *) &centers_);
-    clStatus |= clSetKernelArg(update_data_kernel, 2, sizeof(cl_mem), (void *) &labels_);
-    clStatus |= clSetKernelArg(update_data_kernel, 3, sizeof(cl_int), (void *) &n_pixels);
-    clStatus |= clSetKernelArg(update_data_kernel, 4, sizeof(cl_int), (void *) &n_channels);
-    // printf("%s\n", clStatus);
-    // fflush(stdout);
-
-    double transfer_data_time = omp_get_wtime() - start_time;
+    engine.zero_copy = options->zero_copy;
+    // the image fits, so its pixels and bytes are in int range
+    gpu_engine_bind(&engine, data, centers, (int) n_pixels, n_channels, n_clusters, ring_slots);
+    double transfer_data_time = engine.upload_time;
+    int host_ptr = engine.host_ptr;
+
+    // better initial centers from the device, replacing the random ones
+    double seeding_time = 0;
+    if (options->seeding != SEEDING_RANDOM) {
+        start_time = omp_get_wtime();
+        if (options->seeding == SEEDING_KMEANSPP) {
+            gpu_engine_seed_plusplus(&engine, centers);
+        } else {
+            gpu_engine_seed_parallel(&engine, centers, SEED_ROUNDS, SEED_OVERSAMPLING * n_clusters);
+        }
+        gpu_engine_write_centers(&engine, centers);
+        seeding_time = omp_get_wtime() - start_time;
+    }
 
+    cl_command_queue command_queue = engine.queue;
     double assign_pixels_time = 0;
     double read_changed_time = 0;
-    double partial_sum_centers_time = 0;
-    double partial_sum_centers_time_new = 0;
+    double accumulate_centers_time = 0;
+    double assign_accumulate_time = 0;
     double centers_mean_time = 0;
     double update_data_time = 0;
     double read_updated_data_time = 0;
+    double host_sync_time = 0;
+    double loop_time = omp_get_wtime();
+    int iterations = 0;
+    cl_long zero = 0;
+
+    if (options->resident_iterations <= 0) {
+        for (int i = 0; i < max_iterations; i++) {
+            int slot = 0;
+            iterations++;
+
+            start_time = omp_get_wtime();
+            gpu_enqueue_fill(&engine, "fill ring", engine.ring, &zero, sizeof(cl_long), 0, RING_FIELDS * sizeof(cl_long));
+            gpu_enqueue_assign(&engine, slot, NULL);
+            CL_CHECK(clFinish(command_queue));
+            if (fused) {
+                assign_accumulate_time += omp_get_wtime() - start_time;
+            } else {
+                assign_pixels_time += omp_get_wtime() - start_time;
+            }
+
+            start_time = omp_get_wtime();
+            gpu_enqueue_read(&engine, "read ring", engine.ring, CL_TRUE, 0, RING_FIELDS * sizeof(cl_long), ring, NULL);
+            read_changed_time += omp_get_wtime() - start_time;
+
+            // if clusters haven't changed, they won't change in the next iteration as well, so just stop early
+            if (!ring[0]) {
+                break;
+            }
+
+            if (!fused) {
+                start_time = omp_get_wtime();
+                gpu_enqueue_accumulate(&engine, slot, NULL);
+                CL_CHECK(clFinish(command_queue));
+                accumulate_centers_time += omp_get_wtime() - start_time;
+            }
+
+            start_time = omp_get_wtime();
+            gpu_enqueue_centers_update(&engine, slot);
+            CL_CHECK(clFinish(command_queue));
+            centers_mean_time += omp_get_wtime() - start_time;
+        }
 
-    for (int i = 0; i < max_iterations; i++) {
+        host_sync_time = assign_pixels_time + read_changed_time + accumulate_centers_time + assign_accumulate_time + centers_mean_time;
+    } else {
+        // device-resident loop: kernels of a whole batch go back to back, the host only looks at the
+        // ring of the previous batch while the current one is running
+        iterations = gpu_engine_run(&engine, max_iterations, batch_size, ring, &host_sync_time);
+    }
+    loop_time = omp_get_wtime() - loop_time;
 
-        // printf("### Loop %d ###\n", i);
-        // printf("[+] Starting assign_pixels kernel: ");
-        // fflush(stdout);
-        start_time = omp_get_wtime();
-        clStatus = clEnqueueNDRangeKernel(command_queue, assign_pixels_kernel, 1, NULL, &global_item_size, &local_item_size, 0, NULL, NULL);
-        clStatus = clFinish(command_queue);
-        assign_pixels_time += omp_get_wtime() - start_time;
-        // printf("%s\n", clStatus);
-        // fflush(stdout);
-        
-        // printf("[+] Copying changed to host: ");
-        // fflush(stdout);
-        start_time = omp_get_wtime();
-        clStatus = clEnqueueReadBuffer(command_queue, changed_, CL_TRUE, 0, sizeof(int), &changed, 0, NULL, NULL);
-        read_changed_time += omp_get_wtime() - start_time;
-        // printf("%s\n", clStatus);
-        // // printf("\t[+] Changed: %d\n", changed);
-        // fflush(stdout);
-
-        // if clusters haven't changed, they won't change in the next iteration as well, so just stop early
-        if (!changed) {
-            break;
-        }
+    // palette indices (4 or 8 bits) and the palette are less to move than the expanded pixels
+    int palette = options->palette && n_clusters <= 256;
 
-        // printf("[+] Starting partial_sum_centers kernel: ");
-        // fflush(stdout);
-        // start_time = omp_get_wtime();
-        // clStatus = clEnqueueNDRangeKernel(command_queue, partial_sum_centers_kernel, 1, NULL, &global_item_size, &local_item_size, 0, NULL, NULL);
-        // clStatus = clFinish(command_queue);
-        // partial_sum_centers_time += omp_get_wtime() - start_time;
-        // printf("%s\n", clStatus);
-        // fflush(stdout);
-
-        // printf("[+] Starting partial_sum_centers_new kernel: ");
-        // fflush(stdout);
-        start_time = omp_get_wtime();
-        clStatus = clEnqueueNDRangeKernel(command_queue, partial_sum_centers_kernel_new, 1, NULL, &global_item_size_partial_sum_centers, &local_item_size_partial_sum_centers, 0, NULL, NULL);
-        clStatus = clFinish(command_queue);
-        partial_sum_centers_time_new += omp_get_wtime() - start_time;
-        // printf("%s\n", clStatus);
-        // fflush(stdout);
-
-        // printf("[+] Starting centers_mean kernel: ");
-        // fflush(stdout);
+    if (palette) {
+        gpu_engine_read_palette(&engine, data);
+    } else {
         start_time = omp_get_wtime();
-        clStatus = clEnqueueNDRangeKernel(command_queue, centers_mean_kernel, 1, NULL, &global_item_size, &local_item_size, 0, NULL, NULL);
-        clStatus = clFinish(command_queue);
-        centers_mean_time += omp_get_wtime() - start_time;
-        // printf("%s\n", clStatus);
-        // fflush(stdout);
-    }
+        gpu_enqueue_update_data(&engine, NULL);
+        CL_CHECK(clFinish(command_queue));
+        update_data_time += omp_get_wtime() - start_time;
 
-    // printf("[+] Starting update_data kernel: ");
-    // fflush(stdout);
-    start_time = omp_get_wtime();
-    clStatus = clEnqueueNDRangeKernel(command_queue, update_data_kernel, 1, NULL, &global_item_size, &local_item_size, 0, NULL, NULL);
-    clStatus = clFinish(command_queue);
-    update_data_time += omp_get_wtime() - start_time;
-    // printf("%s\n", clStatus);
-    // fflush(stdout);
-
-
-    // printf("[+] Copying update data to host: ");
-    // fflush(stdout);
-    start_time = omp_get_wtime();
-    clStatus = clEnqueueReadBuffer(command_queue, data_, CL_TRUE, 0, n_pixels * n_channels * sizeof(byte_t), data, 0, NULL, NULL);
-    clStatus = clFinish(command_queue);
-    read_updated_data_time = omp_get_wtime() - start_time;
-    // printf("%s\n", clStatus);
-
-    // printf("\t[+] Updated data: ");
-    // for (int pixel = 0; pixel < 20; pixel++) {
-    //     for (int channel = 0; channel < n_channels; channel++) {
-    //         printf("%d ", data[pixel * n_channels + channel]);
-    //     }
-    //     printf("| ");
-    // }
-    // printf("\n");
-    // fflush(stdout);
+        gpu_engine_read_data(&engine, data);
+    }
+    read_updated_data_time = engine.download_time;
 
+    program_cache_info_t *build_info = &engine.build_info;
     printf("[+] Printing times: \n");
+    printf("\t[+] build_program_time: %f (%s)\n", build_info->build_time, build_info->hit ? "cached binary" : build_info->stored ? "compiled, cached" : "compiled");
     printf("\t[+] transfer_data_time: %f\n", transfer_data_time);
+    printf("\t[+] seeding_time: %f (%s)\n", seeding_time,
+           options->seeding == SEEDING_KMEANSPP ? "k-means++" : options->seeding == SEEDING_PARALLEL ? "k-means||" : "random");
     printf("\t[+] assign_pixels_time: %f\n", assign_pixels_time);
     printf("\t[+] read_changed_time: %f\n", read_changed_time);
-    // printf("\t[+] partial_sum_centers_time: %f\n", partial_sum_centers_time);
-    printf("\t[+] partial_sum_centers_time_new: %f\n", partial_sum_centers_time_new);
+    printf("\t[+] accumulate_centers_time: %f\n", accumulate_centers_time);
+    printf("\t[+] assign_accumulate_time: %f\n", assign_accumulate_time);
     printf("\t[+] centers_mean_time: %f\n", centers_mean_time);
     printf("\t[+] update_data_time: %f\n", update_data_time);
     printf("\t[+] read_updated_data_time: %f\n", read_updated_data_time);
+    printf("\t[+] loop_time: %f (%d iterations per batch)\n", loop_time, batch_size);
+    printf("\t[+] host_sync_time: %f\n", host_sync_time);
+    printf("\t[+] iterations: %d\n", iterations);
+    printf("\t[+] throughput: %.2f Mpixels/s (%d-bit kernels)\n", loop_time > 0 ? (double)n_pixels * iterations / loop_time / 1e6 : 0, engine.precision);
+    printf("\t[+] uploaded: %zu bytes in %f (%s)\n", engine.upload_bytes, engine.upload_time,
+           !options->zero_copy ? "copied" : host_ptr ? "zero-copy, host pointer" : "zero-copy, mapped");
+    if (palette) {
+        printf("\t[+] downloaded: %zu bytes in %f (%d-bit indices + palette)\n", engine.download_bytes, engine.download_time, gpu_index_bits(n_clusters));
+    } else {
+        printf("\t[+] downloaded: %zu bytes in %f (pixels)\n", engine.download_bytes, engine.download_time);
+    }
     fflush(stdout);
 
-    clStatus = clReleaseKernel(assign_pixels_kernel);
-    clStatus = clReleaseKernel(partial_sum_centers_kernel);
-    clStatus = clReleaseKernel(centers_mean_kernel);
-    clStatus = clReleaseKernel(update_data_kernel);
+    report_trace(&trace, options, iterations);
+    gpu_engine_release(&engine);
 
-    clStatus = clReleaseProgram(program);
+    free(ring);
+    free(centers);
+}
 
-    clStatus = clReleaseMemObject(data_);
-    clStatus = clReleaseMemObject(centers_);
-    clStatus = clReleaseMemObject(labels_);
-    clStatus = clReleaseMemObject(distances_);
-    clStatus = clReleaseMemObject(counts_);
-    
-    clStatus = clReleaseCommandQueue(command_queue);
-    clStatus = clReleaseContext(context);
+void kmeans_batch_gpu(byte_t **images, const int *widths, const int *heights, const int *channels, int n_images, int n_clusters, int max_iterations,
+                      int n_queues, int reuse, const gpu_options_t *options, gpu_batch_stats_t *stats)
+{
+    double start_time = omp_get_wtime();
+    int batch_size = options->resident_iterations > 0 ? options->resident_iterations : 1;
+    int ring_slots = 2 * batch_size;
+    int palette = options->palette && n_clusters <= 256;
+
+    // initial centers up front, in image order: rand() is neither per-thread nor reproducible across threads
+    long **centers = (long**) malloc(n_images * sizeof(long*));
+    for (int i = 0; i < n_images; i++) {
+        centers[i] = (long*) malloc(n_clusters * channels[i] * sizeof(long));
+        gpu_initialise_centers(images[i], centers[i], widths[i] * heights[i], channels[i], n_clusters);
+    }
+
+    // a process per image can't overlap anything either
+    if (!reuse) {
+        n_queues = 1;
+    }
+
+    gpu_engine_t *engines = (gpu_engine_t*) calloc(n_queues, sizeof(gpu_engine_t));
+    if (reuse) {
+        gpu_engine_init(&engines[0], options->device, options->precision, 0);
+        override_tuning(&engines[0], options);
+
+        for (int queue = 1; queue < n_queues; queue++) {
+            gpu_engine_clone(&engines[queue], &engines[0], 0);
+        }
+    }
+    stats->setup_time = omp_get_wtime() - start_time;
+
+    long iterations = 0;
+
+    // every thread feeds its own in-order queue, so the device sees the upload of one image, the
+    // iterations of another and the readback of a third at the same time
+    #pragma omp parallel for num_threads(n_queues) schedule(dynamic, 1) reduction(+:iterations)
+    for (int i = 0; i < n_images; i++) {
+        gpu_engine_t *engine = &engines[omp_get_thread_num()];
+        double image_start = omp_get_wtime();
+        double host_sync_time = 0;
+        cl_long *ring = (cl_long*) calloc(ring_slots * RING_FIELDS, sizeof(cl_long));
+
+        if (!reuse) {
+            double setup_start = omp_get_wtime();
+            gpu_engine_init(engine, options->device, options->precision, 0);
+            override_tuning(engine, options);
+            stats->setup_time += omp_get_wtime() - setup_start;
+        }
 
-    free(devices);
-    free(platforms);
+        gpu_engine_bind(engine, images[i], centers[i], widths[i] * heights[i], channels[i], n_clusters, ring_slots);
+        iterations += gpu_engine_run(engine, max_iterations, batch_size, ring, &host_sync_time);
 
-    free(counts);
+        if (palette) {
+            gpu_engine_read_palette(engine, images[i]);
+        } else {
+            gpu_enqueue_update_data(engine, NULL);
+            gpu_engine_read_data(engine, images[i]);
+        }
+        gpu_engine_unbind(engine);
+
+        if (!reuse) {
+            gpu_engine_release(engine);
+        }
+
+        stats->latencies[i] = omp_get_wtime() - image_start;
+        free(ring);
+    }
+
+    if (reuse) {
+        for (int queue = 0; queue < n_queues; queue++) {
+            gpu_engine_release(&engines[queue]);
+        }
+    }
+
+    stats->iterations = iterations;
+    stats->time = omp_get_wtime() - start_time;
+
+    for (int i = 0; i < n_images; i++) {
+        free(centers[i]);
+    }
     free(centers);
-    free(labels);
-    free(distances);
+    free(engines);
+}
+
+// median of TUNE_RUNS profiled runs of one kernel, sums and counts are cleared before every run
+static double time_kernel(gpu_engine_t *engine, int accumulate)
+{
+    double times[TUNE_RUNS];
+    cl_long zero_long = 0;
+    cl_int zero = 0;
+
+    for (int run = 0; run < TUNE_RUNS; run++) {
+        cl_event event;
+
+        CL_CHECK(clEnqueueFillBuffer(engine->queue, engine->sums, &zero_long, sizeof(cl_long), 0, engine->n_clusters * engine->n_channels * sizeof(long), 0, NULL, NULL));
+        CL_CHECK(clEnqueueFillBuffer(engine->queue, engine->counts, &zero, sizeof(cl_int), 0, engine->n_clusters * sizeof(int), 0, NULL, NULL));
+
+        if (accumulate) {
+            gpu_enqueue_accumulate(engine, 0, &event);
+        } else {
+            gpu_enqueue_assign(engine, 0, &event);
+        }
+
+        CL_CHECK(clWaitForEvents(1, &event));
+        times[run] = gpu_event_time(event);
+        CL_CHECK(clReleaseEvent(event));
+    }
 
+    // insertion sort, there are only a handful
+    for (int i = 1; i < TUNE_RUNS; i++) {
+        double time = times[i];
+        int j = i - 1;
+        for (; j >= 0 && times[j] > time; j--) {
+            times[j + 1] = times[j];
+        }
+        times[j + 1] = time;
+    }
+
+    return times[TUNE_RUNS / 2];
 }
 
-void initialise_centers(byte_t *data, long *centers, int n_pixels, int n_channels, int n_clusters)
+void kmeans_autotune_gpu(byte_t *data, int width, int height, int n_channels, int n_clusters, const gpu_options_t *options)
 {
-    for (int cluster = 0; cluster < n_clusters; cluster++) {
-        // Pick a random pixel
-        int random_int = rand() % n_pixels;
-
-        // Set the random pixel as one of the centers
-        for (int channel = 0; channel < n_channels; channel++) {
-            // Save picked pixel's channels
-            centers[cluster * n_channels + channel] = data[random_int * n_channels + channel];
+    static const size_t local_sizes[] = { 32, 64, 128, 256, 512, 1024 };
+    static const int pixels_per_item[] = { 1, 4, 8, 16, 32, 64 };
+    int n_local_sizes = sizeof(local_sizes) / sizeof(local_sizes[0]);
+    int n_pixels_per_item = sizeof(pixels_per_item) / sizeof(pixels_per_item[0]);
+
+    int n_pixels = width * height;
+    long *centers = (long*) malloc(n_clusters * n_channels * sizeof(long));
+    gpu_initialise_centers(data, centers, n_pixels, n_channels, n_clusters);
+
+    gpu_engine_t engine;
+    gpu_engine_init(&engine, options->device, options->precision, CL_QUEUE_PROFILING_ENABLE);
+    printf("[+] Device: ");
+    cl_describe_device(engine.device, stdout);
+
+    gpu_tuning_t tuning;
+    gpu_tuning_defaults(&tuning);
+    gpu_engine_tune(&engine, &tuning);
+    gpu_engine_bind(&engine, data, centers, n_pixels, n_channels, n_clusters, 2);
+
+    // labels settle after the first assignment, later runs time the steady state
+    gpu_enqueue_assign(&engine, 0, NULL);
+    CL_CHECK(clFinish(engine.queue));
+
+    printf("[+] Autotuning (%d x %d, %d clusters, median of %d runs): \n", width, height, n_clusters, TUNE_RUNS);
+    printf("\t%-18s %8s %8s %12s\n", "kernel", "local", "pixels", "time [ms]");
+
+    // assign_pixels: one pixel per work-item and grid-stride, only the local size matters
+    double best_assign = DBL_MAX;
+    size_t best_assign_local = tuning.assign_local;
+    for (int l = 0; l < n_local_sizes; l++) {
+        tuning.fused = 0;
+        tuning.assign_local = local_sizes[l];
+        gpu_engine_tune(&engine, &tuning);
+
+        // the device capped it, this size was already tried
+        if (engine.local_item_size != local_sizes[l]) {
+            continue;
+        }
+
+        double time = time_kernel(&engine, 0);
+        printf("\t%-18s %8zu %8d %12.4f\n", "assign_pixels", engine.local_item_size, 1, time * 1e3);
+
+        if (time < best_assign) {
+            best_assign = time;
+            best_assign_local = local_sizes[l];
         }
     }
+    tuning.assign_local = best_assign_local;
+
+    // accumulate_centers and the fused kernel: local size and pixels per work-item
+    double best[2] = { DBL_MAX, DBL_MAX };
+    size_t best_local[2] = { tuning.accumulate_local, tuning.accumulate_local };
+    int best_pixels[2] = { tuning.pixels_per_item, tuning.pixels_per_item };
+
+    for (int fused = 0; fused < 2; fused++) {
+        for (int l = 0; l < n_local_sizes; l++) {
+            for (int p = 0; p < n_pixels_per_item; p++) {
+                tuning.fused = fused;
+                tuning.accumulate_local = local_sizes[l];
+                tuning.pixels_per_item = pixels_per_item[p];
+                gpu_engine_tune(&engine, &tuning);
+
+                if (engine.local_item_size_accumulate != local_sizes[l]) {
+                    continue;
+                }
+
+                double time = fused ? time_kernel(&engine, 0) : time_kernel(&engine, 1);
+                printf("\t%-18s %8zu %8d %12.4f\n", fused ? "assign_accumulate" : "accumulate_centers", local_sizes[l], pixels_per_item[p], time * 1e3);
+
+                if (time < best[fused]) {
+                    best[fused] = time;
+                    best_local[fused] = local_sizes[l];
+                    best_pixels[fused] = pixels_per_item[p];
+                }
+            }
+        }
+    }
+
+    // reduction strategy: a separate accumulate pass after assign_pixels, or both in one kernel
+    tuning.fused = best[1] < best_assign + best[0];
+    tuning.accumulate_local = best_local[tuning.fused];
+    tuning.pixels_per_item = best_pixels[tuning.fused];
+
+    printf("[+] Best: assign_pixels %zu + accumulate_centers %zu/%d = %.4f ms, assign_accumulate %zu/%d = %.4f ms -> %s\n",
+           best_assign_local, best_local[0], best_pixels[0], (best_assign + best[0]) * 1e3, best_local[1], best_pixels[1], best[1] * 1e3,
+           tuning.fused ? "fused" : "separate");
+
+    char path[4096];
+    if (gpu_tuning_save(engine.device, &tuning) && gpu_tuning_path(engine.device, path, sizeof(path))) {
+        printf("[+] Profile: %s\n", path);
+    } else {
+        fprintf(stderr, "[!] Could not write the tuning profile\n");
+    }
+    fflush(stdout);
+
+    gpu_engine_release(&engine);
+    free(centers);
 }
@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <omp.h>
+#include <CL/cl.h>
+
+#include "image_io.h"
+#include "compression.h"
+#include "cl_device.h"
+#include "gpu_engine.h"
+
+// neither side gets less than this share while the split is rebalanced
+#define HYBRID_MIN_SHARE 0.02
+// the split only moves for a change of at least this share, every move costs stale device labels
+#define HYBRID_HYSTERESIS 0.01
+// weight of the newest measurement in the smoothed share
+#define HYBRID_SMOOTHING 0.5
+
+// the CPU's share [first, last): the same integer distances and sums as the device kernels, so a
+// pixel ends up in the same cluster whichever side it is on
+static long assign_accumulate_cpu(byte_t *data, const long *centers, int *labels, double *distances, long *sums, int *counts,
+                                  int first, int last, int n_channels, int n_clusters)
+{
+    long changed = 0;
+
+    for (int j = 0; j < n_clusters * n_channels; j++) {
+        sums[j] = 0;
+    }
+    for (int cluster = 0; cluster < n_clusters; cluster++) {
+        counts[cluster] = 0;
+    }
+
+    #pragma omp parallel for schedule(static) reduction(+:changed, sums[:n_clusters * n_channels], counts[:n_clusters])
+    for (int pixel = first; pixel < last; pixel++) {
+        int min_distance = INT_MAX;
+        int min_cluster = 0;
+
+        for (int cluster = 0; cluster < n_clusters; cluster++) {
+            int distance = 0;
+
+            for (int channel = 0; channel < n_channels; channel++) {
+                int tmp = data[pixel * n_channels + channel] - (int) centers[cluster * n_channels + channel];
+                distance += tmp * tmp;
+            }
+
+            if (distance < min_distance) {
+                min_distance = distance;
+                min_cluster = cluster;
+            }
+        }
+
+        distances[pixel] = min_distance;
+
+        if (labels[pixel] != min_cluster) {
+            labels[pixel] = min_cluster;
+            changed++;
+        }
+
+        for (int channel = 0; channel < n_channels; channel++) {
+            sums[min_cluster * n_channels + channel] += data[pixel * n_channels + channel];
+        }
+        counts[min_cluster]++;
+    }
+
+    return changed;
+}
+
+static void update_data_cpu(byte_t *data, const long *centers, const int *labels, int first, int last, int n_channels)
+{
+    #pragma omp parallel for schedule(static)
+    for (int pixel = first; pixel < last; pixel++) {
+        for (int channel = 0; channel < n_channels; channel++) {
+            data[pixel * n_channels + channel] = (byte_t) centers[labels[pixel] * n_channels + channel];
+        }
+    }
+}
+
+void kmeans_compression_hybrid(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations, const hybrid_options_t *options, hybrid_stats_t *stats)
+{
+    int n_pixels = width * height;
+    int n_values = n_clusters * n_channels;
+
+    long *centers = malloc(n_values * sizeof(long));
+    long *sums = malloc(n_values * sizeof(long));
+    int *counts = malloc(n_clusters * sizeof(int));
+    long *device_sums = malloc(n_values * sizeof(long));
+    int *device_counts = malloc(n_clusters * sizeof(int));
+    long *cpu_sums = malloc(n_values * sizeof(long));
+    int *cpu_counts = malloc(n_clusters * sizeof(int));
+    int *labels = malloc(n_pixels * sizeof(int));
+    double *distances = malloc(n_pixels * sizeof(double));
+    cl_long ring[RING_FIELDS];
+
+    for (int pixel = 0; pixel < n_pixels; pixel++) {
+        labels[pixel] = -1;
+    }
+
+    omp_set_num_threads(options->n_threads);
+    gpu_initialise_centers(data, centers, n_pixels, n_channels, n_clusters);
+
+    // the device works on the pixels [0, split), the CPU on [split, n_pixels)
+    gpu_engine_t engine;
+    gpu_engine_init(&engine, options->gpu.device, options->gpu.precision, CL_QUEUE_PROFILING_ENABLE);
+    printf("[+] Device: ");
+    cl_describe_device(engine.device, stdout);
+
+    gpu_tuning_t tuning = engine.tuning;
+    tuning.fused = 1;
+    gpu_engine_tune(&engine, &tuning);
+
+    engine.host_reduce = 1;
+    gpu_engine_bind(&engine, data, centers, n_pixels, n_channels, n_clusters, 1);
+
+    double share = options->device_share;
+    int split = (int) (share * n_pixels);
+
+    stats->iterations = 0;
+    stats->device_time = 0;
+    stats->cpu_time = 0;
+    stats->merge_time = 0;
+    stats->rebalances = 0;
+    stats->device_rate = 0;
+    stats->cpu_rate = 0;
+
+    double loop_time = omp_get_wtime();
+
+    for (int i = 0; i < max_iterations; i++) {
+        stats->iterations++;
+
+        // Device: assign and accumulate its share without waiting
+        cl_event first = NULL, last = NULL;
+        if (split > 0) {
+            cl_long zero = 0;
+            if (engine.n_pixels != split) {
+                gpu_engine_limit(&engine, split);
+            }
+            gpu_engine_write_centers(&engine, centers);
+            CL_CHECK(clEnqueueFillBuffer(engine.queue, engine.ring, &zero, sizeof(cl_long), 0, RING_FIELDS * sizeof(cl_long), 0, NULL, NULL));
+            gpu_enqueue_assign(&engine, 0, &first);
+            gpu_enqueue_read_partials(&engine, device_sums, device_counts, ring, &last);
+        }
+
+        // CPU: its share meanwhile
+        double start_time = omp_get_wtime();
+        long changed = assign_accumulate_cpu(data, centers, labels, distances, cpu_sums, cpu_counts, split, n_pixels, n_channels, n_clusters);
+        double cpu_time = omp_get_wtime() - start_time;
+
+        double device_time = 0;
+        if (split > 0) {
+            CL_CHECK(clWaitForEvents(1, &last));
+            device_time = gpu_event_span(first, last);
+            changed += ring[0];
+            clReleaseEvent(first);
+            clReleaseEvent(last);
+        }
+
+        stats->cpu_time += cpu_time;
+        stats->device_time += device_time;
+
+        // if clusters haven't changed, they won't change in the next iteration as well, so just stop early;
+        // pixels that just moved to the other side count as changed once, their labels there are stale
+        if (!changed) {
+            break;
+        }
+
+        // Merge the partial sums and compute the new centers
+        start_time = omp_get_wtime();
+        int empty = 0;
+        for (int j = 0; j < n_values; j++) {
+            sums[j] = cpu_sums[j] + (split > 0 ? device_sums[j] : 0);
+        }
+        for (int cluster = 0; cluster < n_clusters; cluster++) {
+            counts[cluster] = cpu_counts[cluster] + (split > 0 ? device_counts[cluster] : 0);
+            empty += counts[cluster] == 0;
+        }
+
+        // reseeding needs every distance, which is rare enough to read the device's back
+        if (empty && split > 0) {
+            gpu_engine_read_distances(&engine, distances);
+        }
+        gpu_host_centers(data, centers, sums, counts, distances, n_pixels, n_channels, n_clusters);
+        stats->merge_time += omp_get_wtime() - start_time;
+
+        // Rebalance: give each side the share of the pixels its measured rate can finish in the same time
+        double device_rate = device_time > 0 ? split / device_time : 0;
+        double cpu_rate = cpu_time > 0 ? (n_pixels - split) / cpu_time : 0;
+        stats->device_rate = device_rate;
+        stats->cpu_rate = cpu_rate;
+
+        // not after the last iteration: the write-back needs the split that produced the labels, the
+        // pixels that would change sides carry none on their new side
+        if (options->rebalance && i + 1 < max_iterations && device_rate > 0 && cpu_rate > 0) {
+            double target = device_rate / (device_rate + cpu_rate);
+            double smoothed = HYBRID_SMOOTHING * target + (1 - HYBRID_SMOOTHING) * share;
+
+            if (smoothed < HYBRID_MIN_SHARE) {
+                smoothed = HYBRID_MIN_SHARE;
+            }
+            if (smoothed > 1 - HYBRID_MIN_SHARE) {
+                smoothed = 1 - HYBRID_MIN_SHARE;
+            }
+
+            if (fabs(smoothed - share) >= HYBRID_HYSTERESIS) {
+                share = smoothed;
+                split = (int) (share * n_pixels);
+                stats->rebalances++;
+            }
+        }
+    }
+
+    // Write the compressed pixels, each side its own share
+    if (split > 0) {
+        gpu_engine_limit(&engine, split);
+        gpu_engine_write_centers(&engine, centers);
+        gpu_enqueue_update_data(&engine, NULL);
+        CL_CHECK(clFlush(engine.queue));
+    }
+    update_data_cpu(data, centers, labels, split, n_pixels, n_channels);
+    if (split > 0) {
+        gpu_engine_read_data(&engine, data);
+    }
+
+    stats->loop_time = omp_get_wtime() - loop_time;
+    stats->device_share = share;
+    stats->split = split;
+
+    gpu_engine_release(&engine);
+
+    free(distances);
+    free(labels);
+    free(cpu_counts);
+    free(cpu_sums);
+    free(device_counts);
+    free(device_sums);
+    free(counts);
+    free(sums);
+    free(centers);
+}
@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <omp.h>
+#include <mpi.h>
+
+#include "image_io.h"
+#include "compression.h"
+
+// compression_omp.c
+void initialise_centers(byte_t *data, double *centers, int n_pixels, int n_channels, int n_clusters);
+void assign_pixels(byte_t *data, double *centers, int *labels, double *distances, int *changed, int n_pixels, int n_channels, int n_clusters);
+void update_data(byte_t *data, double *centers, int *labels, int n_pixels, int n_channels);
+
+// first row of a rank's slab, the last rank's ends at height
+static int slab_first_row(int rank, int n_ranks, int height)
+{
+    return (int) ((long) height * rank / n_ranks);
+}
+
+// sums and counts of the slab's clusters, in one buffer with the changed flag so a single allreduce
+// merges all of them
+static void partial_sums(byte_t *data, int *labels, double *reduced, int changed, int n_pixels, int n_channels, int n_clusters)
+{
+    int n_values = n_clusters * n_channels;
+    double *sums = reduced;
+    double *counts = &reduced[n_values];
+
+    for (int j = 0; j < n_values + n_clusters; j++) {
+        reduced[j] = 0;
+    }
+
+    #pragma omp parallel for schedule(static) reduction(+:sums[:n_values], counts[:n_clusters])
+    for (int pixel = 0; pixel < n_pixels; pixel++) {
+        int cluster = labels[pixel];
+
+        for (int channel = 0; channel < n_channels; channel++) {
+            sums[cluster * n_channels + channel] += data[pixel * n_channels + channel];
+        }
+        counts[cluster] += 1;
+    }
+
+    reduced[n_values + n_clusters] = changed;
+}
+
+// farthest pixel of the slab from its center, the first one on a tie
+static int farthest_pixel(double *distances, int n_pixels, double *max_distance)
+{
+    double max_value = -1;
+    int farthest = 0;
+
+    #pragma omp parallel
+    {
+        double max_value_local = -1;
+        int farthest_local = 0;
+
+        #pragma omp for nowait
+        for (int pixel = 0; pixel < n_pixels; pixel++) {
+            if (distances[pixel] > max_value_local) {
+                max_value_local = distances[pixel];
+                farthest_local = pixel;
+            }
+        }
+
+        #pragma omp critical
+        {
+            if (max_value_local > max_value || (max_value_local == max_value && farthest_local < farthest)) {
+                max_value = max_value_local;
+                farthest = farthest_local;
+            }
+        }
+    }
+
+    *max_distance = max_value;
+    return farthest;
+}
+
+// new centers from the merged sums; an empty cluster moves onto the farthest pixel of the whole image,
+// the rank holding it wins a MAXLOC reduction and broadcasts its channels
+static void update_centers_mpi(byte_t *data, double *centers, double *reduced, double *distances, int n_pixels, int n_channels, int n_clusters, int rank)
+{
+    int n_values = n_clusters * n_channels;
+
+    for (int cluster = 0; cluster < n_clusters; cluster++) {
+        double count = reduced[n_values + cluster];
+
+        if (count > 0) {
+            for (int channel = 0; channel < n_channels; channel++) {
+                centers[cluster * n_channels + channel] = reduced[cluster * n_channels + channel] / count;
+            }
+            continue;
+        }
+
+        struct {
+            double distance;
+            int rank;
+        } local, global;
+
+        int farthest = farthest_pixel(distances, n_pixels, &local.distance);
+        local.rank = rank;
+        MPI_Allreduce(&local, &global, 1, MPI_DOUBLE_INT, MPI_MAXLOC, MPI_COMM_WORLD);
+
+        double pixel[KMEANS_MAX_CHANNELS];
+        if (global.rank == rank) {
+            for (int channel = 0; channel < n_channels; channel++) {
+                pixel[channel] = data[farthest * n_channels + channel];
+            }
+
+            // the next empty cluster must not pick the same pixel
+            distances[farthest] = 0;
+        }
+        MPI_Bcast(pixel, n_channels, MPI_DOUBLE, global.rank, MPI_COMM_WORLD);
+
+        for (int channel = 0; channel < n_channels; channel++) {
+            centers[cluster * n_channels + channel] = pixel[channel];
+        }
+    }
+}
+
+void kmeans_compression_mpi(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations, int n_threads, mpi_stats_t *stats)
+{
+    int rank, n_ranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &n_ranks);
+
+    omp_set_num_threads(n_threads);
+
+    double scatter_time = MPI_Wtime();
+
+    int size[3] = { width, height, n_channels };
+    MPI_Bcast(size, 3, MPI_INT, 0, MPI_COMM_WORLD);
+    width = size[0];
+    height = size[1];
+    n_channels = size[2];
+
+    int n_values = n_clusters * n_channels;
+
+    // the root picks the initial centers from the whole image, the same ones as the OpenMP engine's for a seed
+    double *centers = malloc(n_values * sizeof(double));
+    if (rank == 0) {
+        initialise_centers(data, centers, width * height, n_channels, n_clusters);
+    }
+    MPI_Bcast(centers, n_values, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+    // Scatter the row slabs; counted in rows, so images over 2 GB don't overflow the byte counts
+    MPI_Datatype row;
+    MPI_Type_contiguous(width * n_channels, MPI_UNSIGNED_CHAR, &row);
+    MPI_Type_commit(&row);
+
+    int *slab_rows = malloc(n_ranks * sizeof(int));
+    int *slab_offsets = malloc(n_ranks * sizeof(int));
+    for (int r = 0; r < n_ranks; r++) {
+        slab_offsets[r] = slab_first_row(r, n_ranks, height);
+        slab_rows[r] = slab_first_row(r + 1, n_ranks, height) - slab_offsets[r];
+    }
+
+    int n_pixels = slab_rows[rank] * width;
+
+    // the root's slab is the start of its own image
+    byte_t *slab = rank == 0 ? data : malloc((size_t) n_pixels * n_channels);
+    MPI_Scatterv(data, slab_rows, slab_offsets, row, rank == 0 ? MPI_IN_PLACE : slab, slab_rows[rank], row, 0, MPI_COMM_WORLD);
+    scatter_time = MPI_Wtime() - scatter_time;
+
+    int *labels = malloc(n_pixels * sizeof(int));
+    double *distances = malloc(n_pixels * sizeof(double));
+    double *reduced = malloc((n_values + n_clusters + 1) * sizeof(double));
+    double *iteration_times = malloc(2 * max_iterations * sizeof(double));
+
+    for (int pixel = 0; pixel < n_pixels; pixel++) {
+        labels[pixel] = -1;
+    }
+
+    int iterations = 0;
+    double loop_time = MPI_Wtime();
+
+    for (int i = 0; i < max_iterations; i++) {
+        iterations++;
+
+        // Compute: the slab's labels and partial sums
+        double start_time = MPI_Wtime();
+        int changed;
+        assign_pixels(slab, centers, labels, distances, &changed, n_pixels, n_channels, n_clusters);
+        partial_sums(slab, labels, reduced, changed, n_pixels, n_channels, n_clusters);
+        double compute_time = MPI_Wtime() - start_time;
+
+        // Communicate: the sums, counts and changed flags of all slabs, in one allreduce; it also waits
+        // for the slowest rank, so imbalance shows up here
+        start_time = MPI_Wtime();
+        MPI_Allreduce(MPI_IN_PLACE, reduced, n_values + n_clusters + 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+        // if clusters haven't changed, they won't change in the next iteration as well, so just stop early
+        int done = reduced[n_values + n_clusters] == 0;
+        if (!done) {
+            update_centers_mpi(slab, centers, reduced, distances, n_pixels, n_channels, n_clusters, rank);
+        }
+
+        iteration_times[2 * i] = compute_time;
+        iteration_times[2 * i + 1] = MPI_Wtime() - start_time;
+
+        if (done) {
+            break;
+        }
+    }
+    loop_time = MPI_Wtime() - loop_time;
+
+    // Compress the slabs and gather them back into the root's image
+    double gather_time = MPI_Wtime();
+    update_data(slab, centers, labels, n_pixels, n_channels);
+    MPI_Gatherv(rank == 0 ? MPI_IN_PLACE : slab, slab_rows[rank], row, data, slab_rows, slab_offsets, row, 0, MPI_COMM_WORLD);
+    gather_time = MPI_Wtime() - gather_time;
+
+    // per-iteration times of the slowest rank
+    double *max_times = rank == 0 ? malloc(2 * iterations * sizeof(double)) : NULL;
+    MPI_Reduce(iteration_times, max_times, 2 * iterations, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    if (rank == 0) {
+        stats->n_ranks = n_ranks;
+        stats->iterations = iterations;
+        stats->slab_rows = 0;
+        stats->scatter_time = scatter_time;
+        stats->compute_time = 0;
+        stats->comm_time = 0;
+        stats->gather_time = gather_time;
+        stats->loop_time = loop_time;
+
+        for (int r = 0; r < n_ranks; r++) {
+            if (slab_rows[r] > stats->slab_rows) {
+                stats->slab_rows = slab_rows[r];
+            }
+        }
+
+        for (int i = 0; i < iterations; i++) {
+            stats->compute_time += max_times[2 * i];
+            stats->comm_time += max_times[2 * i + 1];
+            if (stats->iteration_compute) {
+                stats->iteration_compute[i] = max_times[2 * i];
+            }
+            if (stats->iteration_comm) {
+                stats->iteration_comm[i] = max_times[2 * i + 1];
+            }
+        }
+
+        free(max_times);
+    }
+
+    MPI_Type_free(&row);
+
+    free(iteration_times);
+    free(reduced);
+    free(distances);
+    free(labels);
+    if (slab != data) {
+        free(slab);
+    }
+    free(slab_offsets);
+    free(slab_rows);
+    free(centers);
+}
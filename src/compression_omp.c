@@ -5,38 +5,284 @@
 #include <omp.h>
 
 #include "image_io.h"
+#include "arena.h"
 #include "compression.h"
+#include "tile_pool.h"
+
+typedef struct {
+    int *labels;
+    double *centers;
+    double *distances;
+    int *counts;
+    int *changed;
+    double *partial_centers;
+    int *partial_counts;
+    unsigned int *seed;       // the initial centers from rand_r on this seed, NULL from rand()
+} workspace_t;
+
+typedef struct {
+    byte_t *data;
+    double *centers;
+    int *labels;
+    double *distances;
+    int *changed;
+    double *partial_centers;
+    int *partial_counts;
+    int width;
+    int n_channels;
+    int n_clusters;
+} tile_args_t;
+
+struct kmeans_context {
+    kmeans_config_t config;
+    arena_t arena;
+    tile_pool_t *pool;
+    int phases[3];
+    byte_t *palette;
+    unsigned int seed;
+    int seeded;               // the next run draws from seed, see kmeans_context_seed
+};
 
 void initialise_centers(byte_t *data, double *centers, int n_pixels, int n_channels, int n_clusters);
+void initialise_centers_ws(workspace_t *ws, byte_t *data, int n_pixels, int n_channels, int n_clusters);
 void assign_pixels(byte_t *data, double *centers, int *labels, double *distances, int *changed, int n_pixels, int n_channels, int n_clusters);
-void update_centers(byte_t *data, double *centers, int *labels, double *distances, int n_pixels, int n_channels, int n_clusters);
+void update_centers(byte_t *data, double *centers, int *counts, int *labels, double *distances, int n_pixels, int n_channels, int n_clusters);
 void update_data(byte_t *data, double *centers, int *labels, int n_pixels, int n_channels);
+void centers_mean(byte_t *data, double *centers, int *counts, double *distances, int n_pixels, int n_channels, int n_clusters);
 
+void assign_pixels_tile(const tile_t *tile, int worker, void *arg);
+void partial_sum_centers_tile(const tile_t *tile, int worker, void *arg);
+void update_data_tile(const tile_t *tile, int worker, void *arg);
 
-void kmeans_compression_omp(byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations, int n_threads) 
+void workspace_alloc(workspace_t *ws, arena_t *arena, int n_pixels, int n_channels, int n_clusters, int n_threads);
+void reduce_partial_sums(workspace_t *ws, int n_partials, int n_channels, int n_clusters);
+void kmeans_run_static(workspace_t *ws, byte_t *data, byte_t *out, int width, int height, int n_channels, int n_clusters, int max_iterations, int n_threads, kmeans_stats_t *stats);
+void kmeans_run_tiles(workspace_t *ws, tile_pool_t *pool, int *phases, byte_t *data, byte_t *out, int width, int height, int n_channels, int n_clusters, int max_iterations, int n_threads, kmeans_stats_t *stats);
+void kmeans_run_pstl(workspace_t *ws, byte_t *data, byte_t *out, int width, int height, int n_channels, int n_clusters, int max_iterations, int n_threads, kmeans_stats_t *stats);
+
+#ifdef WITH_PSTL
+// compression_pstl.cpp
+void pstl_set_num_threads(int n_threads);
+void assign_pixels_pstl(byte_t *data, double *centers, int *labels, double *distances, int *changed, int n_pixels, int n_channels, int n_clusters);
+void partial_sum_centers_pstl(byte_t *data, int *labels, double *partial_centers, int *partial_counts, int n_chunks, int n_pixels, int n_channels, int n_clusters);
+void update_data_pstl(byte_t *data, double *centers, int *labels, int n_pixels, int n_channels);
+#endif
+
+
+size_t kmeans_workspace_size_omp(int width, int height, int n_channels, int n_clusters, int n_threads)
 {
-    int n_pixels = width * height;
+    size_t n_pixels = (size_t)width * height;
+
+    size_t size = ARENA_ALIGN(n_pixels * sizeof(int))
+        + ARENA_ALIGN(n_clusters * n_channels * sizeof(double))
+        + ARENA_ALIGN(n_pixels * sizeof(double))
+        + ARENA_ALIGN(n_clusters * sizeof(int));
+
+    // per-worker accumulators of the tile scheduler
+    size += ARENA_ALIGN(n_threads * sizeof(int))
+        + ARENA_ALIGN(n_threads * n_clusters * n_channels * sizeof(double))
+        + ARENA_ALIGN(n_threads * n_clusters * sizeof(int));
+
+    return size;
+}
+
+void workspace_alloc(workspace_t *ws, arena_t *arena, int n_pixels, int n_channels, int n_clusters, int n_threads)
+{
+    // keep in sync with kmeans_workspace_size_omp
+    ws->labels = arena_alloc(arena, n_pixels * sizeof(int));
+    ws->centers = arena_alloc(arena, n_clusters * n_channels * sizeof(double));
+    ws->distances = arena_alloc(arena, n_pixels * sizeof(double));
+    ws->counts = arena_alloc(arena, n_clusters * sizeof(int));
+    ws->changed = arena_alloc(arena, n_threads * sizeof(int));
+    ws->partial_centers = arena_alloc(arena, n_threads * n_clusters * n_channels * sizeof(double));
+    ws->partial_counts = arena_alloc(arena, n_threads * n_clusters * sizeof(int));
+    ws->seed = NULL;
+
+    // the arena hands back the last run's labels, so every pixel has to change on the first iteration
+    for (int pixel = 0; pixel < n_pixels; pixel++) {
+        ws->labels[pixel] = -1;
+    }
+}
 
-    int *labels = malloc(n_pixels * sizeof(int));
-    double *centers = malloc(n_clusters * n_channels * sizeof(double));
-    double *distances = malloc(n_pixels * sizeof(double));
+void reduce_partial_sums(workspace_t *ws, int n_partials, int n_channels, int n_clusters)
+{
+    double *centers = ws->centers;
+    int *counts = ws->counts;
+
+    for (int j = 0; j < n_clusters * n_channels; j++) {
+        centers[j] = 0;
+    }
+    for (int cluster = 0; cluster < n_clusters; cluster++) {
+        counts[cluster] = 0;
+    }
+
+    // reduce the workers' partial sums
+    for (int partial = 0; partial < n_partials; partial++) {
+        for (int j = 0; j < n_clusters * n_channels; j++) {
+            centers[j] += ws->partial_centers[partial * n_clusters * n_channels + j];
+        }
+        for (int cluster = 0; cluster < n_clusters; cluster++) {
+            counts[cluster] += ws->partial_counts[partial * n_clusters + cluster];
+        }
+    }
+}
+
+void kmeans_compression_omp(arena_t *arena, byte_t *data, int width, int height, int n_channels, int n_clusters, int max_iterations, int n_threads, int schedule, kmeans_stats_t *run_stats) 
+{
+    kmeans_stats_t stats;
+    workspace_t ws;
+
+    // everything the run needs is carved out of the arena up front and given back at the end
+    size_t arena_start = arena_mark(arena);
+    workspace_alloc(&ws, arena, width * height, n_channels, n_clusters, n_threads);
+
+    if (schedule == SCHEDULE_TILES) {
+        tile_pool_t *pool = tile_pool_create(n_threads, width, height, TILE_WIDTH, TILE_HEIGHT);
+        int phases[3];
+        phases[0] = tile_pool_add_phase(pool, "assign_pixels");
+        phases[1] = tile_pool_add_phase(pool, "partial_sum");
+        phases[2] = tile_pool_add_phase(pool, "update_data");
+
+        kmeans_run_tiles(&ws, pool, phases, data, data, width, height, n_channels, n_clusters, max_iterations, n_threads, &stats);
+
+        tile_pool_report(pool, stdout);
+        tile_pool_destroy(pool);
+    } else if (schedule == SCHEDULE_PSTL) {
+        kmeans_run_pstl(&ws, data, data, width, height, n_channels, n_clusters, max_iterations, n_threads, &stats);
+    } else {
+        kmeans_run_static(&ws, data, data, width, height, n_channels, n_clusters, max_iterations, n_threads, &stats);
+    }
+
+    // double sum = stats.initialise_centers_time + stats.assign_pixels_time + stats.update_centers_time + stats.update_data_time;
+    // printf("%23s: %7.4lf\n", "initialise_centers_time", (stats.initialise_centers_time / sum) * 100);
+    // printf("%23s: %7.4lf\n", "assign_pixels_time", (stats.assign_pixels_time / sum) * 100);
+    // printf("%23s: %7.4lf\n", "update_centers_time", (stats.update_centers_time / sum) * 100);
+    // printf("%23s: %7.4lf\n", "update_data_time", (stats.update_data_time / sum) * 100);
+
+    if (run_stats) {
+        *run_stats = stats;
+        run_stats->workspace_bytes = arena->peak;
+    }
+
+    arena_release(arena, arena_start);
+}
+
+kmeans_context_t *kmeans_context_create(const kmeans_config_t *config)
+{
+    kmeans_context_t *ctx = malloc(sizeof(kmeans_context_t));
+    if (!ctx) {
+        return NULL;
+    }
+
+    ctx->config = *config;
+    ctx->seeded = 0;
+    arena_init(&ctx->arena);
+    ctx->palette = malloc((size_t)config->n_clusters * KMEANS_MAX_CHANNELS * sizeof(byte_t));
+    if (!ctx->palette) {
+        free(ctx);
+        return NULL;
+    }
+
+    // the pool starts with a single tile and grows with the images
+    ctx->pool = tile_pool_create(config->n_threads, 1, 1, TILE_WIDTH, TILE_HEIGHT);
+    ctx->phases[0] = tile_pool_add_phase(ctx->pool, "assign_pixels");
+    ctx->phases[1] = tile_pool_add_phase(ctx->pool, "partial_sum");
+    ctx->phases[2] = tile_pool_add_phase(ctx->pool, "update_data");
+
+    return ctx;
+}
+
+int kmeans_context_compress(kmeans_context_t *ctx, byte_t *data, int width, int height, int n_channels, kmeans_result_t *result)
+{
+    return kmeans_context_compress_to(ctx, data, data, width, height, n_channels, result);
+}
+
+int kmeans_context_compress_to(kmeans_context_t *ctx, byte_t *data, byte_t *out, int width, int height, int n_channels, kmeans_result_t *result)
+{
+    kmeans_config_t *config = &ctx->config;
+    workspace_t ws;
+
+    if (n_channels > KMEANS_MAX_CHANNELS) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of channels %d >> \n", n_channels);
+        return 0;
+    }
+
+    // the workspace is remapped only when this image needs more than any image before it
+    arena_reset(&ctx->arena);
+    if (!arena_try_reserve(&ctx->arena, kmeans_workspace_size_omp(width, height, n_channels, config->n_clusters, config->n_threads))) {
+        return 0;
+    }
+    workspace_alloc(&ws, &ctx->arena, width * height, n_channels, config->n_clusters, config->n_threads);
+    ws.seed = ctx->seeded ? &ctx->seed : NULL;
+    ctx->seeded = 0;
+
+    if (config->schedule == SCHEDULE_TILES) {
+        tile_pool_resize(ctx->pool, width, height, TILE_WIDTH, TILE_HEIGHT);
+        kmeans_run_tiles(&ws, ctx->pool, ctx->phases, data, out, width, height, n_channels, config->n_clusters, config->max_iterations, config->n_threads, &result->stats);
+    } else if (config->schedule == SCHEDULE_PSTL) {
+        kmeans_run_pstl(&ws, data, out, width, height, n_channels, config->n_clusters, config->max_iterations, config->n_threads, &result->stats);
+    } else {
+        kmeans_run_static(&ws, data, out, width, height, n_channels, config->n_clusters, config->max_iterations, config->n_threads, &result->stats);
+    }
+
+    for (int i = 0; i < config->n_clusters * n_channels; i++) {
+        ctx->palette[i] = (byte_t)round(ws.centers[i]);
+    }
+
+    result->palette = ctx->palette;
+    result->labels = ws.labels;
+    result->n_clusters = config->n_clusters;
+    result->n_channels = n_channels;
+    result->n_pixels = width * height;
+    result->stats.workspace_bytes = ctx->arena.capacity;
+
+    return 1;
+}
+
+void kmeans_context_seed(kmeans_context_t *ctx, unsigned int seed)
+{
+    ctx->seed = seed;
+    ctx->seeded = 1;
+}
+
+void kmeans_context_report(kmeans_context_t *ctx, FILE *out)
+{
+    if (ctx->config.schedule == SCHEDULE_TILES) {
+        tile_pool_report(ctx->pool, out);
+    }
+}
+
+void kmeans_context_destroy(kmeans_context_t *ctx)
+{
+    tile_pool_destroy(ctx->pool);
+    arena_destroy(&ctx->arena);
+    free(ctx->palette);
+    free(ctx);
+}
+
+void kmeans_run_static(workspace_t *ws, byte_t *data, byte_t *out, int width, int height, int n_channels, int n_clusters, int max_iterations, int n_threads, kmeans_stats_t *stats)
+{
+    int n_pixels = width * height;
 
     omp_set_num_threads(n_threads);
 
-    double initialise_centers_time = 0;
-    double assign_pixels_time = 0;
-    double update_centers_time = 0;
-    double update_data_time = 0;
+    stats->iterations = 0;
+    stats->initialise_centers_time = 0;
+    stats->assign_pixels_time = 0;
+    stats->update_centers_time = 0;
+    stats->update_data_time = 0;
 
     double start_time = omp_get_wtime();
-    initialise_centers(data, centers, n_pixels, n_channels, n_clusters);
-    initialise_centers_time += omp_get_wtime() - start_time;
+    initialise_centers_ws(ws, data, n_pixels, n_channels, n_clusters);
+    stats->initialise_centers_time += omp_get_wtime() - start_time;
 
     int have_clusters_changed = 0;
     for (int i = 0; i < max_iterations; i++) {
+        stats->iterations++;
+
         start_time = omp_get_wtime();
-        assign_pixels(data, centers, labels, distances, &have_clusters_changed, n_pixels, n_channels, n_clusters);
-        assign_pixels_time += omp_get_wtime() - start_time;
+        assign_pixels(data, ws->centers, ws->labels, ws->distances, &have_clusters_changed, n_pixels, n_channels, n_clusters);
+        stats->assign_pixels_time += omp_get_wtime() - start_time;
 
         // if clusters haven't changed, they won't change in the next iteration as well, so just stop early
         if (!have_clusters_changed) {
@@ -44,24 +290,13 @@ void kmeans_compression_omp(byte_t *data, int width, int height, int n_channels,
         }
 
         start_time = omp_get_wtime();
-        update_centers(data, centers, labels, distances, n_pixels, n_channels, n_clusters);
-        update_centers_time += omp_get_wtime() - start_time;
+        update_centers(data, ws->centers, ws->counts, ws->labels, ws->distances, n_pixels, n_channels, n_clusters);
+        stats->update_centers_time += omp_get_wtime() - start_time;
     }
 
     start_time = omp_get_wtime();
-    update_data(data, centers, labels, n_pixels, n_channels);
-    update_data_time += omp_get_wtime() - start_time;
-
-    // double sum = initialise_centers_time + assign_pixels_time + update_centers_time + update_data_time;
-    // printf("%23s: %7.4lf\n", "initialise_centers_time", (initialise_centers_time / sum) * 100);
-    // printf("%23s: %7.4lf\n", "assign_pixels_time", (assign_pixels_time / sum) * 100);
-    // printf("%23s: %7.4lf\n", "update_centers_time", (update_centers_time / sum) * 100);
-    // printf("%23s: %7.4lf\n", "update_data_time", (update_data_time / sum) * 100);
-
-    free(centers);
-    free(labels);
-    free(distances);
-
+    update_data(out, ws->centers, ws->labels, n_pixels, n_channels);
+    stats->update_data_time += omp_get_wtime() - start_time;
 }
 
 void initialise_centers(byte_t *data, double *centers, int n_pixels, int n_channels, int n_clusters)
@@ -78,6 +313,23 @@ void initialise_centers(byte_t *data, double *centers, int n_pixels, int n_chann
     }
 }
 
+// the same pixels from the workspace's own seed if it has one, so concurrent runs don't share rand()
+void initialise_centers_ws(workspace_t *ws, byte_t *data, int n_pixels, int n_channels, int n_clusters)
+{
+    if (!ws->seed) {
+        initialise_centers(data, ws->centers, n_pixels, n_channels, n_clusters);
+        return;
+    }
+
+    for (int cluster = 0; cluster < n_clusters; cluster++) {
+        int random_int = rand_r(ws->seed) % n_pixels;
+
+        for (int channel = 0; channel < n_channels; channel++) {
+            ws->centers[cluster * n_channels + channel] = data[(size_t)random_int * n_channels + channel];
+        }
+    }
+}
+
 void assign_pixels(byte_t *data, double *centers, int *labels, double *distances, int *changed, int n_pixels, int n_channels, int n_clusters)
 {
     int have_clusters_changed = 0;
@@ -118,10 +370,8 @@ void assign_pixels(byte_t *data, double *centers, int *labels, double *distances
     *changed = have_clusters_changed;
 }
 
-void update_centers(byte_t *data, double *centers, int *labels, double *distances, int n_pixels, int n_channels, int n_clusters)
+void update_centers(byte_t *data, double *centers, int *counts, int *labels, double *distances, int n_pixels, int n_channels, int n_clusters)
 {
-    int *counts = malloc(n_clusters * sizeof(int));
-
     // reset centers and initialise clusters' counters
     for (int cluster = 0; cluster < n_clusters; cluster++) {
         for (int channel = 0; channel < n_channels; channel++) {
@@ -146,6 +396,11 @@ void update_centers(byte_t *data, double *centers, int *labels, double *distance
         counts[min_cluster] += 1;
     }
 
+    centers_mean(data, centers, counts, distances, n_pixels, n_channels, n_clusters);
+}
+
+void centers_mean(byte_t *data, double *centers, int *counts, double *distances, int n_pixels, int n_channels, int n_clusters)
+{
     // obtain the centers mean
     for (int cluster = 0; cluster < n_clusters; cluster++) {
         if (counts[cluster]) {
@@ -191,9 +446,6 @@ void update_centers(byte_t *data, double *centers, int *labels, double *distance
             distances[farthest_pixel] = 0;
         }
     }
-
-    free(counts);
-
 }
 
 void update_data(byte_t *data, double *centers, int *labels, int n_pixels, int n_channels)
@@ -208,4 +460,204 @@ void update_data(byte_t *data, double *centers, int *labels, int n_pixels, int n
             data[pixel * n_channels + channel] = (byte_t)round(centers[min_cluster * n_channels + channel]);
         }
     }
-}
\ No newline at end of file
+}
+
+void kmeans_run_tiles(workspace_t *ws, tile_pool_t *pool, int *phases, byte_t *data, byte_t *out, int width, int height, int n_channels, int n_clusters, int max_iterations, int n_threads, kmeans_stats_t *stats)
+{
+    int n_pixels = width * height;
+    double *centers = ws->centers;
+    int *counts = ws->counts;
+
+    // per-worker accumulators, so workers never write to the same cluster sums
+    tile_args_t args;
+    args.data = data;
+    args.centers = centers;
+    args.labels = ws->labels;
+    args.distances = ws->distances;
+    args.changed = ws->changed;
+    args.partial_centers = ws->partial_centers;
+    args.partial_counts = ws->partial_counts;
+    args.width = width;
+    args.n_channels = n_channels;
+    args.n_clusters = n_clusters;
+
+    stats->iterations = 0;
+    stats->initialise_centers_time = 0;
+    stats->assign_pixels_time = 0;
+    stats->update_centers_time = 0;
+    stats->update_data_time = 0;
+
+    double start_time = omp_get_wtime();
+    initialise_centers_ws(ws, data, n_pixels, n_channels, n_clusters);
+    stats->initialise_centers_time += omp_get_wtime() - start_time;
+
+    for (int i = 0; i < max_iterations; i++) {
+        stats->iterations++;
+
+        start_time = omp_get_wtime();
+        for (int worker = 0; worker < n_threads; worker++) {
+            args.changed[worker] = 0;
+        }
+
+        tile_pool_run(pool, phases[0], assign_pixels_tile, &args);
+
+        int have_clusters_changed = 0;
+        for (int worker = 0; worker < n_threads; worker++) {
+            have_clusters_changed |= args.changed[worker];
+        }
+        stats->assign_pixels_time += omp_get_wtime() - start_time;
+
+        // if clusters haven't changed, they won't change in the next iteration as well, so just stop early
+        if (!have_clusters_changed) {
+            break;
+        }
+
+        start_time = omp_get_wtime();
+        for (int j = 0; j < n_threads * n_clusters * n_channels; j++) {
+            args.partial_centers[j] = 0;
+        }
+        for (int j = 0; j < n_threads * n_clusters; j++) {
+            args.partial_counts[j] = 0;
+        }
+
+        tile_pool_run(pool, phases[1], partial_sum_centers_tile, &args);
+
+        reduce_partial_sums(ws, n_threads, n_channels, n_clusters);
+
+        centers_mean(data, centers, counts, ws->distances, n_pixels, n_channels, n_clusters);
+        stats->update_centers_time += omp_get_wtime() - start_time;
+    }
+
+    // the compressed pixels go to out, the tiles before were only read
+    start_time = omp_get_wtime();
+    args.data = out;
+    tile_pool_run(pool, phases[2], update_data_tile, &args);
+    stats->update_data_time += omp_get_wtime() - start_time;
+}
+
+void kmeans_run_pstl(workspace_t *ws, byte_t *data, byte_t *out, int width, int height, int n_channels, int n_clusters, int max_iterations, int n_threads, kmeans_stats_t *stats)
+{
+#ifdef WITH_PSTL
+    int n_pixels = width * height;
+
+    pstl_set_num_threads(n_threads);
+
+    stats->iterations = 0;
+    stats->initialise_centers_time = 0;
+    stats->assign_pixels_time = 0;
+    stats->update_centers_time = 0;
+    stats->update_data_time = 0;
+
+    double start_time = omp_get_wtime();
+    initialise_centers_ws(ws, data, n_pixels, n_channels, n_clusters);
+    stats->initialise_centers_time += omp_get_wtime() - start_time;
+
+    int have_clusters_changed = 0;
+    for (int i = 0; i < max_iterations; i++) {
+        stats->iterations++;
+
+        start_time = omp_get_wtime();
+        assign_pixels_pstl(data, ws->centers, ws->labels, ws->distances, &have_clusters_changed, n_pixels, n_channels, n_clusters);
+        stats->assign_pixels_time += omp_get_wtime() - start_time;
+
+        // if clusters haven't changed, they won't change in the next iteration as well, so just stop early
+        if (!have_clusters_changed) {
+            break;
+        }
+
+        // one chunk of partial sums per thread, same buffers as the tile scheduler
+        start_time = omp_get_wtime();
+        partial_sum_centers_pstl(data, ws->labels, ws->partial_centers, ws->partial_counts, n_threads, n_pixels, n_channels, n_clusters);
+        reduce_partial_sums(ws, n_threads, n_channels, n_clusters);
+        centers_mean(data, ws->centers, ws->counts, ws->distances, n_pixels, n_channels, n_clusters);
+        stats->update_centers_time += omp_get_wtime() - start_time;
+    }
+
+    start_time = omp_get_wtime();
+    update_data_pstl(out, ws->centers, ws->labels, n_pixels, n_channels);
+    stats->update_data_time += omp_get_wtime() - start_time;
+#else
+    (void) ws; (void) data; (void) out; (void) width; (void) height;
+    (void) n_channels; (void) n_clusters; (void) max_iterations; (void) n_threads; (void) stats;
+    fprintf(stderr, "INPUT ERROR: << Parallel STL backend not compiled in (build with -DWITH_PSTL) >> \n");
+    exit(EXIT_FAILURE);
+#endif
+}
+
+void assign_pixels_tile(const tile_t *tile, int worker, void *arg)
+{
+    tile_args_t *args = (tile_args_t *)arg;
+    int n_channels = args->n_channels;
+    int n_clusters = args->n_clusters;
+    int have_clusters_changed = 0;
+
+    for (int y = tile->y0; y < tile->y1; y++) {
+        for (int pixel = y * args->width + tile->x0; pixel < y * args->width + tile->x1; pixel++) {
+            double min_distance = DBL_MAX;
+            int min_cluster = 0;
+
+            // calculate the distance between the pixel and each of the centers
+            for (int cluster = 0; cluster < n_clusters; cluster++) {
+                double distance = 0;
+
+                for (int channel = 0; channel < n_channels; channel++) {
+                    double tmp = (double)(args->data[pixel * n_channels + channel] - args->centers[cluster * n_channels + channel]);
+                    distance += (tmp * tmp);
+                }
+
+                if (distance < min_distance) {
+                    min_distance = distance;
+                    min_cluster = cluster;
+                }
+            }
+
+            args->distances[pixel] = min_distance;
+
+            if (args->labels[pixel] != min_cluster) {
+                args->labels[pixel] = min_cluster;
+                have_clusters_changed = 1;
+            }
+        }
+    }
+
+    if (have_clusters_changed) {
+        args->changed[worker] = 1;
+    }
+}
+
+void partial_sum_centers_tile(const tile_t *tile, int worker, void *arg)
+{
+    tile_args_t *args = (tile_args_t *)arg;
+    int n_channels = args->n_channels;
+    double *centers = &args->partial_centers[worker * args->n_clusters * n_channels];
+    int *counts = &args->partial_counts[worker * args->n_clusters];
+
+    for (int y = tile->y0; y < tile->y1; y++) {
+        for (int pixel = y * args->width + tile->x0; pixel < y * args->width + tile->x1; pixel++) {
+            int min_cluster = args->labels[pixel];
+
+            for (int channel = 0; channel < n_channels; channel++) {
+                centers[min_cluster * n_channels + channel] += args->data[pixel * n_channels + channel];
+            }
+
+            counts[min_cluster] += 1;
+        }
+    }
+}
+
+void update_data_tile(const tile_t *tile, int worker, void *arg)
+{
+    (void) worker;
+    tile_args_t *args = (tile_args_t *)arg;
+    int n_channels = args->n_channels;
+
+    for (int y = tile->y0; y < tile->y1; y++) {
+        for (int pixel = y * args->width + tile->x0; pixel < y * args->width + tile->x1; pixel++) {
+            int min_cluster = args->labels[pixel];
+
+            for (int channel = 0; channel < n_channels; channel++) {
+                args->data[pixel * n_channels + channel] = (byte_t)round(args->centers[min_cluster * n_channels + channel]);
+            }
+        }
+    }
+}
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <execution>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <numeric>
+
+#if __has_include(<tbb/global_control.h>)
+#include <tbb/global_control.h>
+#define HAVE_TBB_GLOBAL_CONTROL
+#endif
+
+extern "C" {
+#include "image_io.h"
+}
+
+// random access iterator over [0, n), so the algorithms can walk pixel indices
+class index_iterator {
+public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = int;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const int *;
+    using reference = int;
+
+    index_iterator() : index(0) {}
+    explicit index_iterator(int index) : index(index) {}
+
+    int operator*() const { return index; }
+    int operator[](difference_type n) const { return index + (int)n; }
+
+    index_iterator &operator++() { index++; return *this; }
+    index_iterator operator++(int) { index_iterator tmp = *this; index++; return tmp; }
+    index_iterator &operator--() { index--; return *this; }
+    index_iterator operator--(int) { index_iterator tmp = *this; index--; return tmp; }
+    index_iterator &operator+=(difference_type n) { index += (int)n; return *this; }
+    index_iterator &operator-=(difference_type n) { index -= (int)n; return *this; }
+
+    friend index_iterator operator+(index_iterator it, difference_type n) { return it += n; }
+    friend index_iterator operator+(difference_type n, index_iterator it) { return it += n; }
+    friend index_iterator operator-(index_iterator it, difference_type n) { return it -= n; }
+    friend difference_type operator-(index_iterator a, index_iterator b) { return a.index - b.index; }
+
+    friend bool operator==(index_iterator a, index_iterator b) { return a.index == b.index; }
+    friend bool operator!=(index_iterator a, index_iterator b) { return a.index != b.index; }
+    friend bool operator<(index_iterator a, index_iterator b) { return a.index < b.index; }
+    friend bool operator>(index_iterator a, index_iterator b) { return a.index > b.index; }
+    friend bool operator<=(index_iterator a, index_iterator b) { return a.index <= b.index; }
+    friend bool operator>=(index_iterator a, index_iterator b) { return a.index >= b.index; }
+
+private:
+    int index;
+};
+
+#ifdef HAVE_TBB_GLOBAL_CONTROL
+static std::unique_ptr<tbb::global_control> thread_limit;
+#endif
+
+extern "C" void pstl_set_num_threads(int n_threads)
+{
+#ifdef HAVE_TBB_GLOBAL_CONTROL
+    // the limit holds for as long as the object lives
+    thread_limit.reset();
+    thread_limit.reset(new tbb::global_control(tbb::global_control::max_allowed_parallelism, n_threads));
+#else
+    (void)n_threads;
+#endif
+}
+
+extern "C" void assign_pixels_pstl(byte_t *data, double *centers, int *labels, double *distances, int *changed, int n_pixels, int n_channels, int n_clusters)
+{
+    // every pixel reports whether its label moved, the reduction counts them
+    int n_changed = std::transform_reduce(std::execution::par_unseq, index_iterator(0), index_iterator(n_pixels), 0, std::plus<int>(),
+        [=](int pixel) {
+            double min_distance = DBL_MAX;
+            int min_cluster = 0;
+
+            // calculate the distance between the pixel and each of the centers
+            for (int cluster = 0; cluster < n_clusters; cluster++) {
+                double distance = 0;
+
+                for (int channel = 0; channel < n_channels; channel++) {
+                    double tmp = (double)(data[pixel * n_channels + channel] - centers[cluster * n_channels + channel]);
+                    distance += (tmp * tmp);
+                }
+
+                if (distance < min_distance) {
+                    min_distance = distance;
+                    min_cluster = cluster;
+                }
+            }
+
+            distances[pixel] = min_distance;
+
+            if (labels[pixel] != min_cluster) {
+                labels[pixel] = min_cluster;
+                return 1;
+            }
+
+            return 0;
+        });
+
+    *changed = n_changed > 0;
+}
+
+extern "C" void partial_sum_centers_pstl(byte_t *data, int *labels, double *partial_centers, int *partial_counts, int n_chunks, int n_pixels, int n_channels, int n_clusters)
+{
+    // each chunk of pixels sums into its own slot, the caller reduces the slots
+    std::for_each(std::execution::par_unseq, index_iterator(0), index_iterator(n_chunks),
+        [=](int chunk) {
+            double *centers = &partial_centers[chunk * n_clusters * n_channels];
+            int *counts = &partial_counts[chunk * n_clusters];
+            int start = (int)((long)n_pixels * chunk / n_chunks);
+            int end = (int)((long)n_pixels * (chunk + 1) / n_chunks);
+
+            std::fill(centers, centers + n_clusters * n_channels, 0.0);
+            std::fill(counts, counts + n_clusters, 0);
+
+            for (int pixel = start; pixel < end; pixel++) {
+                int min_cluster = labels[pixel];
+
+                for (int channel = 0; channel < n_channels; channel++) {
+                    centers[min_cluster * n_channels + channel] += data[pixel * n_channels + channel];
+                }
+
+                counts[min_cluster] += 1;
+            }
+        });
+}
+
+extern "C" void update_data_pstl(byte_t *data, double *centers, int *labels, int n_pixels, int n_channels)
+{
+    std::for_each(std::execution::par_unseq, index_iterator(0), index_iterator(n_pixels),
+        [=](int pixel) {
+            int min_cluster = labels[pixel];
+
+            for (int channel = 0; channel < n_channels; channel++) {
+                data[pixel * n_channels + channel] = (byte_t)std::round(centers[min_cluster * n_channels + channel]);
+            }
+        });
+}
@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <omp.h>
+#include <CL/cl.h>
+
+#include "image_io.h"
+#include "compression.h"
+#include "cl_device.h"
+#include "gpu_engine.h"
+
+// two sets of slab buffers, one is transferred while the other computes
+#define TILED_SETS 2
+
+typedef struct {
+    byte_t *data;
+    int *labels;
+    void *distances;          // in the kernel variant's type, see farthest_pixel
+    size_t distance_size;
+    long n_pixels;
+    long slab_pixels;
+    int n_slabs;
+    int n_channels;
+    int resident;             // every slab has a set of its own, nothing needs streaming after the first upload
+} tiled_image_t;
+
+static long slab_first(const tiled_image_t *image, int slab)
+{
+    return (long) slab * image->slab_pixels;
+}
+
+static int slab_size(const tiled_image_t *image, int slab)
+{
+    long first = slab_first(image, slab);
+
+    return (int) (first + image->slab_pixels < image->n_pixels ? image->slab_pixels : image->n_pixels - first);
+}
+
+// farthest pixel of the whole image, 64-bit indices and either distance type
+static long farthest_pixel(const tiled_image_t *image)
+{
+    double max_distance = -1;
+    long farthest = 0;
+
+    #pragma omp parallel
+    {
+        double max_distance_local = -1;
+        long farthest_local = 0;
+
+        #pragma omp for nowait
+        for (long pixel = 0; pixel < image->n_pixels; pixel++) {
+            double distance = image->distance_size == sizeof(cl_int) ? ((cl_int *) image->distances)[pixel] : ((cl_double *) image->distances)[pixel];
+
+            if (distance > max_distance_local) {
+                max_distance_local = distance;
+                farthest_local = pixel;
+            }
+        }
+
+        #pragma omp critical
+        {
+            if (max_distance_local > max_distance || (max_distance_local == max_distance && farthest_local < farthest)) {
+                max_distance = max_distance_local;
+                farthest = farthest_local;
+            }
+        }
+    }
+
+    return farthest;
+}
+
+// one pass over all slabs: assign and accumulate, or write back the compressed pixels
+static void stream_slabs(gpu_engine_t *sets, int n_sets, tiled_image_t *image, int update, size_t *streamed_bytes)
+{
+    int n_channels = image->n_channels;
+
+    for (int slab = 0; slab < image->n_slabs; slab++) {
+        gpu_engine_t *engine = &sets[slab % n_sets];
+        long first = slab_first(image, slab);
+        int n_pixels = slab_size(image, slab);
+        byte_t *data = &image->data[(size_t) first * n_channels];
+        int *labels = &image->labels[first];
+
+        if (engine->n_pixels != n_pixels) {
+            gpu_engine_limit(engine, n_pixels);
+        }
+
+        // the set's queue is in order: this upload waits for the set's previous slab, while the
+        // other set's kernels keep the device busy
+        if (!image->resident) {
+            gpu_enqueue_write(engine, "write data", engine->data, CL_FALSE, 0, (size_t) n_pixels * n_channels, data, NULL);
+            gpu_enqueue_write(engine, "write labels", engine->labels, CL_FALSE, 0, (size_t) n_pixels * sizeof(int), labels, NULL);
+            *streamed_bytes += (size_t) n_pixels * (n_channels + sizeof(int));
+        }
+
+        if (update) {
+            gpu_enqueue_update_data(engine, NULL);
+            gpu_enqueue_read(engine, "read data", engine->data, CL_FALSE, 0, (size_t) n_pixels * n_channels, data, NULL);
+            *streamed_bytes += (size_t) n_pixels * n_channels;
+        } else {
+            gpu_enqueue_assign(engine, 0, NULL);
+            if (!image->resident) {
+                gpu_enqueue_read(engine, "read labels", engine->labels, CL_FALSE, 0, (size_t) n_pixels * sizeof(int), labels, NULL);
+                *streamed_bytes += (size_t) n_pixels * sizeof(int);
+            }
+            gpu_enqueue_read(engine, "read distances", engine->distances, CL_FALSE, 0, (size_t) n_pixels * image->distance_size,
+                             (char *) image->distances + (size_t) first * image->distance_size, NULL);
+            *streamed_bytes += (size_t) n_pixels * image->distance_size;
+        }
+
+        CL_CHECK(clFlush(engine->queue));
+    }
+}
+
+int kmeans_compression_tiled(gpu_engine_t *engine, byte_t *data, long n_pixels, int n_channels, int n_clusters, int max_iterations, const long *initial_centers, const gpu_options_t *options)
+{
+    int n_values = n_clusters * n_channels;
+
+    tiled_image_t image;
+    image.data = data;
+    image.n_pixels = n_pixels;
+    image.n_channels = n_channels;
+    image.distance_size = engine->distance_size;
+    image.slab_pixels = options->slab_pixels > 0 ? options->slab_pixels : gpu_engine_slab_pixels(engine, n_channels, TILED_SETS);
+    if (image.slab_pixels > n_pixels) {
+        image.slab_pixels = n_pixels;
+    }
+    image.n_slabs = (int) ((n_pixels - 1) / image.slab_pixels + 1);
+    image.resident = image.n_slabs <= TILED_SETS;
+
+    int n_sets = image.n_slabs < TILED_SETS ? image.n_slabs : TILED_SETS;
+    printf("[+] Tiled: %d slabs of up to %ld pixels, %d buffer sets%s\n", image.n_slabs, image.slab_pixels, n_sets, image.resident ? " (resident)" : "");
+
+    // host copies of what the device only holds a slab of
+    image.labels = malloc(n_pixels * sizeof(int));
+    image.distances = malloc(n_pixels * image.distance_size);
+    for (long pixel = 0; pixel < n_pixels; pixel++) {
+        image.labels[pixel] = -1;
+    }
+
+    long *centers = malloc(n_values * sizeof(long));
+    long *sums = malloc(n_values * sizeof(long));
+    int *counts = malloc(n_clusters * sizeof(int));
+    long *set_sums = malloc(n_sets * n_values * sizeof(long));
+    int *set_counts = malloc(n_sets * n_clusters * sizeof(int));
+    cl_long *rings = malloc(n_sets * RING_FIELDS * sizeof(cl_long));
+    cl_event *events = malloc(n_sets * sizeof(cl_event));
+
+    for (int j = 0; j < n_values; j++) {
+        centers[j] = initial_centers[j];
+    }
+
+    // set 0 is the caller's engine, the others share its context and program with queues of their own;
+    // every set accumulates the sums of its slabs, the host adds the sets up
+    gpu_engine_t *sets = malloc(n_sets * sizeof(gpu_engine_t));
+    sets[0] = *engine;
+    for (int set = 1; set < n_sets; set++) {
+        gpu_engine_clone(&sets[set], engine, engine->trace ? CL_QUEUE_PROFILING_ENABLE : 0);
+        sets[set].trace = engine->trace;
+    }
+
+    double transfer_data_time = omp_get_wtime();
+    for (int set = 0; set < n_sets; set++) {
+        gpu_tuning_t tuning = sets[set].tuning;
+        tuning.fused = 1;
+        gpu_engine_tune(&sets[set], &tuning);
+
+        sets[set].host_reduce = 1;
+        gpu_engine_bind(&sets[set], &data[(size_t) slab_first(&image, set) * n_channels], centers, slab_size(&image, set), n_channels, n_clusters, 1);
+    }
+    transfer_data_time = omp_get_wtime() - transfer_data_time;
+
+    size_t streamed_bytes = 0;
+    double merge_time = 0;
+    double loop_time = omp_get_wtime();
+    int iterations = 0;
+
+    for (int i = 0; i < max_iterations; i++) {
+        iterations++;
+
+        for (int set = 0; set < n_sets; set++) {
+            cl_long zero = 0;
+            gpu_engine_write_centers(&sets[set], centers);
+            gpu_enqueue_fill(&sets[set], "fill ring", sets[set].ring, &zero, sizeof(cl_long), 0, RING_FIELDS * sizeof(cl_long));
+        }
+
+        stream_slabs(sets, n_sets, &image, 0, &streamed_bytes);
+
+        long changed = 0;
+        for (int set = 0; set < n_sets; set++) {
+            gpu_enqueue_read_partials(&sets[set], &set_sums[set * n_values], &set_counts[set * n_clusters], &rings[set * RING_FIELDS], &events[set]);
+        }
+        for (int set = 0; set < n_sets; set++) {
+            CL_CHECK(clWaitForEvents(1, &events[set]));
+            clReleaseEvent(events[set]);
+            changed += rings[set * RING_FIELDS];
+        }
+
+        // if clusters haven't changed, they won't change in the next iteration as well, so just stop early
+        if (!changed) {
+            break;
+        }
+
+        // Merge the sets' sums and compute the new centers, empty clusters move onto the farthest pixels
+        double start_time = omp_get_wtime();
+        for (int j = 0; j < n_values; j++) {
+            sums[j] = 0;
+        }
+        for (int cluster = 0; cluster < n_clusters; cluster++) {
+            counts[cluster] = 0;
+        }
+        for (int set = 0; set < n_sets; set++) {
+            for (int j = 0; j < n_values; j++) {
+                sums[j] += set_sums[set * n_values + j];
+            }
+            for (int cluster = 0; cluster < n_clusters; cluster++) {
+                counts[cluster] += set_counts[set * n_clusters + cluster];
+            }
+        }
+
+        for (int cluster = 0; cluster < n_clusters; cluster++) {
+            if (counts[cluster]) {
+                for (int channel = 0; channel < n_channels; channel++) {
+                    centers[cluster * n_channels + channel] = sums[cluster * n_channels + channel] / counts[cluster];
+                }
+                continue;
+            }
+
+            long farthest = farthest_pixel(&image);
+            for (int channel = 0; channel < n_channels; channel++) {
+                centers[cluster * n_channels + channel] = data[(size_t) farthest * n_channels + channel];
+            }
+
+            // the next empty cluster must not pick the same pixel
+            memset((char *) image.distances + (size_t) farthest * image.distance_size, 0, image.distance_size);
+        }
+        merge_time += omp_get_wtime() - start_time;
+    }
+    loop_time = omp_get_wtime() - loop_time;
+
+    // Write the compressed pixels back, slab by slab
+    double update_data_time = omp_get_wtime();
+    for (int set = 0; set < n_sets; set++) {
+        gpu_engine_write_centers(&sets[set], centers);
+    }
+    stream_slabs(sets, n_sets, &image, 1, &streamed_bytes);
+    for (int set = 0; set < n_sets; set++) {
+        CL_CHECK(clFinish(sets[set].queue));
+    }
+    update_data_time = omp_get_wtime() - update_data_time;
+
+    program_cache_info_t *build_info = &engine->build_info;
+    printf("[+] Printing times: \n");
+    printf("\t[+] build_program_time: %f (%s)\n", build_info->build_time, build_info->hit ? "cached binary" : build_info->stored ? "compiled, cached" : "compiled");
+    printf("\t[+] transfer_data_time: %f\n", transfer_data_time);
+    printf("\t[+] merge_time: %f\n", merge_time);
+    printf("\t[+] update_data_time: %f\n", update_data_time);
+    printf("\t[+] loop_time: %f\n", loop_time);
+    printf("\t[+] iterations: %d\n", iterations);
+    printf("\t[+] throughput: %.2f Mpixels/s (%d-bit kernels)\n", loop_time > 0 ? (double)n_pixels * iterations / loop_time / 1e6 : 0, engine->precision);
+    printf("\t[+] streamed: %zu bytes (%.2f GB/s over the loop and the write back)\n", streamed_bytes,
+           loop_time + update_data_time > 0 ? streamed_bytes / (loop_time + update_data_time) / 1e9 : 0);
+    fflush(stdout);
+
+    // the caller releases its own engine, the copy in set 0 only held its buffers
+    gpu_engine_unbind(&sets[0]);
+    for (int set = 1; set < n_sets; set++) {
+        gpu_engine_release(&sets[set]);
+    }
+
+    free(sets);
+    free(events);
+    free(rings);
+    free(set_counts);
+    free(set_sums);
+    free(counts);
+    free(sums);
+    free(centers);
+    free(image.distances);
+    free(image.labels);
+
+    return iterations;
+}
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon_protocol.h"
+
+int daemon_read_full(int fd, void *buffer, size_t size)
+{
+    char *bytes = buffer;
+
+    while (size > 0) {
+        ssize_t n = read(fd, bytes, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+
+        bytes += n;
+        size -= n;
+    }
+
+    return 1;
+}
+
+int daemon_write_full(int fd, const void *buffer, size_t size)
+{
+    const char *bytes = buffer;
+
+    while (size > 0) {
+        // a client that went away must not take the daemon down with SIGPIPE
+        ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+
+        bytes += n;
+        size -= n;
+    }
+
+    return 1;
+}
+
+int daemon_write_fd(int fd, const void *buffer, size_t size, int passed_fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    // the descriptor rides along with the first byte, the rest is an ordinary write
+    struct iovec iov = { (void *) buffer, 1 };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &passed_fd, sizeof(int));
+
+    if (size == 0 || sendmsg(fd, &message, MSG_NOSIGNAL) != 1) {
+        return 0;
+    }
+
+    return daemon_write_full(fd, (const char *) buffer + 1, size - 1);
+}
+
+int daemon_read_fd(int fd, void *buffer, size_t size, int *received_fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    *received_fd = -1;
+
+    struct iovec iov = { buffer, 1 };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(fd, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (size == 0 || n != 1) {
+        return 0;
+    }
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+        memcpy(received_fd, CMSG_DATA(header), sizeof(int));
+    }
+
+    return daemon_read_full(fd, (char *) buffer + 1, size - 1);
+}
+
+void daemon_reply_init(daemon_reply_t *reply, int status)
+{
+    memset(reply, 0, sizeof(daemon_reply_t));
+    reply->magic = DAEMON_MAGIC;
+    reply->status = status;
+}
+
+int daemon_send_reply(int fd, const daemon_reply_t *reply, const void *payload)
+{
+    return daemon_write_full(fd, reply, sizeof(daemon_reply_t)) && daemon_write_full(fd, payload, reply->payload_bytes);
+}
+
+int daemon_connect(const char *path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int daemon_submit(const char *path, const daemon_request_t *request, const void *payload, int passed_fd, void *result, daemon_reply_t *reply)
+{
+    int fd = daemon_connect(path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int status = -1;
+    if (daemon_write_full(fd, request, sizeof(daemon_request_t)) && daemon_read_full(fd, reply, sizeof(daemon_reply_t))) {
+        status = reply->status;
+
+        if (status == DAEMON_ACCEPTED) {
+            int sent = passed_fd >= 0 ? daemon_write_fd(fd, payload, request->payload_bytes, passed_fd)
+                                      : daemon_write_full(fd, payload, request->payload_bytes);
+
+            status = -1;
+            if (sent && daemon_read_full(fd, reply, sizeof(daemon_reply_t))) {
+                status = reply->status;
+                if (status == DAEMON_OK && reply->payload_bytes > 0 && !daemon_read_full(fd, result, reply->payload_bytes)) {
+                    status = -1;
+                }
+            }
+        }
+    }
+
+    close(fd);
+    return status;
+}
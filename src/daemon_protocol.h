@@ -0,0 +1,71 @@
+#ifndef DAEMON_PROTOCOL_H
+#define DAEMON_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DAEMON_MAGIC 0x6b6d6432   // "kmd2"
+#define DAEMON_DEFAULT_SOCKET "/tmp/kmeansd.sock"
+#define DAEMON_MAX_PATH 4096
+
+// request types
+#define DAEMON_JOB_PIXELS 1       // the payload is width x height x channels bytes, compressed in place and sent back
+#define DAEMON_JOB_FILE 2         // the payload is "input\0output\0", the daemon loads and saves the files itself
+#define DAEMON_STATS 3            // no payload, the reply's is "key value" lines
+#define DAEMON_JOB_SHARED 4       // the pixels are at the start of shared memory the daemon maps, the result goes to output_offset
+                                  // in it; the payload is the POSIX shared memory name, or "" with a memfd attached
+
+// reply status
+#define DAEMON_OK 0
+#define DAEMON_ACCEPTED 1         // the job has a queue slot, send the payload
+#define DAEMON_BUSY 2             // the queue is full, nothing was read, try again later
+#define DAEMON_ERROR 3
+
+// A job takes two round trips on one connection: the header is answered at once with ACCEPTED or BUSY,
+// so a full queue never has to swallow a payload it won't run; after ACCEPTED the client sends the
+// payload and gets the result once a worker is done with it. STATS is answered right away.
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    int32_t width;
+    int32_t height;
+    int32_t n_channels;
+    int32_t n_clusters;
+    int32_t max_iterations;
+    int32_t seed;
+    uint64_t payload_bytes;
+    uint64_t shared_bytes;    // DAEMON_JOB_SHARED: size of the shared memory
+    uint64_t output_offset;   // DAEMON_JOB_SHARED: 0 compresses in place
+} daemon_request_t;
+
+typedef struct {
+    uint32_t magic;
+    int32_t status;
+    int32_t iterations;
+    int32_t queue_depth;      // jobs waiting when the reply was sent
+    double queue_time;        // accepted to picked up by a worker
+    double service_time;      // payload read to result ready
+    uint64_t payload_bytes;
+} daemon_reply_t;
+
+// whole buffers over a stream socket, 0 on EOF or an error
+int daemon_read_full(int fd, void *buffer, size_t size);
+int daemon_write_full(int fd, const void *buffer, size_t size);
+// the same with a descriptor passed along (SCM_RIGHTS); received_fd is -1 if none came
+int daemon_write_fd(int fd, const void *buffer, size_t size, int passed_fd);
+int daemon_read_fd(int fd, void *buffer, size_t size, int *received_fd);
+
+// a reply of status with nothing filled in yet
+void daemon_reply_init(daemon_reply_t *reply, int status);
+// the reply header followed by its payload_bytes of payload
+int daemon_send_reply(int fd, const daemon_reply_t *reply, const void *payload);
+
+// connected socket, -1 if nobody listens
+int daemon_connect(const char *path);
+
+// one attempt at a job: the header, the payload (passed_fd attached if >= 0) once the daemon has a slot,
+// then the reply with its payload into result; the reply's status, DAEMON_BUSY if turned away, -1 if
+// the daemon can't be reached or hung up
+int daemon_submit(const char *path, const daemon_request_t *request, const void *payload, int passed_fd, void *result, daemon_reply_t *reply);
+
+#endif
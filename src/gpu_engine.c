@@ -0,0 +1,1047 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <omp.h>
+#include <CL/cl.h>
+
+#include "gpu_engine.h"
+#include "cl_device.h"
+#include "kernel_source.h"
+#include "program_cache.h"
+
+static void create_kernels(gpu_engine_t *engine)
+{
+    engine->assign_pixels = cl_create_kernel(engine->program, "assign_pixels");
+    engine->accumulate_centers = cl_create_kernel(engine->program, "accumulate_centers");
+    engine->accumulate_centers_global = cl_create_kernel(engine->program, "accumulate_centers_global");
+    engine->assign_accumulate = cl_create_kernel(engine->program, "assign_accumulate");
+    engine->assign_accumulate_global = cl_create_kernel(engine->program, "assign_accumulate_global");
+    engine->centers_finalize = cl_create_kernel(engine->program, "centers_finalize");
+    engine->argmax_distances = cl_create_kernel(engine->program, "argmax_distances");
+    engine->reseed_cluster = cl_create_kernel(engine->program, "reseed_cluster");
+    engine->update_data = cl_create_kernel(engine->program, "update_data");
+    engine->pack_labels = cl_create_kernel(engine->program, "pack_labels");
+    engine->seed_distances = cl_create_kernel(engine->program, "seed_distances");
+    engine->seed_pick = cl_create_kernel(engine->program, "seed_pick");
+    engine->seed_sample = cl_create_kernel(engine->program, "seed_sample");
+    engine->seed_weights = cl_create_kernel(engine->program, "seed_weights");
+}
+
+void gpu_engine_init(gpu_engine_t *engine, const char *device, int precision, cl_command_queue_properties properties)
+{
+    gpu_engine_init_device(engine, cl_select_device(device), precision, properties);
+}
+
+void gpu_engine_init_device(gpu_engine_t *engine, cl_device_id device, int precision, cl_command_queue_properties properties)
+{
+    cl_int clStatus;
+
+    memset(engine, 0, sizeof(gpu_engine_t));
+
+    // Device
+    engine->device = device;
+
+    // Context
+    engine->context = clCreateContext(NULL, 1, &engine->device, NULL, NULL, &clStatus);
+    CL_CHECK(clStatus);
+
+    // Command queue
+    engine->queue = clCreateCommandQueue(engine->context, engine->device, properties, &clStatus);
+    CL_CHECK(clStatus);
+
+    // Kernel variant, the int32 one needs neither doubles nor 64-bit atomics
+    if (precision == GPU_PRECISION_AUTO) {
+        int int64 = cl_device_has_extension(engine->device, "cl_khr_fp64")
+            && cl_device_has_extension(engine->device, "cl_khr_int64_base_atomics");
+        precision = int64 ? GPU_PRECISION_INT64 : GPU_PRECISION_INT32;
+    }
+    engine->precision = precision;
+    engine->center_size = precision == GPU_PRECISION_INT32 ? sizeof(cl_int) : sizeof(cl_long);
+    engine->distance_size = precision == GPU_PRECISION_INT32 ? sizeof(cl_int) : sizeof(cl_double);
+    CL_CHECK(clGetDeviceInfo(engine->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &engine->local_mem_size, NULL));
+
+    // Create and build a program, the source is embedded at build time (kernel_source.c) and
+    // compiled binaries are cached on disk (per build options)
+    const char *options = precision == GPU_PRECISION_INT32 ? "-DKMEANS_INT32" : NULL;
+    engine->program = program_cache_build(engine->context, engine->device, kernel_gpu_source, KERNEL_GPU_SOURCE_SIZE, options, &clStatus, &engine->build_info);
+
+    // Log
+    size_t build_log_len;
+    CL_CHECK(clGetProgramBuildInfo(engine->program, engine->device, CL_PROGRAM_BUILD_LOG, 0, NULL, &build_log_len));
+    if (build_log_len > 2 || clStatus != CL_SUCCESS)
+    {
+        char *build_log =(char *)malloc(sizeof(char)*(build_log_len+1));
+        CL_CHECK(clGetProgramBuildInfo(engine->program, engine->device, CL_PROGRAM_BUILD_LOG,
+                                       build_log_len, build_log, NULL));
+        build_log[build_log_len] = '\0';
+        printf("%s", build_log);
+        free(build_log);
+    }
+    CL_CHECK(clStatus);
+
+    create_kernels(engine);
+
+    // launch parameters found by an earlier autotuning run of this device
+    gpu_tuning_defaults(&engine->tuning);
+    gpu_tuning_load(engine->device, &engine->tuning);
+}
+
+void gpu_engine_clone(gpu_engine_t *engine, const gpu_engine_t *parent, cl_command_queue_properties properties)
+{
+    cl_int clStatus;
+
+    memset(engine, 0, sizeof(gpu_engine_t));
+
+    engine->device = parent->device;
+    engine->context = parent->context;
+    engine->program = parent->program;
+    engine->build_info = parent->build_info;
+    engine->precision = parent->precision;
+    engine->center_size = parent->center_size;
+    engine->distance_size = parent->distance_size;
+    engine->local_mem_size = parent->local_mem_size;
+    engine->tuning = parent->tuning;
+    engine->zero_copy = parent->zero_copy;
+    engine->host_reduce = parent->host_reduce;
+
+    // every engine releases what it holds, so the shared objects need one more reference each
+    CL_CHECK(clRetainContext(engine->context));
+    CL_CHECK(clRetainProgram(engine->program));
+
+    engine->queue = clCreateCommandQueue(engine->context, engine->device, properties, &clStatus);
+    CL_CHECK(clStatus);
+
+    // kernel arguments belong to the kernel object, so every queue needs kernels of its own
+    create_kernels(engine);
+}
+
+void gpu_engine_release(gpu_engine_t *engine)
+{
+    gpu_engine_unbind(engine);
+
+    CL_CHECK(clReleaseKernel(engine->assign_pixels));
+    CL_CHECK(clReleaseKernel(engine->accumulate_centers));
+    CL_CHECK(clReleaseKernel(engine->accumulate_centers_global));
+    CL_CHECK(clReleaseKernel(engine->assign_accumulate));
+    CL_CHECK(clReleaseKernel(engine->assign_accumulate_global));
+    CL_CHECK(clReleaseKernel(engine->centers_finalize));
+    CL_CHECK(clReleaseKernel(engine->argmax_distances));
+    CL_CHECK(clReleaseKernel(engine->reseed_cluster));
+    CL_CHECK(clReleaseKernel(engine->update_data));
+    CL_CHECK(clReleaseKernel(engine->pack_labels));
+    CL_CHECK(clReleaseKernel(engine->seed_distances));
+    CL_CHECK(clReleaseKernel(engine->seed_pick));
+    CL_CHECK(clReleaseKernel(engine->seed_sample));
+    CL_CHECK(clReleaseKernel(engine->seed_weights));
+
+    CL_CHECK(clReleaseProgram(engine->program));
+    CL_CHECK(clReleaseCommandQueue(engine->queue));
+    CL_CHECK(clReleaseContext(engine->context));
+}
+
+// global and local sizes for the bound image under the current tuning
+static void divide_work(gpu_engine_t *engine)
+{
+    int n_pixels = engine->n_pixels;
+
+    // Divide work: the tuned sizes are only an upper bound, the device has the last word
+    engine->local_item_size = cl_kernel_local_size(engine->assign_pixels, engine->device, engine->tuning.assign_local, 0);
+    size_t local_item_size_update = cl_kernel_local_size(engine->update_data, engine->device, engine->tuning.assign_local, 0);
+    if (local_item_size_update < engine->local_item_size) {
+        engine->local_item_size = local_item_size_update;
+    }
+    engine->global_item_size = ((n_pixels - 1) / engine->local_item_size + 1) * engine->local_item_size;
+
+    // accumulate_centers: a few pixels per work-item, but never so many per group that
+    // the group's int sums (up to 255 per pixel) could overflow
+    engine->local_item_size_accumulate = cl_kernel_local_size(engine->accumulate_kernel, engine->device, engine->tuning.accumulate_local, 0);
+    size_t local_item_size_fused = cl_kernel_local_size(engine->fused_kernel, engine->device, engine->tuning.accumulate_local, 0);
+    if (local_item_size_fused < engine->local_item_size_accumulate) {
+        engine->local_item_size_accumulate = local_item_size_fused;
+    }
+    size_t num_groups_accumulate = (n_pixels - 1) / (engine->local_item_size_accumulate * engine->tuning.pixels_per_item) + 1;
+    size_t min_groups_accumulate = (n_pixels - 1) / ACCUMULATE_MAX_GROUP_PIXELS + 1;
+    if (num_groups_accumulate < min_groups_accumulate) {
+        num_groups_accumulate = min_groups_accumulate;
+    }
+    engine->global_item_size_accumulate = num_groups_accumulate * engine->local_item_size_accumulate;
+
+    engine->finalize_item_size = engine->n_clusters;
+
+    // Farthest pixel search for the empty clusters, a round per reseeded cluster
+    engine->reseed_rounds = engine->n_clusters < RESEED_ROUNDS ? engine->n_clusters : RESEED_ROUNDS;
+    engine->local_item_size_argmax = cl_kernel_local_size(engine->argmax_distances, engine->device, ARGMAX_LOCAL_SIZE, 1);
+    engine->num_groups_argmax = (n_pixels - 1) / engine->local_item_size_argmax + 1;
+    if (engine->num_groups_argmax > ARGMAX_GROUPS) {
+        engine->num_groups_argmax = ARGMAX_GROUPS;
+    }
+    engine->global_item_size_argmax = engine->num_groups_argmax * engine->local_item_size_argmax;
+    engine->local_item_size_reseed = cl_kernel_local_size(engine->reseed_cluster, engine->device, ARGMAX_GROUPS, 1);
+}
+
+// the pixels of the image: copied to the device, or in host memory the device can map
+static void upload_data(gpu_engine_t *engine, byte_t *data)
+{
+    size_t size = (size_t)engine->n_pixels * engine->n_channels * sizeof(byte_t);
+
+    engine->host_data = data;
+    engine->host_ptr = 0;
+
+    if (!engine->zero_copy) {
+        engine->data = cl_create_buffer(engine->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, data);
+        engine->upload_bytes += size;
+        return;
+    }
+
+    // page-aligned pixels (e.g. from an arena) are used in place, anything else goes through
+    // host memory the runtime allocates for sharing with the device
+    if ((uintptr_t)data % sysconf(_SC_PAGESIZE) == 0) {
+        engine->data = cl_create_buffer(engine->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, size, data);
+        engine->host_ptr = 1;
+        return;
+    }
+
+    cl_int clStatus;
+    engine->data = cl_create_buffer(engine->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL);
+    cl_event scratch, *traced = gpu_trace_event(engine->trace, NULL, &scratch);
+    void *mapped = clEnqueueMapBuffer(engine->queue, engine->data, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, size, 0, NULL, traced, &clStatus);
+    CL_CHECK(clStatus);
+    gpu_trace_add(engine->trace, "map data", GPU_TRACE_MAP, 0, engine->queue, traced, NULL);
+    memcpy(mapped, data, size);
+    CL_CHECK(clEnqueueUnmapMemObject(engine->queue, engine->data, mapped, 0, NULL, traced));
+    gpu_trace_add(engine->trace, "unmap data", GPU_TRACE_MAP, size, engine->queue, traced, NULL);
+    engine->upload_bytes += size;
+}
+
+// the initial centers in the width of the kernel variant
+static void upload_centers(gpu_engine_t *engine, const long *centers)
+{
+    int n_values = engine->n_clusters * engine->n_channels;
+    size_t size = n_values * engine->center_size;
+
+    if (engine->precision == GPU_PRECISION_INT32) {
+        cl_int *device_centers = malloc(size);
+
+        for (int i = 0; i < n_values; i++) {
+            device_centers[i] = (cl_int) centers[i];
+        }
+        engine->centers = cl_create_buffer(engine->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, device_centers);
+        free(device_centers);
+    } else {
+        engine->centers = cl_create_buffer(engine->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, (void *) centers);
+    }
+
+    engine->upload_bytes += size;
+}
+
+void gpu_engine_bind(gpu_engine_t *engine, byte_t *data, const long *centers, int n_pixels, int n_channels, int n_clusters, int ring_slots)
+{
+    cl_context context = engine->context;
+    cl_int zero = 0;
+    cl_int no_cluster = -1;
+
+    engine->n_pixels = n_pixels;
+    engine->bound_pixels = n_pixels;
+    engine->n_channels = n_channels;
+    engine->n_clusters = n_clusters;
+    engine->ring_slots = ring_slots;
+
+    engine->upload_bytes = 0;
+    engine->download_bytes = 0;
+    engine->download_time = 0;
+
+    // the per-group sums and counts, and the fused kernel's copy of the centers, in local memory when
+    // they fit next to the kernels' own group counters; a few thousand clusters don't on most devices
+    cl_ulong sums_bytes = (cl_ulong) n_clusters * n_channels * sizeof(cl_int) + (cl_ulong) n_clusters * sizeof(cl_int) + 2 * sizeof(cl_long);
+    cl_ulong centers_bytes = (cl_ulong) n_clusters * n_channels * engine->center_size;
+    int local_accumulate = sums_bytes <= engine->local_mem_size;
+    int local_fused = sums_bytes + centers_bytes <= engine->local_mem_size;
+    engine->accumulate_kernel = local_accumulate ? engine->accumulate_centers : engine->accumulate_centers_global;
+    engine->accumulate_slot_arg = local_accumulate ? 10 : 8;
+    engine->fused_kernel = local_fused ? engine->assign_accumulate : engine->assign_accumulate_global;
+    engine->fused_slot_arg = local_fused ? 13 : 10;
+
+    divide_work(engine);
+
+    // Transfer data from host
+    double start_time = omp_get_wtime();
+    upload_data(engine, data);
+    upload_centers(engine, centers);
+
+    // scratch lives on the device only, the host never reads or writes it unless it merges partial results
+    // or streams slabs of a larger image through the buffers
+    cl_mem_flags partials = engine->host_reduce ? CL_MEM_READ_WRITE : CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS;
+    engine->labels = cl_create_buffer(context, partials, n_pixels * sizeof(int), NULL);
+    engine->distances = cl_create_buffer(context, partials, n_pixels * engine->distance_size, NULL);
+    engine->ring = cl_create_buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, ring_slots * RING_FIELDS * sizeof(cl_long), NULL);
+    engine->converged = cl_create_buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, sizeof(int), NULL);
+    engine->sums = cl_create_buffer(context, partials, n_clusters * n_channels * sizeof(long), NULL);
+    engine->counts = cl_create_buffer(context, partials, n_clusters * sizeof(int), NULL);
+    engine->empty = cl_create_buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, n_clusters * sizeof(int), NULL);
+    engine->group_max = cl_create_buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, ARGMAX_GROUPS * engine->distance_size, NULL);
+    engine->group_index = cl_create_buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, ARGMAX_GROUPS * sizeof(int), NULL);
+
+    // no pixel starts in a cluster, so the first iteration always counts as changed
+    cl_long zero_long = 0;
+    gpu_enqueue_fill(engine, "fill labels", engine->labels, &no_cluster, sizeof(cl_int), 0, n_pixels * sizeof(int));
+    gpu_enqueue_fill(engine, "fill ring", engine->ring, &zero_long, sizeof(cl_long), 0, ring_slots * RING_FIELDS * sizeof(cl_long));
+    gpu_enqueue_fill(engine, "fill converged", engine->converged, &zero, sizeof(cl_int), 0, sizeof(int));
+    gpu_enqueue_fill(engine, "fill sums", engine->sums, &zero_long, sizeof(cl_long), 0, n_clusters * n_channels * sizeof(long));
+    gpu_enqueue_fill(engine, "fill counts", engine->counts, &zero, sizeof(cl_int), 0, n_clusters * sizeof(int));
+    gpu_enqueue_fill(engine, "fill empty", engine->empty, &zero, sizeof(cl_int), 0, n_clusters * sizeof(int));
+    CL_CHECK(clFinish(engine->queue));
+    engine->upload_time = omp_get_wtime() - start_time;
+
+    cl_kernel kernel = engine->assign_pixels;
+    CL_CHECK(clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &engine->data));
+    CL_CHECK(clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &engine->centers));
+    CL_CHECK(clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *) &engine->labels));
+    CL_CHECK(clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *) &engine->distances));
+    CL_CHECK(clSetKernelArg(kernel, 4, sizeof(cl_mem), (void *) &engine->ring));
+    // 5: slot, set per iteration
+    CL_CHECK(clSetKernelArg(kernel, 6, sizeof(cl_mem), (void *) &engine->converged));
+    CL_CHECK(clSetKernelArg(kernel, 7, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(kernel, 8, sizeof(cl_int), (void *) &n_channels));
+    CL_CHECK(clSetKernelArg(kernel, 9, sizeof(cl_int), (void *) &n_clusters));
+
+    kernel = engine->accumulate_kernel;
+    CL_CHECK(clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &engine->data));
+    CL_CHECK(clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &engine->sums));
+    CL_CHECK(clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *) &engine->labels));
+    CL_CHECK(clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *) &engine->counts));
+    CL_CHECK(clSetKernelArg(kernel, 4, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(kernel, 5, sizeof(cl_int), (void *) &n_channels));
+    CL_CHECK(clSetKernelArg(kernel, 6, sizeof(cl_int), (void *) &n_clusters));
+    if (local_accumulate) {
+        // LOCAL
+        CL_CHECK(clSetKernelArg(kernel, 7, n_clusters * n_channels * sizeof(cl_int), NULL));
+        CL_CHECK(clSetKernelArg(kernel, 8, n_clusters * sizeof(cl_int), NULL));
+        CL_CHECK(clSetKernelArg(kernel, 9, sizeof(cl_mem), (void *) &engine->ring));
+        // 10: slot, set per iteration
+        CL_CHECK(clSetKernelArg(kernel, 11, sizeof(cl_mem), (void *) &engine->converged));
+    } else {
+        CL_CHECK(clSetKernelArg(kernel, 7, sizeof(cl_mem), (void *) &engine->ring));
+        // 8: slot, set per iteration
+        CL_CHECK(clSetKernelArg(kernel, 9, sizeof(cl_mem), (void *) &engine->converged));
+    }
+
+    kernel = engine->fused_kernel;
+    CL_CHECK(clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &engine->data));
+    CL_CHECK(clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &engine->centers));
+    CL_CHECK(clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *) &engine->labels));
+    CL_CHECK(clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *) &engine->distances));
+    CL_CHECK(clSetKernelArg(kernel, 4, sizeof(cl_mem), (void *) &engine->sums));
+    CL_CHECK(clSetKernelArg(kernel, 5, sizeof(cl_mem), (void *) &engine->counts));
+    CL_CHECK(clSetKernelArg(kernel, 6, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(kernel, 7, sizeof(cl_int), (void *) &n_channels));
+    CL_CHECK(clSetKernelArg(kernel, 8, sizeof(cl_int), (void *) &n_clusters));
+    if (local_fused) {
+        // LOCAL
+        CL_CHECK(clSetKernelArg(kernel, 9, n_clusters * n_channels * engine->center_size, NULL));
+        CL_CHECK(clSetKernelArg(kernel, 10, n_clusters * n_channels * sizeof(cl_int), NULL));
+        CL_CHECK(clSetKernelArg(kernel, 11, n_clusters * sizeof(cl_int), NULL));
+        CL_CHECK(clSetKernelArg(kernel, 12, sizeof(cl_mem), (void *) &engine->ring));
+        // 13: slot, set per iteration
+        CL_CHECK(clSetKernelArg(kernel, 14, sizeof(cl_mem), (void *) &engine->converged));
+    } else {
+        CL_CHECK(clSetKernelArg(kernel, 9, sizeof(cl_mem), (void *) &engine->ring));
+        // 10: slot, set per iteration
+        CL_CHECK(clSetKernelArg(kernel, 11, sizeof(cl_mem), (void *) &engine->converged));
+    }
+
+    kernel = engine->centers_finalize;
+    CL_CHECK(clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &engine->centers));
+    CL_CHECK(clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &engine->sums));
+    CL_CHECK(clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *) &engine->counts));
+    CL_CHECK(clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *) &engine->empty));
+    CL_CHECK(clSetKernelArg(kernel, 4, sizeof(cl_int), (void *) &n_channels));
+    CL_CHECK(clSetKernelArg(kernel, 5, sizeof(cl_int), (void *) &n_clusters));
+    CL_CHECK(clSetKernelArg(kernel, 6, sizeof(cl_mem), (void *) &engine->ring));
+    // 7: slot, set per iteration
+    CL_CHECK(clSetKernelArg(kernel, 8, sizeof(cl_mem), (void *) &engine->converged));
+
+    kernel = engine->argmax_distances;
+    CL_CHECK(clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &engine->distances));
+    CL_CHECK(clSetKernelArg(kernel, 1, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *) &engine->empty));
+    CL_CHECK(clSetKernelArg(kernel, 3, sizeof(cl_int), (void *) &n_clusters));
+    // 4: round, set per enqueue
+    CL_CHECK(clSetKernelArg(kernel, 5, sizeof(cl_mem), (void *) &engine->group_max));
+    CL_CHECK(clSetKernelArg(kernel, 6, sizeof(cl_mem), (void *) &engine->group_index));
+    // LOCAL
+    CL_CHECK(clSetKernelArg(kernel, 7, engine->local_item_size_argmax * engine->distance_size, NULL));
+    CL_CHECK(clSetKernelArg(kernel, 8, engine->local_item_size_argmax * sizeof(cl_int), NULL));
+    CL_CHECK(clSetKernelArg(kernel, 9, sizeof(cl_mem), (void *) &engine->ring));
+    // 10: slot, set per iteration
+    CL_CHECK(clSetKernelArg(kernel, 11, sizeof(cl_mem), (void *) &engine->converged));
+
+    kernel = engine->reseed_cluster;
+    CL_CHECK(clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &engine->data));
+    CL_CHECK(clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &engine->centers));
+    CL_CHECK(clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *) &engine->distances));
+    CL_CHECK(clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *) &engine->empty));
+    CL_CHECK(clSetKernelArg(kernel, 4, sizeof(cl_int), (void *) &n_channels));
+    CL_CHECK(clSetKernelArg(kernel, 5, sizeof(cl_int), (void *) &n_clusters));
+    // 6: round, set per enqueue
+    CL_CHECK(clSetKernelArg(kernel, 7, sizeof(cl_mem), (void *) &engine->group_max));
+    CL_CHECK(clSetKernelArg(kernel, 8, sizeof(cl_mem), (void *) &engine->group_index));
+    CL_CHECK(clSetKernelArg(kernel, 9, sizeof(cl_int), (void *) &engine->num_groups_argmax));
+    // LOCAL
+    CL_CHECK(clSetKernelArg(kernel, 10, engine->local_item_size_reseed * engine->distance_size, NULL));
+    CL_CHECK(clSetKernelArg(kernel, 11, engine->local_item_size_reseed * sizeof(cl_int), NULL));
+    CL_CHECK(clSetKernelArg(kernel, 12, sizeof(cl_mem), (void *) &engine->ring));
+    // 13: slot, set per iteration
+    CL_CHECK(clSetKernelArg(kernel, 14, sizeof(cl_mem), (void *) &engine->converged));
+
+    kernel = engine->update_data;
+    CL_CHECK(clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &engine->data));
+    CL_CHECK(clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &engine->centers));
+    CL_CHECK(clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *) &engine->labels));
+    CL_CHECK(clSetKernelArg(kernel, 3, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(kernel, 4, sizeof(cl_int), (void *) &n_channels));
+}
+
+void gpu_engine_unbind(gpu_engine_t *engine)
+{
+    cl_mem *buffers[] = {
+        &engine->data, &engine->centers, &engine->labels, &engine->distances, &engine->ring, &engine->converged,
+        &engine->sums, &engine->counts, &engine->empty, &engine->group_max, &engine->group_index, &engine->indices
+    };
+
+    for (size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); i++) {
+        if (*buffers[i]) {
+            CL_CHECK(clReleaseMemObject(*buffers[i]));
+            *buffers[i] = NULL;
+        }
+    }
+}
+
+void gpu_engine_tune(gpu_engine_t *engine, const gpu_tuning_t *tuning)
+{
+    engine->tuning = *tuning;
+
+    if (engine->data) {
+        divide_work(engine);
+    }
+}
+
+// device bytes per pixel: the pixel, its label and its distance
+static size_t pixel_bytes(gpu_engine_t *engine, int n_channels)
+{
+    return n_channels * sizeof(byte_t) + sizeof(cl_int) + engine->distance_size;
+}
+
+int gpu_engine_fits(gpu_engine_t *engine, long n_pixels, int n_channels)
+{
+    cl_ulong max_alloc_size, global_mem_size;
+    CL_CHECK(clGetDeviceInfo(engine->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc_size), &max_alloc_size, NULL));
+    CL_CHECK(clGetDeviceInfo(engine->device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem_size), &global_mem_size, NULL));
+
+    size_t largest = (size_t) n_channels > engine->distance_size ? (size_t) n_channels : engine->distance_size;
+
+    // the kernels index pixels and bytes with ints
+    return n_pixels * largest <= max_alloc_size
+        && n_pixels * pixel_bytes(engine, n_channels) <= global_mem_size
+        && n_pixels * n_channels <= INT_MAX;
+}
+
+long gpu_engine_slab_pixels(gpu_engine_t *engine, int n_channels, int n_slabs)
+{
+    cl_ulong max_alloc_size, global_mem_size;
+    CL_CHECK(clGetDeviceInfo(engine->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc_size), &max_alloc_size, NULL));
+    CL_CHECK(clGetDeviceInfo(engine->device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem_size), &global_mem_size, NULL));
+
+    size_t largest = (size_t) n_channels > engine->distance_size ? (size_t) n_channels : engine->distance_size;
+
+    // half the device memory for the slabs, the runtime and other processes want some too
+    long slab_pixels = global_mem_size / 2 / n_slabs / pixel_bytes(engine, n_channels);
+    if (slab_pixels > (long) (max_alloc_size / largest)) {
+        slab_pixels = max_alloc_size / largest;
+    }
+    if (slab_pixels > INT_MAX / n_channels) {
+        slab_pixels = INT_MAX / n_channels;
+    }
+
+    return slab_pixels;
+}
+
+void gpu_engine_limit(gpu_engine_t *engine, int n_pixels)
+{
+    if (n_pixels < 1 || n_pixels > engine->bound_pixels) {
+        fprintf(stderr, "GPU ENGINE ERROR: << Limit of %d pixels outside the bound image of %d >> \n", n_pixels, engine->bound_pixels);
+        exit(EXIT_FAILURE);
+    }
+
+    engine->n_pixels = n_pixels;
+    divide_work(engine);
+
+    // every kernel that walks the pixels
+    CL_CHECK(clSetKernelArg(engine->assign_pixels, 7, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(engine->accumulate_kernel, 4, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(engine->fused_kernel, 6, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(engine->argmax_distances, 1, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(engine->update_data, 3, sizeof(cl_int), (void *) &n_pixels));
+}
+
+// bytes the kernels that walk the pixels move at least, for the bandwidth in the trace
+static size_t pixel_traffic(gpu_engine_t *engine, size_t bytes_per_pixel)
+{
+    return (size_t) engine->n_pixels * bytes_per_pixel;
+}
+
+void gpu_enqueue_kernel(gpu_engine_t *engine, cl_kernel kernel, const char *name, const size_t *global, const size_t *local, size_t bytes, cl_event *event)
+{
+    cl_event scratch, *traced = gpu_trace_event(engine->trace, event, &scratch);
+
+    CL_CHECK(clEnqueueNDRangeKernel(engine->queue, kernel, 1, NULL, global, local, 0, NULL, traced));
+    gpu_trace_add(engine->trace, name, GPU_TRACE_KERNEL, bytes, engine->queue, traced, event);
+}
+
+void gpu_enqueue_write(gpu_engine_t *engine, const char *name, cl_mem buffer, cl_bool blocking, size_t offset, size_t size, const void *ptr, cl_event *event)
+{
+    cl_event scratch, *traced = gpu_trace_event(engine->trace, event, &scratch);
+
+    CL_CHECK(clEnqueueWriteBuffer(engine->queue, buffer, blocking, offset, size, ptr, 0, NULL, traced));
+    gpu_trace_add(engine->trace, name, GPU_TRACE_WRITE, size, engine->queue, traced, event);
+}
+
+void gpu_enqueue_read(gpu_engine_t *engine, const char *name, cl_mem buffer, cl_bool blocking, size_t offset, size_t size, void *ptr, cl_event *event)
+{
+    cl_event scratch, *traced = gpu_trace_event(engine->trace, event, &scratch);
+
+    CL_CHECK(clEnqueueReadBuffer(engine->queue, buffer, blocking, offset, size, ptr, 0, NULL, traced));
+    gpu_trace_add(engine->trace, name, GPU_TRACE_READ, size, engine->queue, traced, event);
+}
+
+void gpu_enqueue_fill(gpu_engine_t *engine, const char *name, cl_mem buffer, const void *pattern, size_t pattern_size, size_t offset, size_t size)
+{
+    cl_event scratch, *traced = gpu_trace_event(engine->trace, NULL, &scratch);
+
+    CL_CHECK(clEnqueueFillBuffer(engine->queue, buffer, pattern, pattern_size, offset, size, 0, NULL, traced));
+    gpu_trace_add(engine->trace, name, GPU_TRACE_FILL, size, engine->queue, traced, NULL);
+}
+
+void gpu_enqueue_assign(gpu_engine_t *engine, int slot, cl_event *event)
+{
+    // the pixel, its label read and written and its distance
+    size_t bytes = pixel_traffic(engine, engine->n_channels + 2 * sizeof(cl_int) + engine->distance_size);
+
+    if (engine->tuning.fused) {
+        CL_CHECK(clSetKernelArg(engine->fused_kernel, engine->fused_slot_arg, sizeof(cl_int), (void *) &slot));
+        gpu_enqueue_kernel(engine, engine->fused_kernel, "assign_accumulate", &engine->global_item_size_accumulate, &engine->local_item_size_accumulate, bytes, event);
+    } else {
+        CL_CHECK(clSetKernelArg(engine->assign_pixels, 5, sizeof(cl_int), (void *) &slot));
+        gpu_enqueue_kernel(engine, engine->assign_pixels, "assign_pixels", &engine->global_item_size, &engine->local_item_size, bytes, event);
+    }
+}
+
+void gpu_enqueue_accumulate(gpu_engine_t *engine, int slot, cl_event *event)
+{
+    // the fused kernel already did it
+    if (engine->tuning.fused) {
+        return;
+    }
+
+    CL_CHECK(clSetKernelArg(engine->accumulate_kernel, engine->accumulate_slot_arg, sizeof(cl_int), (void *) &slot));
+    gpu_enqueue_kernel(engine, engine->accumulate_kernel, "accumulate_centers", &engine->global_item_size_accumulate, &engine->local_item_size_accumulate,
+                   pixel_traffic(engine, engine->n_channels + sizeof(cl_int)), event);
+}
+
+// new centers of one iteration: the per-cluster division, then a two-stage argmax over the
+// distances for each of the first reseed_rounds empty clusters
+void gpu_enqueue_centers_update(gpu_engine_t *engine, int slot)
+{
+    CL_CHECK(clSetKernelArg(engine->centers_finalize, 7, sizeof(cl_int), (void *) &slot));
+    gpu_enqueue_kernel(engine, engine->centers_finalize, "centers_finalize", &engine->finalize_item_size, NULL, 0, NULL);
+
+    CL_CHECK(clSetKernelArg(engine->argmax_distances, 10, sizeof(cl_int), (void *) &slot));
+    CL_CHECK(clSetKernelArg(engine->reseed_cluster, 13, sizeof(cl_int), (void *) &slot));
+
+    // rounds past the number of empty clusters return straight away on the device
+    for (int round = 0; round < engine->reseed_rounds; round++) {
+        CL_CHECK(clSetKernelArg(engine->argmax_distances, 4, sizeof(cl_int), (void *) &round));
+        gpu_enqueue_kernel(engine, engine->argmax_distances, "argmax_distances", &engine->global_item_size_argmax, &engine->local_item_size_argmax, 0, NULL);
+        CL_CHECK(clSetKernelArg(engine->reseed_cluster, 6, sizeof(cl_int), (void *) &round));
+        gpu_enqueue_kernel(engine, engine->reseed_cluster, "reseed_cluster", &engine->local_item_size_reseed, &engine->local_item_size_reseed, 0, NULL);
+    }
+}
+
+void gpu_enqueue_update_data(gpu_engine_t *engine, cl_event *event)
+{
+    gpu_enqueue_kernel(engine, engine->update_data, "update_data", &engine->global_item_size, &engine->local_item_size,
+                   pixel_traffic(engine, engine->n_channels + sizeof(cl_int)), event);
+}
+
+// the first slot of the batch that reported no changed pixels, if any
+static int check_ring(cl_long *ring, int first_slot, int n_slots, int *iterations)
+{
+    for (int j = 0; j < n_slots; j++) {
+        if (ring[(first_slot + j) * RING_FIELDS] == 0) {
+            *iterations = j + 1;
+            return 1;
+        }
+    }
+
+    *iterations = n_slots;
+    return 0;
+}
+
+int gpu_engine_run(gpu_engine_t *engine, int max_iterations, int batch_size, cl_long *ring, double *host_sync_time)
+{
+    cl_command_queue command_queue = engine->queue;
+    cl_event batch_read[2] = { NULL, NULL };
+    int batch_first_slot[2] = { 0, 0 };
+    int batch_slots[2] = { 0, 0 };
+    int batch_iteration[2] = { 0, 0 };
+    int batch = 0;
+    int done = 0;
+    int iterations = 0;
+    cl_long zero = 0;
+
+    for (int i = 0; i < max_iterations && !done; i += batch_size, batch ^= 1) {
+        int n = (max_iterations - i < batch_size) ? max_iterations - i : batch_size;
+        int first_slot = batch * batch_size;
+
+        gpu_enqueue_fill(engine, "fill ring", engine->ring, &zero, sizeof(cl_long), first_slot * RING_FIELDS * sizeof(cl_long), n * RING_FIELDS * sizeof(cl_long));
+
+        // arguments are captured at enqueue time, so the slot can change between enqueues
+        for (int j = 0; j < n; j++) {
+            int slot = first_slot + j;
+
+            gpu_enqueue_assign(engine, slot, NULL);
+            gpu_enqueue_accumulate(engine, slot, NULL);
+            gpu_enqueue_centers_update(engine, slot);
+        }
+
+        gpu_enqueue_read(engine, "read ring", engine->ring, CL_FALSE, first_slot * RING_FIELDS * sizeof(cl_long), n * RING_FIELDS * sizeof(cl_long), &ring[first_slot * RING_FIELDS], &batch_read[batch]);
+        CL_CHECK(clFlush(command_queue));
+
+        batch_first_slot[batch] = first_slot;
+        batch_slots[batch] = n;
+        batch_iteration[batch] = i;
+
+        // check the previous batch while this one runs
+        int previous = batch ^ 1;
+        if (batch_read[previous]) {
+            double sync_start = omp_get_wtime();
+            CL_CHECK(clWaitForEvents(1, &batch_read[previous]));
+            *host_sync_time += omp_get_wtime() - sync_start;
+
+            clReleaseEvent(batch_read[previous]);
+            batch_read[previous] = NULL;
+
+            int n_iterations;
+            done = check_ring(ring, batch_first_slot[previous], batch_slots[previous], &n_iterations);
+            iterations = batch_iteration[previous] + n_iterations;
+        }
+    }
+
+    // the last batch that is still in flight
+    for (int b = 0; b < 2; b++) {
+        if (batch_read[b]) {
+            double sync_start = omp_get_wtime();
+            CL_CHECK(clWaitForEvents(1, &batch_read[b]));
+            *host_sync_time += omp_get_wtime() - sync_start;
+
+            clReleaseEvent(batch_read[b]);
+            batch_read[b] = NULL;
+
+            if (!done) {
+                int n_iterations;
+                done = check_ring(ring, batch_first_slot[b], batch_slots[b], &n_iterations);
+                iterations = batch_iteration[b] + n_iterations;
+            }
+        }
+    }
+
+    return iterations;
+}
+
+void gpu_engine_read_data(gpu_engine_t *engine, byte_t *data)
+{
+    size_t size = (size_t)engine->n_pixels * engine->n_channels * sizeof(byte_t);
+    double start_time = omp_get_wtime();
+
+    if (!engine->zero_copy) {
+        gpu_enqueue_read(engine, "read data", engine->data, CL_TRUE, 0, size, data, NULL);
+        engine->download_bytes += size;
+    } else {
+        // mapping makes the device's writes visible; wrapped host memory needs no copy when it's the target
+        cl_int clStatus;
+        cl_event scratch, *traced = gpu_trace_event(engine->trace, NULL, &scratch);
+        void *mapped = clEnqueueMapBuffer(engine->queue, engine->data, CL_TRUE, CL_MAP_READ, 0, size, 0, NULL, traced, &clStatus);
+        CL_CHECK(clStatus);
+        gpu_trace_add(engine->trace, "map data", GPU_TRACE_MAP, mapped != data ? size : 0, engine->queue, traced, NULL);
+        if (mapped != data) {
+            memcpy(data, mapped, size);
+            engine->download_bytes += size;
+        }
+        CL_CHECK(clEnqueueUnmapMemObject(engine->queue, engine->data, mapped, 0, NULL, traced));
+        gpu_trace_add(engine->trace, "unmap data", GPU_TRACE_MAP, 0, engine->queue, traced, NULL);
+        CL_CHECK(clFinish(engine->queue));
+    }
+
+    engine->download_time += omp_get_wtime() - start_time;
+}
+
+int gpu_index_bits(int n_clusters)
+{
+    return n_clusters <= 16 ? 4 : n_clusters <= 256 ? 8 : 0;
+}
+
+size_t gpu_index_bytes(int n_pixels, int bits)
+{
+    return bits == 4 ? ((size_t) n_pixels + 1) / 2 : (size_t) n_pixels;
+}
+
+int gpu_engine_read_indices(gpu_engine_t *engine, unsigned char *indices, byte_t *palette)
+{
+    int n_pixels = engine->n_pixels;
+    int n_values = engine->n_clusters * engine->n_channels;
+    cl_int bits = gpu_index_bits(engine->n_clusters);
+    size_t size = gpu_index_bytes(n_pixels, bits);
+    double start_time = omp_get_wtime();
+
+    if (!engine->indices) {
+        engine->indices = cl_create_buffer(engine->context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, engine->bound_pixels, NULL);
+        CL_CHECK(clSetKernelArg(engine->pack_labels, 0, sizeof(cl_mem), (void *) &engine->labels));
+        CL_CHECK(clSetKernelArg(engine->pack_labels, 1, sizeof(cl_mem), (void *) &engine->indices));
+    }
+    CL_CHECK(clSetKernelArg(engine->pack_labels, 2, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(engine->pack_labels, 3, sizeof(cl_int), (void *) &bits));
+
+    long *centers = malloc(n_values * sizeof(long));
+
+    gpu_enqueue_kernel(engine, engine->pack_labels, "pack_labels", &engine->global_item_size, &engine->local_item_size,
+                   pixel_traffic(engine, sizeof(cl_int)) + size, NULL);
+    gpu_enqueue_read(engine, "read indices", engine->indices, CL_TRUE, 0, size, indices, NULL);
+    gpu_engine_read_centers(engine, centers);
+    engine->download_bytes += size;
+
+    // same conversion as update_data
+    for (int i = 0; i < n_values; i++) {
+        palette[i] = (byte_t) centers[i];
+    }
+
+    free(centers);
+
+    engine->download_time += omp_get_wtime() - start_time;
+    return bits;
+}
+
+// a byte of indices per table entry; entry_size is a constant at every call, so the copies are fixed-size moves
+static inline void expand_entries(const unsigned char *indices, const byte_t (*lut)[GPU_LUT_ENTRY], byte_t *data, long n_bytes, int entry_size)
+{
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < n_bytes; i++) {
+        memcpy(&data[i * entry_size], lut[indices[i]], entry_size);
+    }
+}
+
+void gpu_expand_indices(const unsigned char *indices, int bits, const byte_t *palette, int n_clusters, byte_t *data, int n_pixels, int n_channels)
+{
+    // every possible byte of indices and the pixels it stands for, one with 8-bit indices, two with 4-bit ones
+    byte_t lut[256][GPU_LUT_ENTRY];
+    int per_byte = bits == 4 ? 2 : 1;
+    int entry_size = per_byte * n_channels;
+
+    for (int byte = 0; byte < 256; byte++) {
+        for (int p = 0; p < per_byte; p++) {
+            int index = bits == 4 ? (byte >> (4 * p)) & 0xf : byte;
+
+            for (int channel = 0; channel < n_channels; channel++) {
+                lut[byte][p * n_channels + channel] = index < n_clusters ? palette[index * n_channels + channel] : 0;
+            }
+        }
+    }
+
+    // bytes whose pixels are all in the image, an odd last pixel of 4-bit indices is copied on its own
+    long n_bytes = n_pixels / per_byte;
+
+    switch (entry_size) {
+    case 3:
+        expand_entries(indices, lut, data, n_bytes, 3);
+        break;
+    case 4:
+        expand_entries(indices, lut, data, n_bytes, 4);
+        break;
+    case 6:
+        expand_entries(indices, lut, data, n_bytes, 6);
+        break;
+    case 8:
+        expand_entries(indices, lut, data, n_bytes, 8);
+        break;
+    default:
+        expand_entries(indices, lut, data, n_bytes, entry_size);
+        break;
+    }
+
+    if (n_bytes * per_byte < n_pixels) {
+        memcpy(&data[n_bytes * entry_size], lut[indices[n_bytes]], n_channels);
+    }
+}
+
+void gpu_engine_read_palette(gpu_engine_t *engine, byte_t *data)
+{
+    int n_pixels = engine->n_pixels;
+    int n_channels = engine->n_channels;
+    int n_clusters = engine->n_clusters;
+
+    unsigned char *indices = malloc(gpu_index_bytes(n_pixels, gpu_index_bits(n_clusters)));
+    byte_t *palette = malloc(n_clusters * n_channels);
+    int bits = gpu_engine_read_indices(engine, indices, palette);
+    double start_time = omp_get_wtime();
+
+    // the image is overwritten below, so wrapped host memory must not belong to a buffer any more
+    if (engine->host_ptr) {
+        CL_CHECK(clReleaseMemObject(engine->data));
+        engine->data = NULL;
+        engine->host_ptr = 0;
+    }
+
+    gpu_expand_indices(indices, bits, palette, n_clusters, data, n_pixels, n_channels);
+
+    free(palette);
+    free(indices);
+
+    engine->download_time += omp_get_wtime() - start_time;
+}
+
+void gpu_engine_read_centers(gpu_engine_t *engine, long *centers)
+{
+    int n_values = engine->n_clusters * engine->n_channels;
+
+    if (engine->precision == GPU_PRECISION_INT32) {
+        cl_int *device_centers = malloc(n_values * sizeof(cl_int));
+        gpu_enqueue_read(engine, "read centers", engine->centers, CL_TRUE, 0, n_values * sizeof(cl_int), device_centers, NULL);
+
+        for (int i = 0; i < n_values; i++) {
+            centers[i] = device_centers[i];
+        }
+        free(device_centers);
+    } else {
+        gpu_enqueue_read(engine, "read centers", engine->centers, CL_TRUE, 0, n_values * sizeof(cl_long), centers, NULL);
+    }
+
+    engine->download_bytes += n_values * engine->center_size;
+}
+
+void gpu_engine_write_centers(gpu_engine_t *engine, const long *centers)
+{
+    int n_values = engine->n_clusters * engine->n_channels;
+
+    if (engine->precision == GPU_PRECISION_INT32) {
+        cl_int *device_centers = malloc(n_values * sizeof(cl_int));
+
+        for (int i = 0; i < n_values; i++) {
+            device_centers[i] = (cl_int) centers[i];
+        }
+        gpu_enqueue_write(engine, "write centers", engine->centers, CL_TRUE, 0, n_values * sizeof(cl_int), device_centers, NULL);
+        free(device_centers);
+    } else {
+        gpu_enqueue_write(engine, "write centers", engine->centers, CL_TRUE, 0, n_values * sizeof(cl_long), centers, NULL);
+    }
+
+    engine->upload_bytes += n_values * engine->center_size;
+}
+
+void gpu_enqueue_read_partials(gpu_engine_t *engine, long *sums, int *counts, cl_long *ring, cl_event *event)
+{
+    int n_values = engine->n_clusters * engine->n_channels;
+    cl_long zero_long = 0;
+    cl_int zero = 0;
+
+    gpu_enqueue_read(engine, "read sums", engine->sums, CL_FALSE, 0, n_values * sizeof(cl_long), sums, NULL);
+    gpu_enqueue_read(engine, "read counts", engine->counts, CL_FALSE, 0, engine->n_clusters * sizeof(cl_int), counts, NULL);
+    gpu_enqueue_read(engine, "read ring", engine->ring, CL_FALSE, 0, RING_FIELDS * sizeof(cl_long), ring, event);
+    engine->download_bytes += n_values * sizeof(cl_long) + engine->n_clusters * sizeof(cl_int) + RING_FIELDS * sizeof(cl_long);
+
+    gpu_enqueue_fill(engine, "fill sums", engine->sums, &zero_long, sizeof(cl_long), 0, n_values * sizeof(cl_long));
+    gpu_enqueue_fill(engine, "fill counts", engine->counts, &zero, sizeof(cl_int), 0, engine->n_clusters * sizeof(cl_int));
+    CL_CHECK(clFlush(engine->queue));
+}
+
+void gpu_engine_read_distances(gpu_engine_t *engine, double *distances)
+{
+    int n_pixels = engine->n_pixels;
+
+    if (engine->precision == GPU_PRECISION_INT32) {
+        cl_int *device_distances = malloc(n_pixels * sizeof(cl_int));
+        gpu_enqueue_read(engine, "read distances", engine->distances, CL_TRUE, 0, n_pixels * sizeof(cl_int), device_distances, NULL);
+
+        for (int pixel = 0; pixel < n_pixels; pixel++) {
+            distances[pixel] = device_distances[pixel];
+        }
+        free(device_distances);
+    } else {
+        gpu_enqueue_read(engine, "read distances", engine->distances, CL_TRUE, 0, n_pixels * sizeof(cl_double), distances, NULL);
+    }
+
+    engine->download_bytes += n_pixels * engine->distance_size;
+}
+
+void gpu_initialise_centers(byte_t *data, long *centers, long n_pixels, int n_channels, int n_clusters)
+{
+    for (int cluster = 0; cluster < n_clusters; cluster++) {
+        // Pick a random pixel
+        long random_int = rand() % n_pixels;
+
+        // Set the random pixel as one of the centers
+        for (int channel = 0; channel < n_channels; channel++) {
+            // Save picked pixel's channels
+            centers[cluster * n_channels + channel] = data[(size_t) random_int * n_channels + channel];
+        }
+    }
+}
+
+void gpu_host_centers(byte_t *data, long *centers, const long *sums, const int *counts, double *distances, int n_pixels, int n_channels, int n_clusters)
+{
+    for (int cluster = 0; cluster < n_clusters; cluster++) {
+        if (counts[cluster]) {
+            for (int channel = 0; channel < n_channels; channel++) {
+                centers[cluster * n_channels + channel] = sums[cluster * n_channels + channel] / counts[cluster];
+            }
+            continue;
+        }
+
+        // empty cluster: move it onto the farthest pixel
+        double max_distance = -1;
+        int farthest_pixel = 0;
+
+        #pragma omp parallel
+        {
+            double max_distance_local = -1;
+            int farthest_pixel_local = 0;
+
+            #pragma omp for nowait
+            for (int pixel = 0; pixel < n_pixels; pixel++) {
+                if (distances[pixel] > max_distance_local) {
+                    max_distance_local = distances[pixel];
+                    farthest_pixel_local = pixel;
+                }
+            }
+
+            #pragma omp critical
+            {
+                if (max_distance_local > max_distance || (max_distance_local == max_distance && farthest_pixel_local < farthest_pixel)) {
+                    max_distance = max_distance_local;
+                    farthest_pixel = farthest_pixel_local;
+                }
+            }
+        }
+
+        for (int channel = 0; channel < n_channels; channel++) {
+            centers[cluster * n_channels + channel] = data[farthest_pixel * n_channels + channel];
+        }
+
+        // the next empty cluster must not pick the same pixel
+        distances[farthest_pixel] = 0;
+    }
+}
+
+void gpu_tuning_defaults(gpu_tuning_t *tuning)
+{
+    tuning->assign_local = WORKGROUP_SIZE;
+    tuning->accumulate_local = WORKGROUP_SIZE;
+    tuning->pixels_per_item = ACCUMULATE_PIXELS_PER_ITEM;
+    tuning->fused = 0;
+}
+
+// profile-<device hash>.txt next to the cached program binaries
+int gpu_tuning_path(cl_device_id device, char *path, size_t size)
+{
+    char dir[4096 - 64];
+
+    if (!program_cache_dir(dir, sizeof(dir))) {
+        return 0;
+    }
+
+    snprintf(path, size, "%s/profile-%016llx.txt", dir, program_cache_device_hash(device));
+    return 1;
+}
+
+int gpu_tuning_load(cl_device_id device, gpu_tuning_t *tuning)
+{
+    char path[4096];
+    if (!gpu_tuning_path(device, path, sizeof(path))) {
+        return 0;
+    }
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+
+    // "name value" lines, anything else is a comment
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        char name[64];
+        long value;
+
+        if (sscanf(line, "%63s %ld", name, &value) != 2 || value < 0) {
+            continue;
+        }
+
+        if (strcmp(name, "assign_local") == 0 && value > 0) {
+            tuning->assign_local = value;
+        } else if (strcmp(name, "accumulate_local") == 0 && value > 0) {
+            tuning->accumulate_local = value;
+        } else if (strcmp(name, "pixels_per_item") == 0 && value > 0) {
+            tuning->pixels_per_item = value;
+        } else if (strcmp(name, "fused") == 0) {
+            tuning->fused = value != 0;
+        }
+    }
+
+    fclose(fp);
+    return 1;
+}
+
+int gpu_tuning_save(cl_device_id device, const gpu_tuning_t *tuning)
+{
+    char path[4096];
+    if (!gpu_tuning_path(device, path, sizeof(path))) {
+        return 0;
+    }
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        return 0;
+    }
+
+    char name[256] = "";
+    char driver[256] = "";
+    CL_CHECK(clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL));
+    CL_CHECK(clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL));
+
+    fprintf(fp, "# k-means OpenCL launch parameters for %s (driver %s)\n", name, driver);
+    fprintf(fp, "assign_local %zu\n", tuning->assign_local);
+    fprintf(fp, "accumulate_local %zu\n", tuning->accumulate_local);
+    fprintf(fp, "pixels_per_item %d\n", tuning->pixels_per_item);
+    fprintf(fp, "fused %d\n", tuning->fused);
+
+    return fclose(fp) == 0;
+}
+
+double gpu_event_time(cl_event event)
+{
+    cl_ulong start, end;
+
+    CL_CHECK(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL));
+    CL_CHECK(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL));
+
+    return (end - start) * 1e-9;
+}
+
+double gpu_event_span(cl_event first, cl_event last)
+{
+    cl_ulong start, end;
+
+    CL_CHECK(clGetEventProfilingInfo(first, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL));
+    CL_CHECK(clGetEventProfilingInfo(last, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL));
+
+    return (end - start) * 1e-9;
+}
@@ -0,0 +1,208 @@
+#ifndef GPU_ENGINE_H
+#define GPU_ENGINE_H
+
+#include <CL/cl.h>
+
+#include "image_io.h"
+#include "program_cache.h"
+#include "gpu_trace.h"
+
+#define WORKGROUP_SIZE  (1024)
+#define ACCUMULATE_PIXELS_PER_ITEM 16
+#define ACCUMULATE_MAX_GROUP_PIXELS (1 << 23)
+#define ARGMAX_LOCAL_SIZE 256
+#define ARGMAX_GROUPS 64
+// empty clusters reseeded per iteration, the rest wait for the next one
+#define RESEED_ROUNDS 4
+
+// kernel variants: double distances and 64-bit atomics, or int distances and centers with 64-bit
+// counters emulated by 32-bit atomics (KMEANS_INT32 in kernel_gpu.cl); auto picks the first when
+// the device has cl_khr_fp64 and cl_khr_int64_base_atomics
+#define GPU_PRECISION_AUTO 0
+#define GPU_PRECISION_INT32 32
+#define GPU_PRECISION_INT64 64
+
+// bytes of a gpu_expand_indices table entry: two pixels of at most 4 channels
+#define GPU_LUT_ENTRY 8
+
+// [changed pixels, inertia] per slot, see RING_CHANGED/RING_INERTIA in kernel_gpu.cl
+#define RING_FIELDS 2
+
+// launch parameters of the assign and accumulate kernels, swept by kmeans_autotune_gpu
+typedef struct {
+    size_t assign_local;      // assign_pixels and update_data
+    size_t accumulate_local;  // accumulate_centers and assign_accumulate
+    int pixels_per_item;      // pixels every accumulating work-item sums
+    int fused;                // assign_accumulate instead of assign_pixels + accumulate_centers
+} gpu_tuning_t;
+
+typedef struct {
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    program_cache_info_t build_info;
+    int precision;            // GPU_PRECISION_INT32 or GPU_PRECISION_INT64
+    size_t center_size;       // bytes of a center channel on the device
+    size_t distance_size;     // bytes of a pixel's distance on the device
+    cl_ulong local_mem_size;  // CL_DEVICE_LOCAL_MEM_SIZE
+
+    cl_kernel assign_pixels;
+    cl_kernel accumulate_centers;
+    cl_kernel accumulate_centers_global;
+    cl_kernel assign_accumulate;
+    cl_kernel assign_accumulate_global;
+    cl_kernel centers_finalize;
+    cl_kernel argmax_distances;
+    cl_kernel reseed_cluster;
+    cl_kernel update_data;
+    cl_kernel pack_labels;
+    cl_kernel seed_distances;
+    cl_kernel seed_pick;
+    cl_kernel seed_sample;
+    cl_kernel seed_weights;
+
+    // set before gpu_engine_bind: the pixels live in host memory the device maps instead of a copy
+    int zero_copy;
+    // set before gpu_engine_bind: the host reads sums, counts and distances to merge them with its own,
+    // and may read and write the labels. Needs tuning.fused: accumulate_centers skips a ring slot
+    // without changed pixels, which would leave this engine's sums out of the merge
+    int host_reduce;
+    // every command is recorded here when set, the queue must have CL_QUEUE_PROFILING_ENABLE;
+    // clones don't inherit it
+    gpu_trace_t *trace;
+
+    // buffers of the bound image
+    cl_mem data;
+    cl_mem centers;
+    cl_mem labels;
+    cl_mem distances;
+    cl_mem ring;
+    cl_mem converged;
+    cl_mem sums;
+    cl_mem counts;
+    cl_mem empty;
+    cl_mem group_max;
+    cl_mem group_index;
+    cl_mem indices;
+    int n_pixels;             // pixels the kernels work on, see gpu_engine_limit
+    int bound_pixels;         // pixels of the bound image
+    int n_channels;
+    int n_clusters;
+    int ring_slots;
+    int host_ptr;             // data wraps the caller's pixels (CL_MEM_USE_HOST_PTR)
+    byte_t *host_data;
+
+    // bytes the host moved to and from the device for the bound image, mapped copies included
+    size_t upload_bytes;
+    size_t download_bytes;
+    double upload_time;
+    double download_time;
+
+    // accumulate_centers and assign_accumulate as long as the bound clusters' sums (and the fused
+    // kernel's centers) fit the device's local memory, their _global variants otherwise
+    cl_kernel accumulate_kernel;
+    cl_kernel fused_kernel;
+    cl_uint accumulate_slot_arg;
+    cl_uint fused_slot_arg;
+
+    // work division, derived from the tuning and what the device accepts
+    gpu_tuning_t tuning;
+    size_t local_item_size;
+    size_t global_item_size;
+    size_t local_item_size_accumulate;
+    size_t global_item_size_accumulate;
+    size_t finalize_item_size;
+    size_t local_item_size_argmax;
+    size_t global_item_size_argmax;
+    size_t local_item_size_reseed;
+    cl_int num_groups_argmax;
+    int reseed_rounds;
+} gpu_engine_t;
+
+// device, context, queue, program and kernels; the tuning comes from the device's profile if there is one
+void gpu_engine_init(gpu_engine_t *engine, const char *device, int precision, cl_command_queue_properties properties);
+void gpu_engine_init_device(gpu_engine_t *engine, cl_device_id device, int precision, cl_command_queue_properties properties);
+void gpu_engine_release(gpu_engine_t *engine);
+// another engine on the parent's context and program with a queue and kernels of its own, so images
+// can be in flight on several queues at once; release it before the parent or after, either works
+void gpu_engine_clone(gpu_engine_t *engine, const gpu_engine_t *parent, cl_command_queue_properties properties);
+
+// uploads an image and the initial centers, sets the kernel arguments
+void gpu_engine_bind(gpu_engine_t *engine, byte_t *data, const long *centers, int n_pixels, int n_channels, int n_clusters, int ring_slots);
+void gpu_engine_unbind(gpu_engine_t *engine);
+void gpu_engine_tune(gpu_engine_t *engine, const gpu_tuning_t *tuning);
+// whether an image of n_pixels fits the device's allocation limits in one piece
+int gpu_engine_fits(gpu_engine_t *engine, long n_pixels, int n_channels);
+// largest slab of pixels such that the buffers of n_slabs of them fit the device at once
+long gpu_engine_slab_pixels(gpu_engine_t *engine, int n_channels, int n_slabs);
+
+// the kernels only see the first n_pixels of the bound image from now on, the rest belongs to someone else
+void gpu_engine_limit(gpu_engine_t *engine, int n_pixels);
+
+// enqueue one step of an iteration writing to the given ring slot; event may be NULL
+void gpu_enqueue_assign(gpu_engine_t *engine, int slot, cl_event *event);
+void gpu_enqueue_accumulate(gpu_engine_t *engine, int slot, cl_event *event);
+void gpu_enqueue_centers_update(gpu_engine_t *engine, int slot);
+void gpu_enqueue_update_data(gpu_engine_t *engine, cl_event *event);
+
+// a 1D range on the engine's queue, recorded in its trace with the bytes it moves; event may be NULL
+void gpu_enqueue_kernel(gpu_engine_t *engine, cl_kernel kernel, const char *name, const size_t *global, const size_t *local, size_t bytes, cl_event *event);
+// transfers on the engine's queue, recorded in its trace under name; event may be NULL
+void gpu_enqueue_write(gpu_engine_t *engine, const char *name, cl_mem buffer, cl_bool blocking, size_t offset, size_t size, const void *ptr, cl_event *event);
+void gpu_enqueue_read(gpu_engine_t *engine, const char *name, cl_mem buffer, cl_bool blocking, size_t offset, size_t size, void *ptr, cl_event *event);
+void gpu_enqueue_fill(gpu_engine_t *engine, const char *name, cl_mem buffer, const void *pattern, size_t pattern_size, size_t offset, size_t size);
+
+// device-resident loop over the bound image: batches of batch_size iterations are enqueued back to back
+// and the host checks the ring (2 * batch_size slots) of the previous batch while the next one runs;
+// returns the number of iterations, the time spent waiting is added to host_sync_time
+int gpu_engine_run(gpu_engine_t *engine, int max_iterations, int batch_size, cl_long *ring, double *host_sync_time);
+
+// results of the bound image: the expanded pixels, or palette indices plus the palette, expanded on
+// the host (at most 256 clusters); both block until the data is in place
+void gpu_engine_read_data(gpu_engine_t *engine, byte_t *data);
+void gpu_engine_read_palette(gpu_engine_t *engine, byte_t *data);
+
+// palette indices: two pixels per byte (the first in the low nibble) up to 16 clusters, a byte per pixel
+// up to 256, 0 beyond that
+int gpu_index_bits(int n_clusters);
+size_t gpu_index_bytes(int n_pixels, int bits);
+// the packed indices (gpu_index_bytes of them) and the palette as bytes, for an indexed encoder or
+// gpu_expand_indices; returns the bits per index
+int gpu_engine_read_indices(gpu_engine_t *engine, unsigned char *indices, byte_t *palette);
+// indices back to pixels through a table of the pixels every byte of indices stands for
+void gpu_expand_indices(const unsigned char *indices, int bits, const byte_t *palette, int n_clusters, byte_t *data, int n_pixels, int n_channels);
+// the current centers, widened to long whatever the kernel variant
+void gpu_engine_read_centers(gpu_engine_t *engine, long *centers);
+void gpu_engine_write_centers(gpu_engine_t *engine, const long *centers);
+
+// host_reduce engines: reads the sums, counts and [changed, inertia] of ring slot 0 without waiting and
+// clears the sums and counts for the next iteration; event completes with the last read
+void gpu_enqueue_read_partials(gpu_engine_t *engine, long *sums, int *counts, cl_long *ring, cl_event *event);
+// host_reduce engines: the distances of the pixels the kernels see, as doubles whatever the kernel variant
+void gpu_engine_read_distances(gpu_engine_t *engine, double *distances);
+
+// random pixels of data as the initial centers, drawn from rand()
+void gpu_initialise_centers(byte_t *data, long *centers, long n_pixels, int n_channels, int n_clusters);
+// new centers from partial sums merged on the host, the same as centers_finalize and reseed_cluster:
+// empty clusters move onto the farthest pixels of the merged distances
+void gpu_host_centers(byte_t *data, long *centers, const long *sums, const int *counts, double *distances, int n_pixels, int n_channels, int n_clusters);
+
+// initial centers from the bound image, computed on the device (gpu_seed.c); both draw from rand().
+// k-means++ picks every center by its squared distance to the ones before; k-means|| samples about
+// oversampling candidates per round the same way and reduces them to n_clusters with a weighted
+// k-means++ and a few Lloyd iterations on the host
+void gpu_engine_seed_plusplus(gpu_engine_t *engine, long *centers);
+void gpu_engine_seed_parallel(gpu_engine_t *engine, long *centers, int rounds, int oversampling);
+
+void gpu_tuning_defaults(gpu_tuning_t *tuning);
+int gpu_tuning_path(cl_device_id device, char *path, size_t size);
+int gpu_tuning_load(cl_device_id device, gpu_tuning_t *tuning);
+int gpu_tuning_save(cl_device_id device, const gpu_tuning_t *tuning);
+
+// seconds between the start and the end of a command of a profiling queue
+double gpu_event_time(cl_event event);
+// seconds from the start of the first command to the end of the last one, both on the same queue
+double gpu_event_span(cl_event first, cl_event last);
+
+#endif
@@ -0,0 +1,324 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <CL/cl.h>
+
+#include "gpu_engine.h"
+#include "cl_device.h"
+
+// workgroups of seed_distances, each sums a contiguous chunk of the distances for the host
+#define SEED_GROUPS 256
+#define SEED_LOCAL_SIZE 256
+// weighted Lloyd iterations over the k-means|| candidates
+#define SEED_REFINE_ITERATIONS 8
+
+typedef struct {
+    cl_mem distances;
+    cl_mem group_sums;
+    cl_mem candidates;
+    cl_float group_sums_host[SEED_GROUPS];
+    int n_groups;
+    int chunk;
+    size_t local_distances;
+    size_t global_distances;
+    size_t local_pick;
+    size_t local_sample;
+    size_t global_sample;
+} seed_state_t;
+
+static void seed_begin(gpu_engine_t *engine, seed_state_t *state, int max_candidates)
+{
+    cl_context context = engine->context;
+    int n_pixels = engine->n_pixels;
+    int n_channels = engine->n_channels;
+
+    state->n_groups = n_pixels < SEED_GROUPS ? n_pixels : SEED_GROUPS;
+    state->chunk = (n_pixels - 1) / state->n_groups + 1;
+    state->local_distances = cl_kernel_local_size(engine->seed_distances, engine->device, SEED_LOCAL_SIZE, 1);
+    state->global_distances = state->n_groups * state->local_distances;
+    state->local_pick = cl_kernel_local_size(engine->seed_pick, engine->device, SEED_LOCAL_SIZE, 1);
+    state->local_sample = cl_kernel_local_size(engine->seed_sample, engine->device, SEED_LOCAL_SIZE, 0);
+    state->global_sample = SEED_GROUPS * state->local_sample;
+
+    state->distances = cl_create_buffer(context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, n_pixels * sizeof(cl_float), NULL);
+    state->group_sums = cl_create_buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, SEED_GROUPS * sizeof(cl_float), NULL);
+    state->candidates = cl_create_buffer(context, CL_MEM_READ_WRITE, max_candidates * sizeof(cl_int), NULL);
+
+    cl_kernel kernel = engine->seed_distances;
+    CL_CHECK(clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &engine->data));
+    CL_CHECK(clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &state->candidates));
+    CL_CHECK(clSetKernelArg(kernel, 4, sizeof(cl_mem), (void *) &state->distances));
+    CL_CHECK(clSetKernelArg(kernel, 5, sizeof(cl_mem), (void *) &state->group_sums));
+    CL_CHECK(clSetKernelArg(kernel, 6, state->local_distances * sizeof(cl_float), NULL));
+    CL_CHECK(clSetKernelArg(kernel, 7, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(kernel, 8, sizeof(cl_int), (void *) &n_channels));
+    CL_CHECK(clSetKernelArg(kernel, 9, sizeof(cl_int), (void *) &state->chunk));
+}
+
+static void seed_end(seed_state_t *state)
+{
+    CL_CHECK(clReleaseMemObject(state->candidates));
+    CL_CHECK(clReleaseMemObject(state->group_sums));
+    CL_CHECK(clReleaseMemObject(state->distances));
+}
+
+// distances to the new candidates [first, last), returns the sum of all distances
+static double seed_update(gpu_engine_t *engine, seed_state_t *state, int first, int last)
+{
+    CL_CHECK(clSetKernelArg(engine->seed_distances, 2, sizeof(cl_int), (void *) &first));
+    CL_CHECK(clSetKernelArg(engine->seed_distances, 3, sizeof(cl_int), (void *) &last));
+    gpu_enqueue_kernel(engine, engine->seed_distances, "seed_distances", &state->global_distances, &state->local_distances,
+                       (size_t) engine->n_pixels * (engine->n_channels + 2 * sizeof(cl_float)), NULL);
+    gpu_enqueue_read(engine, "read group_sums", state->group_sums, CL_TRUE, 0, state->n_groups * sizeof(cl_float), state->group_sums_host, NULL);
+
+    double total = 0;
+    for (int group = 0; group < state->n_groups; group++) {
+        total += state->group_sums_host[group];
+    }
+
+    return total;
+}
+
+// uniform in [0, 1)
+static double seed_uniform(void)
+{
+    return (double) rand() / ((double) RAND_MAX + 1);
+}
+
+static void copy_pixel(const byte_t *data, long *center, int pixel, int n_channels)
+{
+    for (int channel = 0; channel < n_channels; channel++) {
+        center[channel] = data[(size_t) pixel * n_channels + channel];
+    }
+}
+
+void gpu_engine_seed_plusplus(gpu_engine_t *engine, long *centers)
+{
+    int n_pixels = engine->n_pixels;
+    int n_channels = engine->n_channels;
+    int n_clusters = engine->n_clusters;
+
+    seed_state_t state;
+    seed_begin(engine, &state, n_clusters);
+
+    cl_kernel kernel = engine->seed_pick;
+    CL_CHECK(clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &state.distances));
+    CL_CHECK(clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &state.candidates));
+    CL_CHECK(clSetKernelArg(kernel, 5, state.local_pick * sizeof(cl_float), NULL));
+    CL_CHECK(clSetKernelArg(kernel, 6, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(kernel, 7, sizeof(cl_int), (void *) &state.chunk));
+
+    // the first center is a uniformly random pixel
+    cl_int first = rand() % n_pixels;
+    gpu_enqueue_write(engine, "write candidates", state.candidates, CL_TRUE, 0, sizeof(cl_int), &first, NULL);
+    double total = seed_update(engine, &state, 0, 1);
+
+    for (cl_int slot = 1; slot < n_clusters; slot++) {
+        // the group by the host's running sum over the group sums, the pixel within it on the device
+        double target = total * seed_uniform();
+        cl_int group = 0;
+        while (group < state.n_groups - 1 && target >= state.group_sums_host[group]) {
+            target -= state.group_sums_host[group];
+            group++;
+        }
+        cl_float group_target = (cl_float) target;
+
+        CL_CHECK(clSetKernelArg(kernel, 2, sizeof(cl_int), (void *) &slot));
+        CL_CHECK(clSetKernelArg(kernel, 3, sizeof(cl_int), (void *) &group));
+        CL_CHECK(clSetKernelArg(kernel, 4, sizeof(cl_float), (void *) &group_target));
+        gpu_enqueue_kernel(engine, kernel, "seed_pick", &state.local_pick, &state.local_pick, (size_t) state.chunk * sizeof(cl_float), NULL);
+
+        total = seed_update(engine, &state, slot, slot + 1);
+    }
+
+    cl_int *candidates = malloc(n_clusters * sizeof(cl_int));
+    gpu_enqueue_read(engine, "read candidates", state.candidates, CL_TRUE, 0, n_clusters * sizeof(cl_int), candidates, NULL);
+    for (int cluster = 0; cluster < n_clusters; cluster++) {
+        copy_pixel(engine->host_data, &centers[cluster * n_channels], candidates[cluster], n_channels);
+    }
+
+    free(candidates);
+    seed_end(&state);
+}
+
+// index drawn with probability weights[i] / sum, uniformly if they are all 0
+static int sample_weighted(const double *weights, int n)
+{
+    double total = 0;
+    for (int i = 0; i < n; i++) {
+        total += weights[i];
+    }
+    if (total <= 0) {
+        return rand() % n;
+    }
+
+    double target = total * seed_uniform();
+    for (int i = 0; i < n; i++) {
+        if (target < weights[i]) {
+            return i;
+        }
+        target -= weights[i];
+    }
+
+    return n - 1;
+}
+
+// squared distance of a candidate pixel to a center
+static long center_distance(const byte_t *pixel, const long *center, int n_channels)
+{
+    long distance = 0;
+
+    for (int channel = 0; channel < n_channels; channel++) {
+        long tmp = pixel[channel] - center[channel];
+        distance += tmp * tmp;
+    }
+
+    return distance;
+}
+
+// the k-means|| reduction: weighted k-means++ over the candidates, then weighted Lloyd iterations
+// among them; a candidate weighs as much as the pixels it is the nearest of
+static void reduce_candidates(const byte_t *data, const int *candidates, const int *weights, int n_candidates,
+                              long *centers, int n_channels, int n_clusters)
+{
+    double *probabilities = malloc(n_candidates * sizeof(double));
+    long *distances = malloc(n_candidates * sizeof(long));
+    long *sums = malloc(n_clusters * n_channels * sizeof(long));
+    long *counts = malloc(n_clusters * sizeof(long));
+
+    for (int i = 0; i < n_candidates; i++) {
+        probabilities[i] = weights[i];
+        distances[i] = LONG_MAX;
+    }
+
+    for (int cluster = 0; cluster < n_clusters; cluster++) {
+        int pick = sample_weighted(probabilities, n_candidates);
+        copy_pixel(data, &centers[cluster * n_channels], candidates[pick], n_channels);
+
+        for (int i = 0; i < n_candidates; i++) {
+            long distance = center_distance(&data[(size_t) candidates[i] * n_channels], &centers[cluster * n_channels], n_channels);
+            if (distance < distances[i]) {
+                distances[i] = distance;
+            }
+            probabilities[i] = (double) weights[i] * distances[i];
+        }
+    }
+
+    for (int iteration = 0; iteration < SEED_REFINE_ITERATIONS; iteration++) {
+        for (int j = 0; j < n_clusters * n_channels; j++) {
+            sums[j] = 0;
+        }
+        for (int cluster = 0; cluster < n_clusters; cluster++) {
+            counts[cluster] = 0;
+        }
+
+        for (int i = 0; i < n_candidates; i++) {
+            const byte_t *pixel = &data[(size_t) candidates[i] * n_channels];
+            long min_distance = LONG_MAX;
+            int nearest = 0;
+
+            for (int cluster = 0; cluster < n_clusters; cluster++) {
+                long distance = center_distance(pixel, &centers[cluster * n_channels], n_channels);
+                if (distance < min_distance) {
+                    min_distance = distance;
+                    nearest = cluster;
+                }
+            }
+
+            for (int channel = 0; channel < n_channels; channel++) {
+                sums[nearest * n_channels + channel] += (long) weights[i] * pixel[channel];
+            }
+            counts[nearest] += weights[i];
+        }
+
+        // a center nothing weighs on stays where it is
+        for (int cluster = 0; cluster < n_clusters; cluster++) {
+            if (counts[cluster]) {
+                for (int channel = 0; channel < n_channels; channel++) {
+                    centers[cluster * n_channels + channel] = sums[cluster * n_channels + channel] / counts[cluster];
+                }
+            }
+        }
+    }
+
+    free(counts);
+    free(sums);
+    free(distances);
+    free(probabilities);
+}
+
+void gpu_engine_seed_parallel(gpu_engine_t *engine, long *centers, int rounds, int oversampling)
+{
+    int n_pixels = engine->n_pixels;
+    int n_channels = engine->n_channels;
+    int n_clusters = engine->n_clusters;
+
+    // about oversampling candidates per round are expected, twice as many fit
+    cl_int max_candidates = 2 * rounds * oversampling + 1;
+    seed_state_t state;
+    seed_begin(engine, &state, max_candidates);
+    cl_mem count = cl_create_buffer(engine->context, CL_MEM_READ_WRITE, sizeof(cl_int), NULL);
+
+    cl_kernel kernel = engine->seed_sample;
+    CL_CHECK(clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &state.distances));
+    CL_CHECK(clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &state.candidates));
+    CL_CHECK(clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *) &count));
+    CL_CHECK(clSetKernelArg(kernel, 3, sizeof(cl_int), (void *) &max_candidates));
+    CL_CHECK(clSetKernelArg(kernel, 6, sizeof(cl_int), (void *) &n_pixels));
+
+    cl_int n_candidates = 1;
+    cl_int first = rand() % n_pixels;
+    gpu_enqueue_write(engine, "write candidates", state.candidates, CL_TRUE, 0, sizeof(cl_int), &first, NULL);
+    double total = seed_update(engine, &state, 0, 1);
+
+    // oversampling rounds: every pixel joins with probability oversampling * distance / total, then the
+    // distances take the new candidates in
+    for (int round = 0; round < rounds && total > 0 && n_candidates < max_candidates; round++) {
+        cl_float scale = (cl_float) (oversampling / total);
+        cl_uint seed = (cl_uint) rand();
+        cl_int n_sampled;
+
+        gpu_enqueue_write(engine, "write count", count, CL_TRUE, 0, sizeof(cl_int), &n_candidates, NULL);
+        CL_CHECK(clSetKernelArg(kernel, 4, sizeof(cl_float), (void *) &scale));
+        CL_CHECK(clSetKernelArg(kernel, 5, sizeof(cl_uint), (void *) &seed));
+        gpu_enqueue_kernel(engine, kernel, "seed_sample", &state.global_sample, &state.local_sample, (size_t) n_pixels * sizeof(cl_float), NULL);
+        gpu_enqueue_read(engine, "read count", count, CL_TRUE, 0, sizeof(cl_int), &n_sampled, NULL);
+
+        if (n_sampled > max_candidates) {
+            n_sampled = max_candidates;
+        }
+        if (n_sampled > n_candidates) {
+            total = seed_update(engine, &state, n_candidates, n_sampled);
+            n_candidates = n_sampled;
+        }
+    }
+
+    // weights: the pixels nearest to every candidate
+    cl_mem weights_buffer = cl_create_buffer(engine->context, CL_MEM_READ_WRITE, n_candidates * sizeof(cl_int), NULL);
+    cl_int zero = 0;
+    size_t local_weights = cl_kernel_local_size(engine->seed_weights, engine->device, SEED_LOCAL_SIZE, 0);
+    size_t global_weights = SEED_GROUPS * local_weights;
+    gpu_enqueue_fill(engine, "fill weights", weights_buffer, &zero, sizeof(cl_int), 0, n_candidates * sizeof(cl_int));
+
+    kernel = engine->seed_weights;
+    CL_CHECK(clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &engine->data));
+    CL_CHECK(clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &state.candidates));
+    CL_CHECK(clSetKernelArg(kernel, 2, sizeof(cl_int), (void *) &n_candidates));
+    CL_CHECK(clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *) &weights_buffer));
+    CL_CHECK(clSetKernelArg(kernel, 4, sizeof(cl_int), (void *) &n_pixels));
+    CL_CHECK(clSetKernelArg(kernel, 5, sizeof(cl_int), (void *) &n_channels));
+    gpu_enqueue_kernel(engine, kernel, "seed_weights", &global_weights, &local_weights, (size_t) n_pixels * n_channels, NULL);
+
+    cl_int *candidates = malloc(n_candidates * sizeof(cl_int));
+    cl_int *weights = malloc(n_candidates * sizeof(cl_int));
+    gpu_enqueue_read(engine, "read candidates", state.candidates, CL_TRUE, 0, n_candidates * sizeof(cl_int), candidates, NULL);
+    gpu_enqueue_read(engine, "read weights", weights_buffer, CL_TRUE, 0, n_candidates * sizeof(cl_int), weights, NULL);
+
+    reduce_candidates(engine->host_data, candidates, weights, n_candidates, centers, n_channels, n_clusters);
+
+    free(weights);
+    free(candidates);
+    CL_CHECK(clReleaseMemObject(weights_buffer));
+    CL_CHECK(clReleaseMemObject(count));
+    seed_end(&state);
+}
@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <CL/cl.h>
+
+#include "gpu_trace.h"
+#include "cl_device.h"
+
+#define TRACE_INITIAL_CAPACITY 1024
+#define TRACE_MAX_QUEUES 64
+
+void gpu_trace_init(gpu_trace_t *trace)
+{
+    memset(trace, 0, sizeof(gpu_trace_t));
+}
+
+void gpu_trace_release(gpu_trace_t *trace)
+{
+    for (int i = trace->n_collected; i < trace->n_entries; i++) {
+        clReleaseEvent(trace->entries[i].event);
+    }
+
+    free(trace->entries);
+    memset(trace, 0, sizeof(gpu_trace_t));
+}
+
+cl_event *gpu_trace_event(gpu_trace_t *trace, cl_event *event, cl_event *scratch)
+{
+    if (event || !trace) {
+        return event;
+    }
+
+    return scratch;
+}
+
+void gpu_trace_add(gpu_trace_t *trace, const char *name, const char *category, size_t bytes,
+                   cl_command_queue queue, cl_event *traced, const cl_event *event)
+{
+    if (!trace || !traced) {
+        return;
+    }
+
+    if (trace->n_entries == trace->capacity) {
+        trace->capacity = trace->capacity ? 2 * trace->capacity : TRACE_INITIAL_CAPACITY;
+        trace->entries = realloc(trace->entries, trace->capacity * sizeof(gpu_trace_entry_t));
+    }
+
+    // the scratch event is handed over, the caller's gets a reference of the trace's own
+    if (traced == event) {
+        CL_CHECK(clRetainEvent(*traced));
+    }
+
+    gpu_trace_entry_t *entry = &trace->entries[trace->n_entries++];
+    entry->name = name;
+    entry->category = category;
+    entry->bytes = bytes;
+    entry->queue = queue;
+    entry->event = *traced;
+}
+
+void gpu_trace_collect(gpu_trace_t *trace)
+{
+    for (int i = trace->n_collected; i < trace->n_entries; i++) {
+        gpu_trace_entry_t *entry = &trace->entries[i];
+
+        CL_CHECK(clWaitForEvents(1, &entry->event));
+        CL_CHECK(clGetEventProfilingInfo(entry->event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &entry->queued, NULL));
+        CL_CHECK(clGetEventProfilingInfo(entry->event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &entry->submit, NULL));
+        CL_CHECK(clGetEventProfilingInfo(entry->event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &entry->start, NULL));
+        CL_CHECK(clGetEventProfilingInfo(entry->event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &entry->end, NULL));
+
+        CL_CHECK(clReleaseEvent(entry->event));
+        entry->event = NULL;
+    }
+
+    trace->n_collected = trace->n_entries;
+}
+
+// index of the queue in order of first appearance
+static int queue_index(cl_command_queue *queues, int *n_queues, cl_command_queue queue)
+{
+    for (int i = 0; i < *n_queues; i++) {
+        if (queues[i] == queue) {
+            return i;
+        }
+    }
+
+    if (*n_queues == TRACE_MAX_QUEUES) {
+        return TRACE_MAX_QUEUES - 1;
+    }
+
+    queues[*n_queues] = queue;
+    return (*n_queues)++;
+}
+
+int gpu_trace_write_chrome(gpu_trace_t *trace, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "[!] Can't write the trace to %s\n", path);
+        return 0;
+    }
+
+    gpu_trace_collect(trace);
+
+    // timestamps in microseconds from the first command queued
+    cl_ulong origin = 0;
+    for (int i = 0; i < trace->n_entries; i++) {
+        if (i == 0 || trace->entries[i].queued < origin) {
+            origin = trace->entries[i].queued;
+        }
+    }
+
+    cl_command_queue queues[TRACE_MAX_QUEUES];
+    int n_queues = 0;
+
+    fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (int i = 0; i < trace->n_entries; i++) {
+        gpu_trace_entry_t *entry = &trace->entries[i];
+        int queue = queue_index(queues, &n_queues, entry->queue);
+
+        fprintf(fp, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                    "\"args\": {\"bytes\": %zu, \"queued_to_submit_us\": %.3f, \"submit_to_start_us\": %.3f}},\n",
+                entry->name, entry->category, 2 * queue, (entry->start - origin) * 1e-3, (entry->end - entry->start) * 1e-3,
+                entry->bytes, (entry->submit - entry->queued) * 1e-3, (entry->start - entry->submit) * 1e-3);
+        fprintf(fp, "{\"name\": \"%s\", \"cat\": \"launch\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f},\n",
+                entry->name, 2 * queue + 1, (entry->queued - origin) * 1e-3, (entry->start - entry->queued) * 1e-3);
+    }
+
+    for (int queue = 0; queue < n_queues; queue++) {
+        fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"queue %d\"}},\n", 2 * queue, queue);
+        fprintf(fp, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"queue %d launch\"}},\n", 2 * queue + 1, queue);
+    }
+    fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"OpenCL device\"}}\n");
+    fprintf(fp, "]}\n");
+
+    return fclose(fp) == 0;
+}
+
+typedef struct {
+    const char *name;
+    const char *category;
+    int count;
+    size_t bytes;
+    cl_ulong execution;
+    cl_ulong queued_to_submit;
+    cl_ulong submit_to_start;
+} trace_row_t;
+
+void gpu_trace_summary(gpu_trace_t *trace, int iterations, FILE *out)
+{
+    gpu_trace_collect(trace);
+
+    trace_row_t *rows = calloc(trace->n_entries + 1, sizeof(trace_row_t));
+    int n_rows = 0;
+    cl_ulong busy = 0, first = 0, last = 0;
+
+    // a row per name in order of first appearance
+    for (int i = 0; i < trace->n_entries; i++) {
+        gpu_trace_entry_t *entry = &trace->entries[i];
+        trace_row_t *row = NULL;
+
+        for (int r = 0; r < n_rows; r++) {
+            if (strcmp(rows[r].name, entry->name) == 0 && strcmp(rows[r].category, entry->category) == 0) {
+                row = &rows[r];
+                break;
+            }
+        }
+        if (!row) {
+            row = &rows[n_rows++];
+            row->name = entry->name;
+            row->category = entry->category;
+        }
+
+        row->count++;
+        row->bytes += entry->bytes;
+        row->execution += entry->end - entry->start;
+        row->queued_to_submit += entry->submit - entry->queued;
+        row->submit_to_start += entry->start - entry->submit;
+
+        busy += entry->end - entry->start;
+        if (i == 0 || entry->queued < first) {
+            first = entry->queued;
+        }
+        if (entry->end > last) {
+            last = entry->end;
+        }
+    }
+
+    fprintf(out, "[+] Profile: %d commands, device busy %f of %f s\n", trace->n_entries, busy * 1e-9, (last - first) * 1e-9);
+    fprintf(out, "\t%-20s %-7s %7s %12s %12s %12s %12s %12s %9s\n",
+            "command", "type", "count", "exec_ms", "ms/iter", "mean_us", "queued_us", "submit_us", "GB/s");
+
+    for (int r = 0; r < n_rows; r++) {
+        trace_row_t *row = &rows[r];
+        double execution = row->execution * 1e-9;
+
+        fprintf(out, "\t%-20s %-7s %7d %12.3f %12.3f %12.2f %12.2f %12.2f ",
+                row->name, row->category, row->count, execution * 1e3, iterations > 0 ? execution * 1e3 / iterations : 0,
+                row->execution * 1e-3 / row->count, row->queued_to_submit * 1e-3 / row->count, row->submit_to_start * 1e-3 / row->count);
+        if (row->bytes > 0 && execution > 0) {
+            fprintf(out, "%9.2f\n", row->bytes / execution / 1e9);
+        } else {
+            fprintf(out, "%9s\n", "-");
+        }
+    }
+
+    free(rows);
+}
@@ -0,0 +1,49 @@
+#ifndef GPU_TRACE_H
+#define GPU_TRACE_H
+
+#include <stdio.h>
+#include <CL/cl.h>
+
+// categories of traced commands
+#define GPU_TRACE_KERNEL "kernel"
+#define GPU_TRACE_WRITE "write"
+#define GPU_TRACE_READ "read"
+#define GPU_TRACE_FILL "fill"
+#define GPU_TRACE_MAP "map"
+
+typedef struct {
+    const char *name;         // kernel or transfer, a string literal
+    const char *category;     // one of GPU_TRACE_*
+    size_t bytes;             // bytes moved; for kernels the pixel data they touch at least, 0 if negligible
+    cl_command_queue queue;
+    cl_event event;           // held until gpu_trace_collect
+    cl_ulong queued, submit, start, end;
+} gpu_trace_entry_t;
+
+// every command enqueued on the profiling queues of the engines that point at the trace
+typedef struct {
+    gpu_trace_entry_t *entries;
+    int n_entries;
+    int capacity;
+    int n_collected;
+} gpu_trace_t;
+
+void gpu_trace_init(gpu_trace_t *trace);
+void gpu_trace_release(gpu_trace_t *trace);
+
+// the event to pass to an enqueue: the caller's, scratch when only the trace wants one, NULL when
+// nobody does; trace may be NULL
+cl_event *gpu_trace_event(gpu_trace_t *trace, cl_event *event, cl_event *scratch);
+// records the command behind traced (from gpu_trace_event), the caller keeps its own event
+void gpu_trace_add(gpu_trace_t *trace, const char *name, const char *category, size_t bytes,
+                   cl_command_queue queue, cl_event *traced, const cl_event *event);
+
+// QUEUED, SUBMIT, START and END of every command recorded so far, waiting for those still running
+void gpu_trace_collect(gpu_trace_t *trace);
+
+// chrome://tracing or Perfetto: a track per queue for the execution, one for the time from QUEUED to START
+int gpu_trace_write_chrome(gpu_trace_t *trace, const char *path);
+// per kernel and transfer: count, execution time, launch overhead and achieved bandwidth
+void gpu_trace_summary(gpu_trace_t *trace, int iterations, FILE *out);
+
+#endif
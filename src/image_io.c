@@ -22,7 +22,33 @@ byte_t *img_load(char *img_file, int *width, int *height, int *n_channels)
     return data;
 }
 
-void img_save(char *img_file, byte_t *data, int width, int height, int n_channels)
+byte_t *img_try_load(char *img_file, int *width, int *height, int *n_channels)
+{
+    return stbi_load(img_file, width, height, n_channels, 0);
+}
+
+byte_t *img_load_arena(char *img_file, arena_t *arena, int *width, int *height, int *n_channels)
+{
+    byte_t *decoded = img_load(img_file, width, height, n_channels);
+
+    // the decoder owns its buffer, so move the pixels into the run's arena and give it back right away
+    size_t size = (size_t)*width * *height * *n_channels;
+    byte_t *data = arena_alloc(arena, size);
+    memcpy(data, decoded, size);
+    stbi_image_free(decoded);
+
+    return data;
+}
+
+void img_info(char *img_file, int *width, int *height, int *n_channels)
+{
+    if (!stbi_info(img_file, width, height, n_channels)) {
+        fprintf(stderr, "ERROR LOADING IMAGE: << Invalid file name or format >> \n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int img_try_save(char *img_file, byte_t *data, int width, int height, int n_channels)
 {
     char *ext;
 
@@ -30,18 +56,24 @@ void img_save(char *img_file, byte_t *data, int width, int height, int n_channel
 
     if (!ext) {
         fprintf(stderr, "ERROR SAVING IMAGE: << Unspecified format >> \n\n");
-        return;
+        return 0;
     }
 
     if ((strcmp(ext, ".jpeg") == 0) || (strcmp(ext, ".jpg") == 0)) {
-        stbi_write_jpg(img_file, width, height, n_channels, data, 100);
+        return stbi_write_jpg(img_file, width, height, n_channels, data, 100);
     } else if (strcmp(ext, ".png") == 0) {
-        stbi_write_png(img_file, width, height, n_channels, data, width * n_channels);
+        return stbi_write_png(img_file, width, height, n_channels, data, width * n_channels);
     } else if (strcmp(ext, ".bmp") == 0) {
-        stbi_write_bmp(img_file, width, height, n_channels, data);
+        return stbi_write_bmp(img_file, width, height, n_channels, data);
     } else if (strcmp(ext, ".tga") == 0) {
-        stbi_write_tga(img_file, width, height, n_channels, data);
-    } else {
-        fprintf(stderr, "ERROR SAVING IMAGE: << Unsupported format >> \n\n");
+        return stbi_write_tga(img_file, width, height, n_channels, data);
     }
-}
\ No newline at end of file
+
+    fprintf(stderr, "ERROR SAVING IMAGE: << Unsupported format >> \n\n");
+    return 0;
+}
+
+void img_save(char *img_file, byte_t *data, int width, int height, int n_channels)
+{
+    img_try_save(img_file, data, width, height, n_channels);
+}
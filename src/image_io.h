@@ -2,9 +2,18 @@
 #ifndef IMAGE_IO_H
 #define IMAGE_IO_H
 
+#include "arena.h"
+
 typedef unsigned char byte_t;
 
 byte_t *img_load(char *img_file, int *width, int *height, int *n_channels);
+// NULL instead of exiting when the file can't be decoded
+byte_t *img_try_load(char *img_file, int *width, int *height, int *n_channels);
+// the pixels bump-allocated from arena; anything that links image_io.c links arena.c as well
+byte_t *img_load_arena(char *img_file, arena_t *arena, int *width, int *height, int *n_channels);
+void img_info(char *img_file, int *width, int *height, int *n_channels);
 void img_save(char *img_file, byte_t *data, int width, int height, int n_channels);
+// 0 instead of carrying on when the file can't be written
+int img_try_save(char *img_file, byte_t *data, int width, int height, int n_channels);
 
 #endif
\ No newline at end of file
@@ -1,36 +1,103 @@
+// the host builds with -DKMEANS_INT32 on devices without cl_khr_fp64 or cl_khr_int64_base_atomics:
+// int distances and centers (squared distances of bytes are exact in 32 bits) and 64-bit counters
+// updated with 32-bit atomics
+#ifdef KMEANS_INT32
+typedef int center_t;
+typedef int distance_t;
+
+// a 64-bit counter as (low, high) words, the adder that wraps the low word carries into the high one;
+// the host and the device share the byte order, so the pair reads back as one ulong
+void atom_add64_global(volatile __global uint *counter, ulong value)
+{
+    uint low = (uint) value;
+    uint high = (uint) (value >> 32);
+    uint old = atomic_add(&counter[0], low);
+
+    if (old + low < old) {
+        high++;
+    }
+    if (high) {
+        atomic_add(&counter[1], high);
+    }
+}
+
+void atom_add64_local(volatile __local uint *counter, ulong value)
+{
+    uint low = (uint) value;
+    uint high = (uint) (value >> 32);
+    uint old = atomic_add(&counter[0], low);
+
+    if (old + low < old) {
+        high++;
+    }
+    if (high) {
+        atomic_add(&counter[1], high);
+    }
+}
+
+#define ATOM_ADD64_GLOBAL(counter, value) atom_add64_global((volatile __global uint *) (counter), (ulong) (value))
+#define ATOM_ADD64_LOCAL(counter, value) atom_add64_local((volatile __local uint *) (counter), (ulong) (value))
+#else
 #pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
 
+typedef long center_t;
+typedef double distance_t;
+
+#define ATOM_ADD64_GLOBAL(counter, value) atom_add((counter), (long) (value))
+#define ATOM_ADD64_LOCAL(counter, value) atom_add((counter), (long) (value))
+#endif
+
+// every iteration owns one slot of the ring: [changed pixels, inertia]
+#define RING_CHANGED(ring, slot) ring[2 * (slot)]
+#define RING_INERTIA(ring, slot) ring[2 * (slot) + 1]
+
 __kernel void assign_pixels(__global unsigned char *data,
-                            __global long *centers,
+                            __global center_t *centers,
                             __global int *labels,
-                            __global double *distances,
-                            __global int *changed,
+                            __global distance_t *distances,
+                            __global long *ring,
+                            int slot,
+                            __global int *converged,
                             int n_pixels,
                             int n_channels,
                             int n_clusters
 )
 {
+    __local long group_changed;
+    __local long group_inertia;
+
+    // iterations enqueued after convergence have nothing left to do
+    if (*converged) {
+        return;
+    }
 
     int lid = (int) get_local_id(0);
 
     // gid = pixel
     int gid = (int) get_global_id(0);
 
+    if (lid == 0) {
+        group_changed = 0;
+        group_inertia = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
     int min_cluster = 0;
-    int have_clusters_changed = 0;
+    long changed = 0;
+    long inertia = 0;
 
     while( gid < n_pixels )
     {
-        double min_distance = DBL_MAX;
+        int min_distance = INT_MAX;
         
         // calculate the distance between the pixel and each of the centers
         for (int cluster = 0; cluster < n_clusters; cluster++) {
-            long distance = 0.0f;
+            int distance = 0;
 
             for (int channel = 0; channel < n_channels; channel++) {
-                // calculate euclidean distance between the pixel's channels and the center's channels
-                double tmp = (double) (data[gid * n_channels + channel] - centers[cluster * n_channels + channel]);
-                distance += (tmp * tmp);
+                // squared euclidean distance of bytes and byte-valued centers, exact in integers
+                int tmp = data[gid * n_channels + channel] - (int) centers[cluster * n_channels + channel];
+                distance += tmp * tmp;
             }
 
             if (distance < min_distance) {
@@ -40,277 +107,476 @@ __kernel void assign_pixels(__global unsigned char *data,
         }
 
         distances[gid] = min_distance;
+        inertia += min_distance;
 
-        // if pixel's cluster has changed, update it and set 'has_changed' to True
+        // if pixel's cluster has changed, update it and count it
         if (labels[gid] != min_cluster) {
             labels[gid] = min_cluster;
-            have_clusters_changed = 1;
+            changed++;
         }
 
 
         gid += get_global_size(0);
     }
 
-    // set the outside flag
-    if (have_clusters_changed) {
-        *changed = 1;
+    // one global atomic per workgroup for the iteration's statistics
+    ATOM_ADD64_LOCAL(&group_changed, changed);
+    ATOM_ADD64_LOCAL(&group_inertia, inertia);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid == 0) {
+        ATOM_ADD64_GLOBAL(&RING_CHANGED(ring, slot), group_changed);
+        ATOM_ADD64_GLOBAL(&RING_INERTIA(ring, slot), group_inertia);
     }
 }
 
-__kernel void partial_sum_centers_new(__global unsigned char *data,
-                                  __global long *centers,
-                                  __global int *labels,
-                                  __global double *distances,
-                                  int n_pixels,
-                                  int n_channels,
-                                  int n_clusters,
-                                  __global int *counts,
-                                  __local int* loc
+// every workgroup sums its pixels into local memory for all clusters and channels,
+// so the global sums see one atomic per cluster and channel per workgroup
+__kernel void accumulate_centers(__global unsigned char *data,
+                                 __global long *sums,
+                                 __global int *labels,
+                                 __global int *counts,
+                                 int n_pixels,
+                                 int n_channels,
+                                 int n_clusters,
+                                 __local int *local_sums,
+                                 __local int *local_counts,
+                                 __global long *ring,
+                                 int slot,
+                                 __global int *converged
 )
 {
-    int gid = (int) get_global_id(0);
+    // nothing to update once no pixel changed its cluster
+    if (*converged || RING_CHANGED(ring, slot) == 0) {
+        return;
+    }
+
     int lid = (int) get_local_id(0);
-    int group_id = (int) get_group_id(0);
     int local_size = (int) get_local_size(0);
 
-    if (gid == 0) {
-        // reset centers and initialise clusters' counters
-        for (int cluster = 0; cluster < n_clusters; cluster++) {
+    for (int i = lid; i < n_clusters * n_channels; i += local_size) {
+        local_sums[i] = 0;
+    }
+    for (int i = lid; i < n_clusters; i += local_size) {
+        local_counts[i] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // each work-item walks over many pixels, the host keeps a group below 2^31 / 255 pixels
+    for (int pixel = (int) get_global_id(0); pixel < n_pixels; pixel += (int) get_global_size(0)) {
+        int label = labels[pixel];
+
+        for (int channel = 0; channel < n_channels; channel++) {
+            atomic_add(&local_sums[label * n_channels + channel], data[pixel * n_channels + channel]);
+        }
+        atomic_inc(&local_counts[label]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = lid; i < n_clusters * n_channels; i += local_size) {
+        if (local_sums[i]) {
+            ATOM_ADD64_GLOBAL(&sums[i], local_sums[i]);
+        }
+    }
+    for (int i = lid; i < n_clusters; i += local_size) {
+        if (local_counts[i]) {
+            atomic_add(&counts[i], local_counts[i]);
+        }
+    }
+}
+
+// assign_pixels and accumulate_centers in one pass: every pixel is read once, as a vector,
+// the centers live in local memory and the sums of the new labels go straight to local memory
+__kernel void assign_accumulate(__global unsigned char *data,
+                                __global center_t *centers,
+                                __global int *labels,
+                                __global distance_t *distances,
+                                __global long *sums,
+                                __global int *counts,
+                                int n_pixels,
+                                int n_channels,
+                                int n_clusters,
+                                __local center_t *local_centers,
+                                __local int *local_sums,
+                                __local int *local_counts,
+                                __global long *ring,
+                                int slot,
+                                __global int *converged
+)
+{
+    __local long group_changed;
+    __local long group_inertia;
+
+    if (*converged) {
+        return;
+    }
+
+    int lid = (int) get_local_id(0);
+    int local_size = (int) get_local_size(0);
+
+    for (int i = lid; i < n_clusters * n_channels; i += local_size) {
+        local_centers[i] = centers[i];
+        local_sums[i] = 0;
+    }
+    for (int i = lid; i < n_clusters; i += local_size) {
+        local_counts[i] = 0;
+    }
+    if (lid == 0) {
+        group_changed = 0;
+        group_inertia = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    long changed = 0;
+    long inertia = 0;
+    int px[4];
+
+    for (int pixel = (int) get_global_id(0); pixel < n_pixels; pixel += (int) get_global_size(0)) {
+        // one vector load per pixel for RGB and RGBA images
+        if (n_channels == 3) {
+            uchar3 p = vload3(pixel, data);
+            px[0] = p.x; px[1] = p.y; px[2] = p.z;
+        } else if (n_channels == 4) {
+            uchar4 p = vload4(pixel, data);
+            px[0] = p.x; px[1] = p.y; px[2] = p.z; px[3] = p.w;
+        } else {
             for (int channel = 0; channel < n_channels; channel++) {
-                centers[cluster * n_channels + channel] = 0;
+                px[channel] = data[pixel * n_channels + channel];
             }
-            counts[cluster] = 0;
         }
-    }
 
-    // Wait for all threads
-	barrier(CLK_GLOBAL_MEM_FENCE);
+        int min_distance = INT_MAX;
+        int min_cluster = 0;
 
-    int clusters_channels = n_clusters * (n_channels + 1);
-    int all = n_pixels * clusters_channels;
-    int pixel = gid / clusters_channels;
-    int channel = gid % (n_channels + 1);
-    int cluster = (gid / (n_channels + 1)) % n_clusters;
-    int label = labels[pixel];
+        for (int cluster = 0; cluster < n_clusters; cluster++) {
+            int distance = 0;
 
-    if (gid < all) {
-        if (label == cluster) {
-            if (channel < n_channels) {
-                loc[lid] = data[pixel * n_channels + channel];
+            for (int channel = 0; channel < n_channels; channel++) {
+                int tmp = px[channel] - (int) local_centers[cluster * n_channels + channel];
+                distance += tmp * tmp;
             }
-            else {
-                loc[lid] = 1;
+
+            if (distance < min_distance) {
+                min_distance = distance;
+                min_cluster = cluster;
             }
         }
-        else {
-            loc[lid] = 0;
+
+        if (distances) {
+            distances[pixel] = min_distance;
         }
-    }
+        inertia += min_distance;
 
-	barrier(CLK_LOCAL_MEM_FENCE);
+        // labels are only written when they change
+        if (labels[pixel] != min_cluster) {
+            labels[pixel] = min_cluster;
+            changed++;
+        }
 
-    // Reduction
+        for (int channel = 0; channel < n_channels; channel++) {
+            atomic_add(&local_sums[min_cluster * n_channels + channel], px[channel]);
+        }
+        atomic_inc(&local_counts[min_cluster]);
+    }
 
-    int log2a = log2((float) local_size / clusters_channels);
-    int floorPow2 = exp2((float)log2a) * clusters_channels;
+    ATOM_ADD64_LOCAL(&group_changed, changed);
+    ATOM_ADD64_LOCAL(&group_inertia, inertia);
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-    if (local_size != floorPow2) {
-        if (lid >= floorPow2) {
-            loc[lid - floorPow2] += loc[lid];
+    for (int i = lid; i < n_clusters * n_channels; i += local_size) {
+        if (local_sums[i]) {
+            ATOM_ADD64_GLOBAL(&sums[i], local_sums[i]);
         }
-        barrier(CLK_LOCAL_MEM_FENCE);
     }
-
-    for (int i = (floorPow2 >> 1); i >= clusters_channels; i >>= 1) {
-        if (lid < i) {
-            loc[lid] += loc[lid + i];
+    for (int i = lid; i < n_clusters; i += local_size) {
+        if (local_counts[i]) {
+            atomic_add(&counts[i], local_counts[i]);
         }
-        barrier(CLK_LOCAL_MEM_FENCE);
     }
+    if (lid == 0) {
+        ATOM_ADD64_GLOBAL(&RING_CHANGED(ring, slot), group_changed);
+        ATOM_ADD64_GLOBAL(&RING_INERTIA(ring, slot), group_inertia);
+    }
+}
 
-    // if (gid == 0) {
-    //     printf("\n");
-    //     for (int i = 0; i < 1; i++) {
-    //         for (int j = 0; j < 16; j++) {
-    //             printf("%5d ", loc[i * 16 + j]);
-    //         }
-    //         printf("\n");
-    //     }
-    // }
-
-    barrier(CLK_GLOBAL_MEM_FENCE);
+// accumulate_centers for more clusters than the device's local memory holds: every pixel adds to the
+// global sums, see gpu_engine_bind
+__kernel void accumulate_centers_global(__global unsigned char *data,
+                                        __global long *sums,
+                                        __global int *labels,
+                                        __global int *counts,
+                                        int n_pixels,
+                                        int n_channels,
+                                        int n_clusters,
+                                        __global long *ring,
+                                        int slot,
+                                        __global int *converged
+)
+{
+    if (*converged || RING_CHANGED(ring, slot) == 0) {
+        return;
+    }
 
-    // Sum the results
+    for (int pixel = (int) get_global_id(0); pixel < n_pixels; pixel += (int) get_global_size(0)) {
+        int label = labels[pixel];
 
-    if (lid < clusters_channels)
-    {
-        if (channel < n_channels) {
-            atomic_add(&centers[cluster * n_channels + channel], loc[lid]);
-        }
-        else {
-            atomic_add(&counts[cluster], loc[lid]);
+        for (int channel = 0; channel < n_channels; channel++) {
+            ATOM_ADD64_GLOBAL(&sums[label * n_channels + channel], data[pixel * n_channels + channel]);
         }
+        atomic_inc(&counts[label]);
     }
 }
 
-// deprecated
-__kernel void partial_sum_centers(__global unsigned char *data,
-                                  __global long *centers,
-                                  __global int *labels,
-                                  __global double *distances,
-                                  int n_pixels,
-                                  int n_channels,
-                                  int n_clusters,
-                                  __global int *counts
+// assign_accumulate for more clusters than the device's local memory holds: the centers are read
+// from and the sums added to global memory
+__kernel void assign_accumulate_global(__global unsigned char *data,
+                                       __global center_t *centers,
+                                       __global int *labels,
+                                       __global distance_t *distances,
+                                       __global long *sums,
+                                       __global int *counts,
+                                       int n_pixels,
+                                       int n_channels,
+                                       int n_clusters,
+                                       __global long *ring,
+                                       int slot,
+                                       __global int *converged
 )
 {
-    int gid = (int) get_global_id(0); 
+    __local long group_changed;
+    __local long group_inertia;
+
+    if (*converged) {
+        return;
+    }
+
+    int lid = (int) get_local_id(0);
+
+    if (lid == 0) {
+        group_changed = 0;
+        group_inertia = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    long changed = 0;
+    long inertia = 0;
+
+    for (int pixel = (int) get_global_id(0); pixel < n_pixels; pixel += (int) get_global_size(0)) {
+        int min_distance = INT_MAX;
+        int min_cluster = 0;
 
-    // TODO @jakobm This could probably be optimized with more threads
-    if (gid == 0) {
-        // reset centers and initialise clusters' counters
         for (int cluster = 0; cluster < n_clusters; cluster++) {
+            int distance = 0;
+
             for (int channel = 0; channel < n_channels; channel++) {
-                centers[cluster * n_channels + channel] = 0.0f;
+                int tmp = data[pixel * n_channels + channel] - (int) centers[cluster * n_channels + channel];
+                distance += tmp * tmp;
             }
-            counts[cluster] = 0;
+
+            if (distance < min_distance) {
+                min_distance = distance;
+                min_cluster = cluster;
+            }
+        }
+
+        distances[pixel] = min_distance;
+        inertia += min_distance;
+
+        if (labels[pixel] != min_cluster) {
+            labels[pixel] = min_cluster;
+            changed++;
         }
+
+        for (int channel = 0; channel < n_channels; channel++) {
+            ATOM_ADD64_GLOBAL(&sums[min_cluster * n_channels + channel], data[pixel * n_channels + channel]);
+        }
+        atomic_inc(&counts[min_cluster]);
     }
 
-    // Wait for all threads
-	barrier(CLK_GLOBAL_MEM_FENCE);
+    ATOM_ADD64_LOCAL(&group_changed, changed);
+    ATOM_ADD64_LOCAL(&group_inertia, inertia);
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-    // TODO @jakobm This could probably be optimized by sequential memory access
-    int min_cluster, channel;
-    while(gid < n_pixels)
-    {
-        min_cluster = labels[gid];
+    if (lid == 0) {
+        ATOM_ADD64_GLOBAL(&RING_CHANGED(ring, slot), group_changed);
+        ATOM_ADD64_GLOBAL(&RING_INERTIA(ring, slot), group_inertia);
+    }
+}
 
-        for (channel = 0; channel < n_channels; channel++) {
-            atom_add(&centers[min_cluster * n_channels + channel], ((long) data[gid * n_channels + channel]));
+// one work-item per cluster: divide the sums of the cluster and flag it if it ended up empty
+__kernel void centers_finalize(__global center_t *centers,
+                               __global long *sums,
+                               __global int *counts,
+                               __global int *empty,
+                               int n_channels,
+                               int n_clusters,
+                               __global long *ring,
+                               int slot,
+                               __global int *converged
+)
+{
+    int cluster = (int) get_global_id(0);
+
+    if (*converged) {
+        return;
+    }
+
+    // no pixel changed its cluster: raise the flag so the rest of the enqueued iterations are skipped
+    if (RING_CHANGED(ring, slot) == 0) {
+        if (cluster == 0) {
+            *converged = 1;
         }
+        return;
+    }
 
-        atomic_inc(&counts[min_cluster]);
+    if (cluster >= n_clusters) {
+        return;
+    }
 
-        gid += get_global_size(0);
+    int count = counts[cluster];
+
+    for (int channel = 0; channel < n_channels; channel++) {
+        if (count) {
+            centers[cluster * n_channels + channel] = (center_t) (sums[cluster * n_channels + channel] / count);
+        }
+
+        // leave the sums empty for the next iteration
+        sums[cluster * n_channels + channel] = 0;
     }
+
+    empty[cluster] = count == 0;
+    counts[cluster] = 0;
 }
 
-__kernel void centers_mean(__global unsigned char *data,
-                           __global long *centers,
-                           __global double *distances,
-                           __global int *counts,
-                           int n_pixels,
-                           int n_channels,
-                           int n_clusters
+int count_empty(__global int *empty, int n_clusters)
+{
+    int n_empty = 0;
 
-)
+    for (int cluster = 0; cluster < n_clusters; cluster++) {
+        n_empty += empty[cluster];
+    }
+
+    return n_empty;
+}
+
+// tree reduction of (distance, pixel) pairs in local memory, ties go to the lower pixel index
+void argmax_local(__local distance_t *loc_max, __local int *loc_index)
 {
-    int gid = (int) get_global_id(0); 
     int lid = (int) get_local_id(0);
 
-    // TODO @jakobm This could probably be optimized with more threads
-    if (gid == 0) {
-        for (int cluster = 0; cluster < n_clusters; cluster++) {
-            if (counts[cluster]) {
-                for (int channel = 0; channel < n_channels; channel++) {
-                    centers[cluster * n_channels + channel] /= counts[cluster];
-                }
-            }
-            else {
-                // if the cluster is empty, we find the farthest pixel from its cluster's center
-                long max_distance = 0;
-                int farthest_pixel = 0;
-
-                // find the farthest pixel
-                for (int pixel = 0; pixel < n_pixels; pixel++) {
-                    if (distances[pixel] > max_distance) {
-                        max_distance = distances[pixel];
-                        farthest_pixel = pixel;
-                    }
-                }
-
-                // set the centers channels to the farthest pixel's channels
-                for (int channel = 0; channel < n_channels; channel++) {
-                    centers[cluster * n_channels + channel] = data[farthest_pixel * n_channels + channel];
-                }
-
-                distances[farthest_pixel] = 0;
+    for (int i = (int) get_local_size(0) >> 1; i > 0; i >>= 1) {
+        if (lid < i) {
+            if (loc_max[lid + i] > loc_max[lid] || (loc_max[lid + i] == loc_max[lid] && loc_index[lid + i] < loc_index[lid])) {
+                loc_max[lid] = loc_max[lid + i];
+                loc_index[lid] = loc_index[lid + i];
             }
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// first stage of the farthest pixel search for the round-th empty cluster: every workgroup
+// reduces its share of the distances to one (distance, pixel) pair
+__kernel void argmax_distances(__global distance_t *distances,
+                               int n_pixels,
+                               __global int *empty,
+                               int n_clusters,
+                               int round,
+                               __global distance_t *group_max,
+                               __global int *group_index,
+                               __local distance_t *loc_max,
+                               __local int *loc_index,
+                               __global long *ring,
+                               int slot,
+                               __global int *converged
+)
+{
+    if (*converged || RING_CHANGED(ring, slot) == 0 || round >= count_empty(empty, n_clusters)) {
+        return;
+    }
+
+    int lid = (int) get_local_id(0);
+    distance_t max_distance = -1;
+    int farthest_pixel = -1;
+
+    for (int pixel = (int) get_global_id(0); pixel < n_pixels; pixel += (int) get_global_size(0)) {
+        if (distances[pixel] > max_distance) {
+            max_distance = distances[pixel];
+            farthest_pixel = pixel;
+        }
     }
 
-    // for (int cluster = 0; cluster < n_clusters; cluster++) {
-    //     if (counts[cluster] == 0) {
-    //         if (gid < n_pixels) {
-    //             loc[lid] = distances[gid];
-    //             loc_index[lid] = gid;
-    //         }
-    //         else {
-    //             loc[lid] = DBL_MAX;
-    //             loc_index[lid] = -1;
-    //         }
-
-    //         barrier(CLK_LOCAL_MEM_FENCE);
-
-    //         // Reduction
-
-    //         int log2a = log2((float) get_local_size(0));
-    //         int floorPow2 = exp2((float)log2a);
-
-    //         if (get_local_size(0) != floorPow2) {
-    //             if (lid >= floorPow2) {
-    //                 if (loc[lid - floorPow2] < loc[lid]) {
-    //                     loc[lid - floorPow2] = loc[lid];
-    //                     loc_index[lid - floorPow2] = gid;
-    //                 }
-    //                 barrier(CLK_LOCAL_MEM_FENCE);
-    //             }
-    //         }
-
-    //         for (int i = (floorPow2 >> 1); i > 0; i >>= 1) {
-    //             if (lid < i) {
-    //                 if (loc[lid] < loc[lid + i]) {
-    //                     loc[lid] = loc[lid + i];
-    //                     loc_index[lid] = gid + i;
-    //                 }
-    //             }
-    //             barrier(CLK_LOCAL_MEM_FENCE);
-    //         }
-
-    //         // write to global
-            
-    //         // if (gid == 0) {
-    //         //     // set the centers channels to the farthest pixel's channels
-    //         //     int farthest_pixel = loc_index[0];
-    //         //     for (int channel = 0; channel < n_channels; channel++) {
-    //         //         centers[cluster * n_channels + channel] = data[farthest_pixel * n_channels + channel];
-    //         //     }
-    //         //     distances[farthest_pixel] = 0;
-    //         // }
-
-    //         // if (gid == 0) {
-    //         //     printf("\n\n");
-    //         //     for (int j = 0; j < 64; j++) {
-    //         //         for (int i = 0; i < 16; i++) {
-    //         //             printf("%6.2lf ", loc[j * 16 + i]);
-    //         //         }
-    //         //         printf("\n");
-    //         //     }
-    //         //     printf("\n\n");
-    //         //     for (int j = 0; j < 64; j++) {
-    //         //         for (int i = 0; i < 16; i++) {
-    //         //             printf("%5d ", loc_index[j * 16 + i]);
-    //         //         }
-    //         //         printf("\n");
-    //         //     }
-    //         // }
-    //     }
-    // }
+    loc_max[lid] = max_distance;
+    loc_index[lid] = farthest_pixel;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    argmax_local(loc_max, loc_index);
+
+    if (lid == 0) {
+        group_max[get_group_id(0)] = loc_max[0];
+        group_index[get_group_id(0)] = loc_index[0];
+    }
+}
+
+// second stage, a single workgroup: reduce the groups' pairs and move the round-th empty
+// cluster onto the farthest pixel
+__kernel void reseed_cluster(__global unsigned char *data,
+                             __global center_t *centers,
+                             __global distance_t *distances,
+                             __global int *empty,
+                             int n_channels,
+                             int n_clusters,
+                             int round,
+                             __global distance_t *group_max,
+                             __global int *group_index,
+                             int n_groups,
+                             __local distance_t *loc_max,
+                             __local int *loc_index,
+                             __global long *ring,
+                             int slot,
+                             __global int *converged
+)
+{
+    if (*converged || RING_CHANGED(ring, slot) == 0 || round >= count_empty(empty, n_clusters)) {
+        return;
+    }
+
+    int lid = (int) get_local_id(0);
+
+    loc_max[lid] = -1;
+    loc_index[lid] = -1;
+    for (int group = lid; group < n_groups; group += (int) get_local_size(0)) {
+        if (group_max[group] > loc_max[lid]) {
+            loc_max[lid] = group_max[group];
+            loc_index[lid] = group_index[group];
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    argmax_local(loc_max, loc_index);
+
+    if (lid == 0) {
+        // the round-th empty cluster
+        int cluster = 0;
+        for (int seen = -1; cluster < n_clusters; cluster++) {
+            seen += empty[cluster];
+            if (seen == round) {
+                break;
+            }
+        }
+
+        int farthest_pixel = loc_index[0];
+        for (int channel = 0; channel < n_channels; channel++) {
+            centers[cluster * n_channels + channel] = data[farthest_pixel * n_channels + channel];
+        }
+
+        // the next round must not pick the same pixel
+        distances[farthest_pixel] = 0;
+    }
 }
 
 __kernel void update_data(__global unsigned char *data,
-                          __global long *centers,
+                          __global center_t *centers,
                           __global int *labels,
                           int n_pixels,
                           int n_channels
@@ -330,4 +596,206 @@ __kernel void update_data(__global unsigned char *data,
 
         gid += get_global_size(0);
     }
-}
\ No newline at end of file
+}
+// labels as palette indices for the readback: a byte per pixel with at most 256 clusters, or with
+// bits == 4 two pixels per byte (the first in the low nibble) with at most 16
+__kernel void pack_labels(__global int *labels,
+                          __global unsigned char *indices,
+                          int n_pixels,
+                          int bits
+)
+{
+    if (bits == 4) {
+        int n_bytes = (n_pixels + 1) / 2;
+
+        for (int gid = (int) get_global_id(0); gid < n_bytes; gid += get_global_size(0)) {
+            int pixel = 2 * gid;
+            int high = pixel + 1 < n_pixels ? labels[pixel + 1] : 0;
+
+            indices[gid] = (unsigned char) (labels[pixel] | (high << 4));
+        }
+        return;
+    }
+
+    for (int gid = (int) get_global_id(0); gid < n_pixels; gid += get_global_size(0)) {
+        indices[gid] = (unsigned char) labels[gid];
+    }
+}
+
+// Seeding (k-means++ and k-means||). Seeding distances are floats in both variants: squared
+// distances of bytes are exact in them and the sampling only needs the sums roughly.
+
+// squared distance of a pixel to another pixel of the image
+int pixel_distance(__global unsigned char *data, int pixel, int other, int n_channels)
+{
+    int distance = 0;
+
+    for (int channel = 0; channel < n_channels; channel++) {
+        int tmp = data[pixel * n_channels + channel] - data[other * n_channels + channel];
+        distance += tmp * tmp;
+    }
+
+    return distance;
+}
+
+// the candidates [first, last) are new: every pixel keeps its squared distance to the nearest
+// candidate so far (first == 0 starts over); group g owns the pixels [g * chunk, (g + 1) * chunk)
+// and writes the sum of their distances to group_sums[g]
+__kernel void seed_distances(__global unsigned char *data,
+                             __global int *candidates,
+                             int first,
+                             int last,
+                             __global float *distances,
+                             __global float *group_sums,
+                             __local float *partial,
+                             int n_pixels,
+                             int n_channels,
+                             int chunk
+)
+{
+    int lid = (int) get_local_id(0);
+    int begin = (int) get_group_id(0) * chunk;
+    int end = min(begin + chunk, n_pixels);
+    float sum = 0;
+
+    for (int pixel = begin + lid; pixel < end; pixel += (int) get_local_size(0)) {
+        float distance = first == 0 ? FLT_MAX : distances[pixel];
+
+        for (int candidate = first; candidate < last; candidate++) {
+            distance = min(distance, (float) pixel_distance(data, pixel, candidates[candidate], n_channels));
+        }
+
+        distances[pixel] = distance;
+        sum += distance;
+    }
+
+    partial[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = (int) get_local_size(0) >> 1; i > 0; i >>= 1) {
+        if (lid < i) {
+            partial[lid] += partial[lid + i];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        group_sums[get_group_id(0)] = partial[0];
+    }
+}
+
+// k-means++, a single workgroup: the host picked the group's chunk from the group sums, this scans
+// the chunk's distances block by block and picks the pixel where the running sum passes target;
+// rounding can leave target past the end, then the last pixel with a distance wins
+__kernel void seed_pick(__global float *distances,
+                        __global int *candidates,
+                        int slot,
+                        int group,
+                        float target,
+                        __local float *scan,
+                        int n_pixels,
+                        int chunk
+)
+{
+    __local int picked;
+
+    int lid = (int) get_local_id(0);
+    int size = (int) get_local_size(0);
+    int begin = group * chunk;
+    int end = min(begin + chunk, n_pixels);
+    float base = 0;
+
+    if (lid == 0) {
+        picked = -1;
+    }
+
+    for (int block = begin; block < end; block += size) {
+        int pixel = block + lid;
+        float distance = pixel < end ? distances[pixel] : 0;
+
+        // inclusive scan of the block
+        scan[lid] = distance;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (int offset = 1; offset < size; offset <<= 1) {
+            float value = lid >= offset ? scan[lid - offset] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            scan[lid] += value;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        // the last pixel whose exclusive running sum is still within target is the one that passes it
+        if (distance > 0 && base + scan[lid] - distance <= target) {
+            atomic_max(&picked, pixel);
+        }
+
+        base += scan[size - 1];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        candidates[slot] = picked >= 0 ? picked : begin;
+    }
+}
+
+// a 32-bit integer hash (lowbias32), uniform enough for sampling
+uint seed_hash(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+
+    return x;
+}
+
+// k-means||: every pixel becomes a candidate with probability scale * distance (scale is the
+// oversampling factor over the sum of the distances), appended after n_candidates
+__kernel void seed_sample(__global float *distances,
+                          __global int *candidates,
+                          __global int *n_candidates,
+                          int max_candidates,
+                          float scale,
+                          uint seed,
+                          int n_pixels
+)
+{
+    for (int pixel = (int) get_global_id(0); pixel < n_pixels; pixel += (int) get_global_size(0)) {
+        float distance = distances[pixel];
+        float u = (seed_hash(seed ^ seed_hash((uint) pixel)) >> 8) * (1.0f / 16777216.0f);
+
+        if (distance > 0 && u < scale * distance) {
+            int slot = atomic_inc(n_candidates);
+
+            if (slot < max_candidates) {
+                candidates[slot] = pixel;
+            }
+        }
+    }
+}
+
+// k-means||: how many pixels every candidate is the nearest of, the weights of the host's reduction
+__kernel void seed_weights(__global unsigned char *data,
+                           __global int *candidates,
+                           int n_candidates,
+                           __global int *weights,
+                           int n_pixels,
+                           int n_channels
+)
+{
+    for (int pixel = (int) get_global_id(0); pixel < n_pixels; pixel += (int) get_global_size(0)) {
+        int min_distance = INT_MAX;
+        int nearest = 0;
+
+        for (int candidate = 0; candidate < n_candidates; candidate++) {
+            int distance = pixel_distance(data, pixel, candidates[candidate], n_channels);
+
+            if (distance < min_distance) {
+                min_distance = distance;
+                nearest = candidate;
+            }
+        }
+
+        atomic_inc(&weights[nearest]);
+    }
+}
@@ -0,0 +1,17 @@
+#include "kernel_source.h"
+
+// the assembler copies kernel_gpu.cl into the binary, so main_gpu no longer depends on the
+// working directory; rebuild this file whenever the kernels change
+__asm__(
+    ".section .rodata\n"
+    ".global kernel_gpu_source\n"
+    ".type kernel_gpu_source, @object\n"
+    ".balign 16\n"
+    "kernel_gpu_source:\n"
+    ".incbin \"kernel_gpu.cl\"\n"
+    ".global kernel_gpu_source_end\n"
+    ".type kernel_gpu_source_end, @object\n"
+    "kernel_gpu_source_end:\n"
+    ".byte 0\n"
+    ".previous\n"
+);
@@ -0,0 +1,12 @@
+#ifndef KERNEL_SOURCE_H
+#define KERNEL_SOURCE_H
+
+#include <stddef.h>
+
+// kernel_gpu.cl as it was at build time, zero-terminated
+extern const char kernel_gpu_source[];
+extern const char kernel_gpu_source_end[];
+
+#define KERNEL_GPU_SOURCE_SIZE ((size_t)(kernel_gpu_source_end - kernel_gpu_source))
+
+#endif
@@ -0,0 +1,397 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <omp.h>
+#ifdef WITH_MPI
+#include <mpi.h>
+#endif
+
+#include "image_io.h"
+#include "compression.h"
+#include "percentile.h"
+
+#define DEFAULT_N_CLUSTERS 8
+#define DEFAULT_MAX_ITERATIONS 150
+#define DEFAULT_N_THREADS 1
+#define DEFAULT_N_WORKERS 1
+#define MAX_PATH 4096
+
+typedef struct {
+    char **inputs;
+    char **outputs;
+    long n_items;
+} manifest_t;
+
+// what a worker sends back to the report
+typedef struct {
+    int worker;
+    int pid;
+    long images;
+    long failed;
+    long pixels;
+    double time;              // first claim to the empty queue
+    double busy_time;         // loading, compressing and saving
+    double p50, p99, max;     // latencies of its own images
+} worker_report_t;
+
+// the remaining items, claimed one at a time by whichever worker is free: a counter in shared memory
+// for forked workers, an MPI window on rank 0 across ranks
+typedef struct {
+    long *next;
+#ifdef WITH_MPI
+    MPI_Win window;
+#endif
+    int mpi;
+} work_queue_t;
+
+// "input output" per line; blank lines and lines starting with # are skipped
+static int read_manifest(const char *path, manifest_t *manifest)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+
+    long capacity = 1024;
+    manifest->inputs = malloc(capacity * sizeof(char *));
+    manifest->outputs = malloc(capacity * sizeof(char *));
+    manifest->n_items = 0;
+
+    char line[2 * MAX_PATH + 2];
+    char input[MAX_PATH], output[MAX_PATH];
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || sscanf(line, "%4095s %4095s", input, output) != 2) {
+            continue;
+        }
+
+        if (manifest->n_items == capacity) {
+            capacity *= 2;
+            manifest->inputs = realloc(manifest->inputs, capacity * sizeof(char *));
+            manifest->outputs = realloc(manifest->outputs, capacity * sizeof(char *));
+        }
+
+        manifest->inputs[manifest->n_items] = strdup(input);
+        manifest->outputs[manifest->n_items] = strdup(output);
+        manifest->n_items++;
+    }
+
+    fclose(fp);
+    return 1;
+}
+
+static void free_manifest(manifest_t *manifest)
+{
+    for (long i = 0; i < manifest->n_items; i++) {
+        free(manifest->inputs[i]);
+        free(manifest->outputs[i]);
+    }
+    free(manifest->inputs);
+    free(manifest->outputs);
+}
+
+static long queue_claim(work_queue_t *queue)
+{
+#ifdef WITH_MPI
+    if (queue->mpi) {
+        long one = 1, item;
+
+        MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, queue->window);
+        MPI_Fetch_and_op(&one, &item, MPI_LONG, 0, 0, MPI_SUM, queue->window);
+        MPI_Win_unlock(0, queue->window);
+
+        return item;
+    }
+#endif
+
+    return __atomic_fetch_add(queue->next, 1, __ATOMIC_RELAXED);
+}
+
+// claims items until the queue runs dry; one context per worker keeps its workspace and threads for
+// every image, and every item is seeded by its index, so the result doesn't depend on who took it
+static void run_worker(int worker, const manifest_t *manifest, work_queue_t *queue, const kmeans_config_t *config,
+                       int seed, double *latencies, worker_report_t *report)
+{
+    kmeans_context_t *ctx = kmeans_context_create(config);
+    kmeans_result_t result;
+
+    long capacity = 64;
+    double *own = malloc(capacity * sizeof(double));
+
+    report->worker = worker;
+    report->pid = getpid();
+    report->images = 0;
+    report->failed = 0;
+    report->pixels = 0;
+    report->busy_time = 0;
+
+    double start_time = omp_get_wtime();
+
+    for (long item = queue_claim(queue); item < manifest->n_items; item = queue_claim(queue)) {
+        double image_start = omp_get_wtime();
+
+        int width, height, n_channels;
+        byte_t *data = img_try_load(manifest->inputs[item], &width, &height, &n_channels);
+        if (data == NULL || n_channels > KMEANS_MAX_CHANNELS) {
+            fprintf(stderr, "[!] Worker %d: can't compress %s\n", worker, manifest->inputs[item]);
+            free(data);
+            report->failed++;
+            continue;
+        }
+
+        srand(seed + item);
+        if (!kmeans_context_compress(ctx, data, width, height, n_channels, &result)
+            || !img_try_save(manifest->outputs[item], data, width, height, n_channels)) {
+            fprintf(stderr, "[!] Worker %d: can't compress %s to %s\n", worker, manifest->inputs[item], manifest->outputs[item]);
+            free(data);
+            report->failed++;
+            continue;
+        }
+        free(data);
+
+        double latency = omp_get_wtime() - image_start;
+        latencies[item] = latency;
+
+        if (report->images == capacity) {
+            capacity *= 2;
+            own = realloc(own, capacity * sizeof(double));
+        }
+        own[report->images++] = latency;
+        report->pixels += (long) width * height;
+        report->busy_time += latency;
+    }
+
+    report->time = omp_get_wtime() - start_time;
+
+    qsort(own, report->images, sizeof(double), compare_doubles);
+    report->p50 = report->images ? percentile(own, report->images, 50) : 0;
+    report->p99 = report->images ? percentile(own, report->images, 99) : 0;
+    report->max = report->images ? own[report->images - 1] : 0;
+
+    free(own);
+    kmeans_context_destroy(ctx);
+}
+
+static void print_report(const worker_report_t *reports, int n_workers, const double *latencies, long n_items, double execution_time)
+{
+    long images = 0, failed = 0, pixels = 0;
+
+    printf("[+] Workers: %d\n", n_workers);
+    printf("\t%6s %8s %7s %7s %10s %10s %7s %10s %10s %10s\n",
+           "worker", "pid", "images", "failed", "images/s", "Mpixels/s", "busy%", "p50", "p99", "max");
+
+    for (int w = 0; w < n_workers; w++) {
+        const worker_report_t *report = &reports[w];
+
+        printf("\t%6d %8d %7ld %7ld %10.2f %10.2f %6.1f%% %10.4f %10.4f %10.4f\n",
+               report->worker, report->pid, report->images, report->failed,
+               report->time > 0 ? report->images / report->time : 0, report->time > 0 ? report->pixels / report->time / 1e6 : 0,
+               report->time > 0 ? 100 * report->busy_time / report->time : 0, report->p50, report->p99, report->max);
+
+        images += report->images;
+        failed += report->failed;
+        pixels += report->pixels;
+    }
+
+    // latencies of the images that made it, over all workers
+    double *sorted = malloc((n_items ? n_items : 1) * sizeof(double));
+    long n_sorted = 0;
+    for (long item = 0; item < n_items; item++) {
+        if (latencies[item] > 0) {
+            sorted[n_sorted++] = latencies[item];
+        }
+    }
+    qsort(sorted, n_sorted, sizeof(double), compare_doubles);
+
+    printf("[+] Batch: %ld of %ld images, %ld failed, %.1f Mpixels\n", images, n_items, failed, pixels / 1e6);
+    printf("\t[+] execution_time: %f\n", execution_time);
+    printf("\t[+] throughput: %.2f images/s (%.2f Mpixels/s)\n", images / execution_time, pixels / execution_time / 1e6);
+    if (n_sorted > 0) {
+        printf("\t[+] latency: p50 %f, p99 %f, max %f\n", percentile(sorted, n_sorted, 50), percentile(sorted, n_sorted, 99), sorted[n_sorted - 1]);
+    }
+
+    free(sorted);
+}
+
+int main(int argc, char **argv)
+{
+    int n_ranks = 1;
+#ifdef WITH_MPI
+    int rank;
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &n_ranks);
+#endif
+
+    kmeans_config_t config;
+    config.n_clusters = DEFAULT_N_CLUSTERS;
+    config.max_iterations = DEFAULT_MAX_ITERATIONS;
+    config.n_threads = DEFAULT_N_THREADS;
+    config.schedule = SCHEDULE_STATIC;
+
+    int n_workers = DEFAULT_N_WORKERS;
+    int seed = time(NULL);
+
+    // Parse arguments and optional parameters
+    char optchar;
+    while ((optchar = getopt(argc, argv, "j:k:m:s:t:wh")) != -1) {
+        switch (optchar)
+        {
+        case 'j':
+            n_workers = strtol(optarg, NULL, 10);
+            break;
+        case 'k':
+            config.n_clusters = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            config.max_iterations = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            config.n_threads = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            config.schedule = SCHEDULE_TILES;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-j workers] [-k clusters] [-m iterations] [-s seed] [-t threads per worker] [-w] manifest\n", argv[0]);
+            exit(EXIT_FAILURE);
+            break;
+        }
+    }
+
+    char *manifest_path = argv[optind];
+
+    // Validate input parameters
+    if (manifest_path == NULL) {
+        fprintf(stderr, "INPUT ERROR: << Parameter 'manifest' not defined >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.n_clusters < 2) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of clusters >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.max_iterations < 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid maximum number of iterations >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.n_threads < 1 || n_workers < 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of threads or workers >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    // every rank reads the manifest itself, only the indices of the items go through the queue
+    manifest_t manifest;
+    if (!read_manifest(manifest_path, &manifest)) {
+        fprintf(stderr, "INPUT ERROR: << Can't read the manifest %s >> \n", manifest_path);
+        exit(EXIT_FAILURE);
+    }
+
+    work_queue_t queue;
+    queue.mpi = n_ranks > 1;
+
+#ifdef WITH_MPI
+    if (queue.mpi) {
+        // a worker per rank, the counter lives in rank 0's window
+        MPI_Win_allocate(rank == 0 ? sizeof(long) : 0, sizeof(long), MPI_INFO_NULL, MPI_COMM_WORLD, &queue.next, &queue.window);
+        if (rank == 0) {
+            *queue.next = 0;
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+
+        double *latencies = calloc(manifest.n_items ? manifest.n_items : 1, sizeof(double));
+        worker_report_t report;
+
+        double start_time = MPI_Wtime();
+        run_worker(rank, &manifest, &queue, &config, seed, latencies, &report);
+
+        // every item was compressed by one rank, the others left its latency at 0
+        double *all_latencies = rank == 0 ? calloc(manifest.n_items ? manifest.n_items : 1, sizeof(double)) : NULL;
+        worker_report_t *reports = rank == 0 ? malloc(n_ranks * sizeof(worker_report_t)) : NULL;
+        MPI_Reduce(latencies, all_latencies, manifest.n_items, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+        MPI_Gather(&report, sizeof(worker_report_t), MPI_BYTE, reports, sizeof(worker_report_t), MPI_BYTE, 0, MPI_COMM_WORLD);
+        double execution_time = MPI_Wtime() - start_time;
+
+        if (rank == 0) {
+            print_report(reports, n_ranks, all_latencies, manifest.n_items, execution_time);
+        }
+
+        free(reports);
+        free(all_latencies);
+        free(latencies);
+        MPI_Win_free(&queue.window);
+        free_manifest(&manifest);
+        MPI_Finalize();
+
+        return EXIT_SUCCESS;
+    }
+#endif
+
+    // Forked workers share the counter, the latencies and their reports through an anonymous mapping
+    size_t latencies_size = (manifest.n_items ? manifest.n_items : 1) * sizeof(double);
+    size_t shared_size = sizeof(long) + latencies_size + n_workers * sizeof(worker_report_t);
+    char *shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    queue.next = (long *) shared;
+    double *latencies = (double *) (shared + sizeof(long));
+    worker_report_t *reports = (worker_report_t *) (shared + sizeof(long) + latencies_size);
+
+    // flush before forking, or the children repeat whatever is still buffered
+    fflush(stdout);
+    double start_time = omp_get_wtime();
+
+    pid_t *pids = malloc(n_workers * sizeof(pid_t));
+    for (int w = 0; w < n_workers; w++) {
+        reports[w].worker = w;
+
+        pids[w] = fork();
+        if (pids[w] < 0) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pids[w] == 0) {
+            run_worker(w, &manifest, &queue, &config, seed, latencies, &reports[w]);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    // only the workers: a singleton MPI_Init leaves a child of its own that outlives them
+    int status, crashed = 0;
+    for (int w = 0; w < n_workers; w++) {
+        if (waitpid(pids[w], &status, 0) < 0) {
+            perror("waitpid");
+            crashed++;
+            continue;
+        }
+        crashed += !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+    }
+    free(pids);
+    double execution_time = omp_get_wtime() - start_time;
+
+    if (crashed) {
+        fprintf(stderr, "[!] %d workers died, their last images are missing\n", crashed);
+    }
+    print_report(reports, n_workers, latencies, manifest.n_items, execution_time);
+
+    munmap(shared, shared_size);
+    free_manifest(&manifest);
+#ifdef WITH_MPI
+    MPI_Finalize();
+#endif
+
+    return crashed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
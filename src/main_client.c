@@ -0,0 +1,490 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <omp.h>
+
+#include "image_io.h"
+#include "daemon_protocol.h"
+#include "shared_buffer.h"
+#include "percentile.h"
+
+#define DEFAULT_OUT_PATH "/tmp/kmeans_client.png"
+#define DEFAULT_CONCURRENCY 4
+// the same defaults as main_omp and the daemon
+#define DEFAULT_N_CLUSTERS 8
+#define DEFAULT_MAX_ITERATIONS 150
+// a busy daemon is asked again after this long, doubling up to the maximum
+#define RETRY_MIN_US 1000
+#define RETRY_MAX_US 100000
+
+#define SHARED_MEMFD 1
+#define SHARED_NAMED 2
+
+typedef struct {
+    const char *socket_path;
+    const char *binary;       // per-process baseline, NULL for the daemon
+    const char *input;
+    const char *output;
+    int file_mode;            // the daemon loads and saves the files instead of getting pixels
+    int shared;               // SHARED_MEMFD or SHARED_NAMED: the pixels go by shared memory instead
+    const char *shared_name;  // SHARED_NAMED, a thread's number is appended
+    int n_clusters;
+    int max_iterations;
+    int seed;
+    byte_t *pixels;           // the decoded input of pixel jobs
+    int width, height, n_channels;
+} client_config_t;
+
+// what one thread submits from: its output file, the result of pixel jobs, the shared memory of shared
+// jobs with the pixels in its first half and the result in its second
+typedef struct {
+    char output[DAEMON_MAX_PATH];
+    byte_t *result;
+    shared_buffer_t shared;
+    char shared_name[DAEMON_MAX_PATH];
+} client_slot_t;
+
+typedef struct {
+    const client_config_t *config;
+    int n_requests;
+    int next;
+    double *latencies;
+    int *iterations;
+    long busy;
+    long failed;
+    pthread_mutex_t lock;
+} load_t;
+
+static size_t frame_bytes(const client_config_t *config)
+{
+    return (size_t) config->width * config->height * config->n_channels;
+}
+
+// one attempt: the reply's status, or -1 if the daemon can't be reached
+static int submit(const client_config_t *config, client_slot_t *slot, daemon_reply_t *reply)
+{
+    daemon_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.magic = DAEMON_MAGIC;
+    request.n_clusters = config->n_clusters;
+    request.max_iterations = config->max_iterations;
+    request.seed = config->seed;
+    request.width = config->width;
+    request.height = config->height;
+    request.n_channels = config->n_channels;
+
+    char paths[2 * DAEMON_MAX_PATH];
+    const void *payload;
+    int passed_fd = -1;
+
+    if (config->file_mode) {
+        int input_length = strlen(config->input) + 1;
+        int output_length = strlen(slot->output) + 1;
+        memcpy(paths, config->input, input_length);
+        memcpy(paths + input_length, slot->output, output_length);
+
+        request.type = DAEMON_JOB_FILE;
+        request.payload_bytes = input_length + output_length;
+        payload = paths;
+    } else if (config->shared) {
+        request.type = DAEMON_JOB_SHARED;
+        request.shared_bytes = slot->shared.size;
+        request.output_offset = frame_bytes(config);
+
+        // the memfd goes along with an empty name
+        payload = config->shared == SHARED_NAMED ? slot->shared_name : "";
+        request.payload_bytes = strlen(payload) + 1;
+        passed_fd = config->shared == SHARED_MEMFD ? slot->shared.fd : -1;
+    } else {
+        request.type = DAEMON_JOB_PIXELS;
+        request.payload_bytes = frame_bytes(config);
+        payload = config->pixels;
+    }
+
+    return daemon_submit(config->socket_path, &request, payload, passed_fd, slot->result, reply);
+}
+
+// submits until the daemon takes the job, backing off while it is busy; the latency includes the waits
+static int submit_job(const client_config_t *config, client_slot_t *slot, long *busy, int *iterations, double *latency)
+{
+    double start_time = omp_get_wtime();
+    int wait_us = RETRY_MIN_US;
+    daemon_reply_t reply;
+    int status;
+
+    while ((status = submit(config, slot, &reply)) == DAEMON_BUSY) {
+        (*busy)++;
+        usleep(wait_us);
+        wait_us = wait_us * 2 < RETRY_MAX_US ? wait_us * 2 : RETRY_MAX_US;
+    }
+
+    *latency = omp_get_wtime() - start_time;
+    *iterations = reply.iterations;
+
+    return status == DAEMON_OK;
+}
+
+// the same job as a process of its own, like a script calling main_omp for every image
+static int run_process(const client_config_t *config, const char *output, double *latency)
+{
+    double start_time = omp_get_wtime();
+    char clusters[16], iterations[16], seed[16];
+    snprintf(clusters, sizeof(clusters), "%d", config->n_clusters);
+    snprintf(iterations, sizeof(iterations), "%d", config->max_iterations);
+    snprintf(seed, sizeof(seed), "%d", config->seed);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        execl(config->binary, config->binary, config->input, "-o", output, "-k", clusters, "-m", iterations, "-s", seed, (char *) NULL);
+        _exit(127);
+    }
+
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+        return 0;
+    }
+
+    *latency = omp_get_wtime() - start_time;
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+// output of a load thread: the thread's number before the extension, so concurrent jobs don't share a file
+static void thread_output(const char *output, int thread, char *path, size_t size)
+{
+    const char *ext = strrchr(output, '.');
+    int stem = ext ? (int) (ext - output) : (int) strlen(output);
+
+    snprintf(path, size, "%.*s.%d%s", stem, output, thread, ext ? ext : "");
+}
+
+// a thread's slot, thread -1 for a single job that uses the output as it is; the caller's pixels are
+// copied into the shared memory once here, like a caller that decodes its frames straight into it
+static int slot_init(const client_config_t *config, client_slot_t *slot, int thread)
+{
+    memset(slot, 0, sizeof(client_slot_t));
+    slot->shared.fd = -1;
+
+    if (thread < 0) {
+        snprintf(slot->output, sizeof(slot->output), "%s", config->output);
+    } else {
+        thread_output(config->output, thread, slot->output, sizeof(slot->output));
+    }
+
+    if (config->file_mode) {
+        return 1;
+    }
+
+    if (!config->shared) {
+        slot->result = malloc(frame_bytes(config));
+        return 1;
+    }
+
+    int ok;
+    if (config->shared == SHARED_NAMED) {
+        snprintf(slot->shared_name, sizeof(slot->shared_name), "%s.%d", config->shared_name, thread < 0 ? 0 : thread);
+        ok = shared_buffer_create_named(&slot->shared, slot->shared_name, 2 * frame_bytes(config));
+    } else {
+        ok = shared_buffer_create(&slot->shared, 2 * frame_bytes(config));
+    }
+
+    if (ok) {
+        memcpy(slot->shared.data, config->pixels, frame_bytes(config));
+    }
+
+    return ok;
+}
+
+// the compressed pixels of the slot's last job
+static byte_t *slot_result(const client_config_t *config, client_slot_t *slot)
+{
+    return config->shared ? (byte_t *) slot->shared.data + frame_bytes(config) : slot->result;
+}
+
+static void slot_release(const client_config_t *config, client_slot_t *slot)
+{
+    if (config->shared) {
+        shared_buffer_release(&slot->shared);
+    }
+    if (config->shared == SHARED_NAMED) {
+        shm_unlink(slot->shared_name);
+    }
+    free(slot->result);
+}
+
+typedef struct {
+    load_t *load;
+    int thread;
+} load_thread_t;
+
+static void *load_main(void *arg)
+{
+    load_thread_t *self = arg;
+    load_t *load = self->load;
+    const client_config_t *config = load->config;
+
+    client_slot_t slot;
+    long busy = 0;
+
+    if (!slot_init(config, &slot, self->thread)) {
+        fprintf(stderr, "[!] Can't create the shared memory of thread %d\n", self->thread);
+        return NULL;
+    }
+
+    for (;;) {
+        int request = __atomic_fetch_add(&load->next, 1, __ATOMIC_RELAXED);
+        if (request >= load->n_requests) {
+            break;
+        }
+
+        double latency = 0;
+        int iterations = 0;
+        int ok = config->binary ? run_process(config, slot.output, &latency)
+                                : submit_job(config, &slot, &busy, &iterations, &latency);
+
+        load->latencies[request] = ok ? latency : -1;
+        load->iterations[request] = iterations;
+    }
+
+    pthread_mutex_lock(&load->lock);
+    load->busy += busy;
+    pthread_mutex_unlock(&load->lock);
+
+    slot_release(config, &slot);
+    return NULL;
+}
+
+// n_requests jobs from concurrency threads, each starting its next job when the last one returns
+static void generate_load(const client_config_t *config, int n_requests, int concurrency, const char *label, double *p50)
+{
+    load_t load;
+    memset(&load, 0, sizeof(load));
+    load.config = config;
+    load.n_requests = n_requests;
+    load.latencies = malloc(n_requests * sizeof(double));
+    load.iterations = calloc(n_requests, sizeof(int));
+    pthread_mutex_init(&load.lock, NULL);
+
+    pthread_t *threads = malloc(concurrency * sizeof(pthread_t));
+    load_thread_t *args = malloc(concurrency * sizeof(load_thread_t));
+
+    double start_time = omp_get_wtime();
+    for (int t = 0; t < concurrency; t++) {
+        args[t].load = &load;
+        args[t].thread = t;
+        pthread_create(&threads[t], NULL, load_main, &args[t]);
+    }
+    for (int t = 0; t < concurrency; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double execution_time = omp_get_wtime() - start_time;
+
+    // failed jobs are left out of the percentiles
+    int n = 0;
+    for (int i = 0; i < n_requests; i++) {
+        if (load.latencies[i] >= 0) {
+            load.latencies[n++] = load.latencies[i];
+        } else {
+            load.failed++;
+        }
+    }
+    qsort(load.latencies, n, sizeof(double), compare_doubles);
+
+    const char *payload = config->file_mode || config->binary ? "files"
+                        : config->shared == SHARED_MEMFD ? "memfd" : config->shared == SHARED_NAMED ? "POSIX shared memory" : "pixels";
+    printf("[+] %s: %d requests, %d concurrent, %s\n", label, n_requests, concurrency, payload);
+    printf("\t[+] execution_time: %f\n", execution_time);
+    printf("\t[+] throughput: %.2f jobs/s\n", n / execution_time);
+    if (n > 0) {
+        printf("\t[+] latency: p50 %f, p99 %f, max %f\n", percentile(load.latencies, n, 50), percentile(load.latencies, n, 99), load.latencies[n - 1]);
+    }
+    printf("\t[+] failed: %ld, busy replies: %ld\n", load.failed, load.busy);
+
+    *p50 = n > 0 ? percentile(load.latencies, n, 50) : 0;
+
+    pthread_mutex_destroy(&load.lock);
+    free(args);
+    free(threads);
+    free(load.iterations);
+    free(load.latencies);
+}
+
+static int print_stats(const char *socket_path)
+{
+    int fd = daemon_connect(socket_path);
+    if (fd < 0) {
+        fprintf(stderr, "[!] No daemon on %s\n", socket_path);
+        return EXIT_FAILURE;
+    }
+
+    daemon_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.magic = DAEMON_MAGIC;
+    request.type = DAEMON_STATS;
+
+    daemon_reply_t reply;
+    char text[4096];
+    int ok = daemon_write_full(fd, &request, sizeof(request)) && daemon_read_full(fd, &reply, sizeof(reply))
+          && reply.payload_bytes < sizeof(text) && daemon_read_full(fd, text, reply.payload_bytes);
+    close(fd);
+
+    if (!ok) {
+        fprintf(stderr, "[!] No stats from %s\n", socket_path);
+        return EXIT_FAILURE;
+    }
+
+    text[reply.payload_bytes] = '\0';
+    fputs(text, stdout);
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    client_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.socket_path = DAEMON_DEFAULT_SOCKET;
+    config.output = DEFAULT_OUT_PATH;
+    config.n_clusters = DEFAULT_N_CLUSTERS;
+    config.max_iterations = DEFAULT_MAX_ITERATIONS;
+    config.seed = time(NULL);
+
+    int n_requests = 0;
+    int concurrency = DEFAULT_CONCURRENCY;
+
+    // Parse arguments and optional parameters
+    char optchar;
+    while ((optchar = getopt(argc, argv, "b:c:k:m:n:s:S:X:fxh")) != -1) {
+        switch (optchar)
+        {
+        case 'b':
+            config.binary = optarg;
+            break;
+        case 'c':
+            concurrency = strtol(optarg, NULL, 10);
+            break;
+        case 'f':
+            config.file_mode = 1;
+            break;
+        case 'k':
+            config.n_clusters = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            config.max_iterations = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            n_requests = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            config.seed = strtol(optarg, NULL, 10);
+            break;
+        case 'S':
+            config.socket_path = optarg;
+            break;
+        case 'x':
+            config.shared = SHARED_MEMFD;
+            break;
+        case 'X':
+            config.shared = SHARED_NAMED;
+            config.shared_name = optarg;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-S socket] stats\n"
+                            "       %s [-S socket] [-f | -x | -X /shm_name] [-k clusters] [-m iterations] [-s seed] input output\n"
+                            "       %s [-S socket] -n requests [-c concurrency] [-b baseline_binary] [-f | -x | -X /shm_name] [-k clusters] [-m iterations] [-s seed] input [output]\n",
+                    argv[0], argv[0], argv[0]);
+            exit(EXIT_FAILURE);
+            break;
+        }
+    }
+
+    if (optind < argc && strcmp(argv[optind], "stats") == 0) {
+        return print_stats(config.socket_path);
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "INPUT ERROR: << Parameter 'input' not defined >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    config.input = argv[optind];
+    if (optind + 1 < argc) {
+        config.output = argv[optind + 1];
+    }
+
+    if (n_requests < 0 || concurrency < 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of requests or concurrency >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.file_mode && config.shared) {
+        fprintf(stderr, "INPUT ERROR: << Files (-f) and shared memory (-x, -X) don't go together >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.n_clusters < 2 || config.max_iterations < 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of clusters or iterations >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    // pixel jobs are decoded once here, like a caller that already has the pixels
+    if (!config.file_mode) {
+        config.pixels = img_load((char *) config.input, &config.width, &config.height, &config.n_channels);
+    }
+
+    if (n_requests == 0) {
+        // A single job
+        client_slot_t slot;
+        long busy = 0;
+        int iterations = 0;
+        double latency = 0;
+
+        if (!slot_init(&config, &slot, -1)) {
+            fprintf(stderr, "[!] Can't create the shared memory\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!submit_job(&config, &slot, &busy, &iterations, &latency)) {
+            fprintf(stderr, "[!] The job failed, is the daemon running on %s?\n", config.socket_path);
+            exit(EXIT_FAILURE);
+        }
+        if (!config.file_mode) {
+            img_save((char *) config.output, slot_result(&config, &slot), config.width, config.height, config.n_channels);
+        }
+
+        printf("Input: %s\n", config.input);
+        printf("Output: %s\n", config.output);
+        printf("Iterations: %d\n", iterations);
+        printf("Latency: %f (%ld busy replies)\n", latency, busy);
+
+        slot_release(&config, &slot);
+        free(config.pixels);
+        return EXIT_SUCCESS;
+    }
+
+    // Load: the daemon, then the same jobs as processes of their own
+    double daemon_p50 = 0, process_p50 = 0;
+    const char *binary = config.binary;
+
+    config.binary = NULL;
+    generate_load(&config, n_requests, concurrency, "Daemon", &daemon_p50);
+
+    if (binary) {
+        config.binary = binary;
+        generate_load(&config, n_requests, concurrency, "Per-process", &process_p50);
+        if (daemon_p50 > 0 && process_p50 > 0) {
+            printf("[+] p50 latency: daemon %f vs per-process %f (%.2fx faster)\n", daemon_p50, process_p50, process_p50 / daemon_p50);
+        }
+    }
+
+    free(config.pixels);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,707 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <omp.h>
+#ifdef WITH_OPENCL
+#include <CL/cl.h>
+#endif
+
+#include "image_io.h"
+#include "compression.h"
+#include "daemon_protocol.h"
+#include "shared_buffer.h"
+#include "percentile.h"
+#ifdef WITH_OPENCL
+#include "cl_device.h"
+#include "gpu_engine.h"
+#endif
+
+#define DEFAULT_N_CLUSTERS 8
+#define DEFAULT_MAX_ITERATIONS 150
+#define DEFAULT_N_WORKERS 2
+#define DEFAULT_N_THREADS 1
+#define DEFAULT_QUEUE_CAPACITY 16
+#define DEFAULT_MAX_MPIXELS 256
+// the most a request may ask for, the workspace grows with the clusters and a job holds its worker for the iterations
+#define DEFAULT_CLUSTER_LIMIT 256
+#define DEFAULT_ITERATION_LIMIT 1000
+#define DEFAULT_RESIDENT_ITERATIONS 8
+
+// latencies of the last jobs the stats percentiles are taken over
+#define LATENCY_WINDOW 4096
+// a client gets this long to send its header, so a stuck one can't block the accept loop
+#define HEADER_TIMEOUT_S 5
+
+#define ENGINE_OMP 0
+#define ENGINE_GPU 1
+
+typedef struct {
+    int fd;
+    daemon_request_t request;
+    double accepted;
+} daemon_job_t;
+
+// bounded FIFO of accepted jobs between the accept loop and the workers, with the counters of the stats
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    daemon_job_t *jobs;
+    int capacity;
+    int head;
+    int depth;
+    int reserved;             // slots promised to jobs whose ACCEPTED is still being sent
+    int running;
+    int stopping;
+    long accepted;
+    long rejected;
+    long completed;
+    long failed;
+    double *latencies;        // accepted to reply sent, a ring of LATENCY_WINDOW
+    double *service_times;
+    long n_recorded;
+} job_queue_t;
+
+typedef struct {
+    int engine;
+    int n_threads;
+    int n_clusters;           // defaults for requests that leave them at 0
+    int max_iterations;
+    long max_pixels;
+    int cluster_limit;
+    int iteration_limit;
+    int resident_iterations;
+} daemon_config_t;
+
+// what a worker keeps warm between jobs
+typedef struct {
+    int id;
+    pthread_t thread;
+    job_queue_t *queue;
+    const daemon_config_t *config;
+    kmeans_context_t *ctx;    // ENGINE_OMP, recreated when a job asks for other clusters or iterations
+    kmeans_config_t ctx_config;
+#ifdef WITH_OPENCL
+    gpu_engine_t engine;      // ENGINE_GPU, clones of the first worker's share its context and program
+    cl_long *ring;
+#endif
+} daemon_worker_t;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int signal)
+{
+    (void) signal;
+    stop_requested = 1;
+}
+
+static void queue_init(job_queue_t *queue, int capacity)
+{
+    memset(queue, 0, sizeof(job_queue_t));
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    queue->capacity = capacity;
+    queue->jobs = malloc(capacity * sizeof(daemon_job_t));
+    queue->latencies = malloc(LATENCY_WINDOW * sizeof(double));
+    queue->service_times = malloc(LATENCY_WINDOW * sizeof(double));
+}
+
+static void queue_destroy(job_queue_t *queue)
+{
+    free(queue->service_times);
+    free(queue->latencies);
+    free(queue->jobs);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+}
+
+// 0 when the queue is full, the caller turns the job away; otherwise a slot is held for the job until
+// queue_push or queue_cancel
+static int queue_reserve(job_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->depth + queue->reserved == queue->capacity) {
+        queue->rejected++;
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+
+    queue->reserved++;
+    pthread_mutex_unlock(&queue->lock);
+
+    return 1;
+}
+
+static void queue_cancel(job_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->reserved--;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// hands the job to the workers in the slot queue_reserve held for it
+static void queue_push(job_queue_t *queue, const daemon_job_t *job)
+{
+    pthread_mutex_lock(&queue->lock);
+
+    queue->jobs[(queue->head + queue->depth) % queue->capacity] = *job;
+    queue->reserved--;
+    queue->depth++;
+    queue->accepted++;
+
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// blocks until there is a job, 0 once the daemon stops and the queue is drained
+static int queue_pop(job_queue_t *queue, daemon_job_t *job)
+{
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->depth == 0 && !queue->stopping) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+
+    if (queue->depth == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+
+    *job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->depth--;
+    queue->running++;
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return 1;
+}
+
+static void queue_done(job_queue_t *queue, int ok, double latency, double service_time)
+{
+    pthread_mutex_lock(&queue->lock);
+
+    queue->running--;
+    if (ok) {
+        queue->completed++;
+        queue->latencies[queue->n_recorded % LATENCY_WINDOW] = latency;
+        queue->service_times[queue->n_recorded % LATENCY_WINDOW] = service_time;
+        queue->n_recorded++;
+    } else {
+        queue->failed++;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// "key value" lines of the counters and the percentiles over the last jobs
+static int format_stats(job_queue_t *queue, const daemon_config_t *config, int n_workers, double uptime, char *text, size_t size)
+{
+    double latencies[LATENCY_WINDOW], service_times[LATENCY_WINDOW];
+
+    pthread_mutex_lock(&queue->lock);
+
+    int n = queue->n_recorded < LATENCY_WINDOW ? (int) queue->n_recorded : LATENCY_WINDOW;
+    memcpy(latencies, queue->latencies, n * sizeof(double));
+    memcpy(service_times, queue->service_times, n * sizeof(double));
+
+    int length = snprintf(text, size,
+                          "engine %s\nworkers %d\nthreads_per_worker %d\nqueue_depth %d\nqueue_capacity %d\nrunning %d\n"
+                          "accepted %ld\nrejected %ld\ncompleted %ld\nfailed %ld\nuptime %f\n",
+                          config->engine == ENGINE_GPU ? "gpu" : "omp", n_workers, config->n_threads, queue->depth, queue->capacity,
+                          queue->running, queue->accepted, queue->rejected, queue->completed, queue->failed, uptime);
+
+    pthread_mutex_unlock(&queue->lock);
+
+    qsort(latencies, n, sizeof(double), compare_doubles);
+    qsort(service_times, n, sizeof(double), compare_doubles);
+
+    if (n > 0) {
+        length += snprintf(text + length, size - length,
+                           "window %d\nlatency_p50 %f\nlatency_p99 %f\nlatency_max %f\nservice_p50 %f\nservice_p99 %f\n",
+                           n, percentile(latencies, n, 50), percentile(latencies, n, 99), latencies[n - 1],
+                           percentile(service_times, n, 50), percentile(service_times, n, 99));
+    }
+
+    return length;
+}
+
+#ifdef WITH_OPENCL
+// random pixels as the initial centers, from the job's own seed so concurrent jobs don't share a sequence
+static void initialise_centers_seeded(byte_t *data, long *centers, int n_pixels, int n_channels, int n_clusters, unsigned int seed)
+{
+    for (int cluster = 0; cluster < n_clusters; cluster++) {
+        int random_int = rand_r(&seed) % n_pixels;
+
+        for (int channel = 0; channel < n_channels; channel++) {
+            centers[cluster * n_channels + channel] = data[random_int * n_channels + channel];
+        }
+    }
+}
+#endif
+
+// compresses data into out (data itself for in place) with the worker's warm engine, the iterations or
+// -1 if it can't
+static int compress_job(daemon_worker_t *worker, byte_t *data, byte_t *out, int width, int height, int n_channels, int n_clusters, int max_iterations, int seed)
+{
+#ifdef WITH_OPENCL
+    if (worker->config->engine == ENGINE_GPU) {
+        gpu_engine_t *engine = &worker->engine;
+        int n_pixels = width * height;
+        int batch_size = worker->config->resident_iterations;
+        double host_sync_time = 0;
+
+        if (!gpu_engine_fits(engine, n_pixels, n_channels)) {
+            return -1;
+        }
+
+        long *centers = malloc(n_clusters * n_channels * sizeof(long));
+        initialise_centers_seeded(data, centers, n_pixels, n_channels, n_clusters, seed);
+
+        worker->ring = realloc(worker->ring, 2 * batch_size * RING_FIELDS * sizeof(cl_long));
+        gpu_engine_bind(engine, data, centers, n_pixels, n_channels, n_clusters, 2 * batch_size);
+        int iterations = gpu_engine_run(engine, max_iterations, batch_size, worker->ring, &host_sync_time);
+        gpu_enqueue_update_data(engine, NULL);
+        gpu_engine_read_data(engine, out);
+        gpu_engine_unbind(engine);
+
+        free(centers);
+        return iterations;
+    }
+#endif
+
+    if (!worker->ctx || worker->ctx_config.n_clusters != n_clusters || worker->ctx_config.max_iterations != max_iterations) {
+        if (worker->ctx) {
+            kmeans_context_destroy(worker->ctx);
+        }
+        worker->ctx_config.n_clusters = n_clusters;
+        worker->ctx_config.max_iterations = max_iterations;
+        worker->ctx = kmeans_context_create(&worker->ctx_config);
+    }
+
+    // a context or workspace that can't be allocated fails the job, not the daemon
+    if (!worker->ctx) {
+        return -1;
+    }
+
+    // the same rand_r sequence as the GPU path, rand() would be shared with the other workers
+    kmeans_result_t result;
+    kmeans_context_seed(worker->ctx, seed);
+    if (!kmeans_context_compress_to(worker->ctx, data, out, width, height, n_channels, &result)) {
+        return -1;
+    }
+
+    return result.stats.iterations;
+}
+
+// reads the job's payload, compresses it and replies; 0 if the job failed
+static int run_job(daemon_worker_t *worker, daemon_job_t *job, double queue_time)
+{
+    const daemon_config_t *config = worker->config;
+    daemon_request_t *request = &job->request;
+    int n_clusters = request->n_clusters > 0 ? request->n_clusters : config->n_clusters;
+    int max_iterations = request->max_iterations > 0 ? request->max_iterations : config->max_iterations;
+
+    daemon_reply_t reply;
+    daemon_reply_init(&reply, DAEMON_ERROR);
+    reply.queue_time = queue_time;
+
+    double start_time = omp_get_wtime();
+    byte_t *payload = malloc(request->payload_bytes);
+    int shared_fd = -1;
+    if (!payload || !daemon_read_fd(job->fd, payload, request->payload_bytes, &shared_fd)) {
+        if (shared_fd >= 0) {
+            close(shared_fd);
+        }
+        free(payload);
+        return 0;
+    }
+
+    // a descriptor on anything but a memfd job is not ours to keep
+    if (shared_fd >= 0 && (request->type != DAEMON_JOB_SHARED || payload[0] != '\0')) {
+        close(shared_fd);
+        shared_fd = -1;
+    }
+
+    int ok = 0;
+    if (request->type == DAEMON_JOB_SHARED) {
+        // the caller's pixels are mapped, not copied: compressed in place or into its output region
+        shared_buffer_t buffer;
+        int mapped = 0;
+
+        if (payload[request->payload_bytes - 1] == '\0') {
+            mapped = payload[0] == '\0' ? shared_fd >= 0 && shared_buffer_map_fd(&buffer, shared_fd, request->shared_bytes)
+                                        : shared_buffer_open(&buffer, (char *) payload, request->shared_bytes);
+        } else if (shared_fd >= 0) {
+            close(shared_fd);
+        }
+
+        if (mapped) {
+            byte_t *data = buffer.data;
+            reply.iterations = compress_job(worker, data, data + request->output_offset, request->width, request->height, request->n_channels,
+                                            n_clusters, max_iterations, request->seed);
+            if (reply.iterations >= 0) {
+                reply.status = DAEMON_OK;
+            }
+            shared_buffer_release(&buffer);
+        }
+        reply.service_time = omp_get_wtime() - start_time;
+
+        ok = daemon_send_reply(job->fd, &reply, NULL) && reply.status == DAEMON_OK;
+    } else if (request->type == DAEMON_JOB_PIXELS) {
+        reply.iterations = compress_job(worker, payload, payload, request->width, request->height, request->n_channels, n_clusters, max_iterations, request->seed);
+        if (reply.iterations >= 0) {
+            reply.status = DAEMON_OK;
+            reply.payload_bytes = request->payload_bytes;
+        }
+        reply.service_time = omp_get_wtime() - start_time;
+
+        pthread_mutex_lock(&worker->queue->lock);
+        reply.queue_depth = worker->queue->depth;
+        pthread_mutex_unlock(&worker->queue->lock);
+
+        ok = daemon_send_reply(job->fd, &reply, payload) && reply.status == DAEMON_OK;
+    } else {
+        // "input\0output\0"
+        char *input = (char *) payload;
+        size_t input_length = strnlen(input, request->payload_bytes);
+        char *output = input + input_length + 1;
+        int width, height, n_channels;
+        byte_t *data = NULL;
+
+        if (input_length + 1 < request->payload_bytes && payload[request->payload_bytes - 1] == '\0') {
+            data = img_try_load(input, &width, &height, &n_channels);
+        }
+
+        if (data && n_channels <= KMEANS_MAX_CHANNELS && (long) width * height <= config->max_pixels && n_clusters <= (long) width * height) {
+            reply.iterations = compress_job(worker, data, data, width, height, n_channels, n_clusters, max_iterations, request->seed);
+            if (reply.iterations >= 0 && img_try_save(output, data, width, height, n_channels)) {
+                reply.status = DAEMON_OK;
+            }
+        }
+        reply.service_time = omp_get_wtime() - start_time;
+
+        ok = daemon_send_reply(job->fd, &reply, NULL) && reply.status == DAEMON_OK;
+        free(data);
+    }
+
+    free(payload);
+    return ok;
+}
+
+static void *worker_main(void *arg)
+{
+    daemon_worker_t *worker = arg;
+    daemon_job_t job;
+
+    while (queue_pop(worker->queue, &job)) {
+        double queue_time = omp_get_wtime() - job.accepted;
+        double start_time = omp_get_wtime();
+
+        int ok = run_job(worker, &job, queue_time);
+        close(job.fd);
+
+        double end_time = omp_get_wtime();
+        queue_done(worker->queue, ok, end_time - job.accepted, end_time - start_time);
+    }
+
+    return NULL;
+}
+
+// checks a job's header before it gets a queue slot
+static int valid_request(const daemon_request_t *request, const daemon_config_t *config)
+{
+    if (request->n_clusters < 0 || request->n_clusters == 1 || request->n_clusters > config->cluster_limit
+        || request->max_iterations < 0 || request->max_iterations > config->iteration_limit) {
+        return 0;
+    }
+
+    if (request->type == DAEMON_JOB_FILE) {
+        return request->payload_bytes > 0 && request->payload_bytes <= 2 * DAEMON_MAX_PATH;
+    }
+
+    // more clusters than pixels can't all get one; a file job is checked once its image is loaded
+    int n_clusters = request->n_clusters > 0 ? request->n_clusters : config->n_clusters;
+    int size_valid = request->width > 0 && request->height > 0
+        && request->n_channels > 0 && request->n_channels <= KMEANS_MAX_CHANNELS
+        && (long) request->width * request->height <= config->max_pixels
+        && n_clusters <= (long) request->width * request->height;
+    uint64_t size = (uint64_t) request->width * request->height * request->n_channels;
+
+    // the output region is the input itself or lies after it, inside the shared memory
+    if (request->type == DAEMON_JOB_SHARED) {
+        return size_valid && request->payload_bytes > 0 && request->payload_bytes <= DAEMON_MAX_PATH
+            && request->shared_bytes >= size
+            && (request->output_offset == 0 || (request->output_offset >= size && request->output_offset <= request->shared_bytes - size));
+    }
+
+    return request->type == DAEMON_JOB_PIXELS && size_valid && request->payload_bytes == size;
+}
+
+static int listen_socket(const char *path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // a socket left behind by a daemon that didn't shut down cleanly
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    char *socket_path = DAEMON_DEFAULT_SOCKET;
+    char *device = NULL;
+    int precision = 0;
+    int n_workers = DEFAULT_N_WORKERS;
+    int queue_capacity = DEFAULT_QUEUE_CAPACITY;
+
+    daemon_config_t config;
+    config.engine = ENGINE_OMP;
+    config.n_threads = DEFAULT_N_THREADS;
+    config.n_clusters = DEFAULT_N_CLUSTERS;
+    config.max_iterations = DEFAULT_MAX_ITERATIONS;
+    config.max_pixels = DEFAULT_MAX_MPIXELS * 1000000L;
+    config.cluster_limit = DEFAULT_CLUSTER_LIMIT;
+    config.iteration_limit = DEFAULT_ITERATION_LIMIT;
+    config.resident_iterations = DEFAULT_RESIDENT_ITERATIONS;
+
+    // Parse arguments and optional parameters
+    char optchar;
+    while ((optchar = getopt(argc, argv, "d:e:j:k:m:q:r:t:w:I:K:M:S:h")) != -1) {
+        switch (optchar)
+        {
+        case 'd':
+            device = optarg;
+            break;
+        case 'e':
+            if (strcmp(optarg, "gpu") == 0) {
+                config.engine = ENGINE_GPU;
+            } else if (strcmp(optarg, "omp") == 0) {
+                config.engine = ENGINE_OMP;
+            } else {
+                fprintf(stderr, "INPUT ERROR: << Unknown engine %s >> \n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            n_workers = strtol(optarg, NULL, 10);
+            break;
+        case 'k':
+            config.n_clusters = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            config.max_iterations = strtol(optarg, NULL, 10);
+            break;
+        case 'q':
+            queue_capacity = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            config.resident_iterations = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            config.n_threads = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            precision = strtol(optarg, NULL, 10);
+            break;
+        case 'I':
+            config.iteration_limit = strtol(optarg, NULL, 10);
+            break;
+        case 'K':
+            config.cluster_limit = strtol(optarg, NULL, 10);
+            break;
+        case 'M':
+            config.max_pixels = strtol(optarg, NULL, 10) * 1000000L;
+            break;
+        case 'S':
+            socket_path = optarg;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-S socket] [-e omp|gpu] [-j workers] [-t threads per worker] [-q queue] [-k clusters] [-m iterations] "
+                            "[-K max_clusters] [-I max_iterations] [-M max_mpixels] [-d device] [-w 32|64] [-r resident]\n", argv[0]);
+            exit(EXIT_FAILURE);
+            break;
+        }
+    }
+
+    if (n_workers < 1 || queue_capacity < 1 || config.n_threads < 1 || config.resident_iterations < 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of workers, queue slots, threads or resident iterations >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.n_clusters < 2 || config.max_iterations < 1 || config.n_clusters > config.cluster_limit || config.max_iterations > config.iteration_limit) {
+        fprintf(stderr, "INPUT ERROR: << Invalid default clusters or iterations, or above their limits >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+#ifndef WITH_OPENCL
+    if (config.engine == ENGINE_GPU) {
+        fprintf(stderr, "INPUT ERROR: << Built without OpenCL, rebuild with -DWITH_OPENCL for the gpu engine >> \n");
+        exit(EXIT_FAILURE);
+    }
+    (void) device;
+    (void) precision;
+#endif
+
+    // Warm up the engines before taking any job: the OpenMP workers' contexts are created on their
+    // first job, the OpenCL platform, context and program right here
+    daemon_worker_t *workers = calloc(n_workers, sizeof(daemon_worker_t));
+    job_queue_t queue;
+    queue_init(&queue, queue_capacity);
+
+    for (int w = 0; w < n_workers; w++) {
+        workers[w].id = w;
+        workers[w].queue = &queue;
+        workers[w].config = &config;
+        workers[w].ctx_config.n_clusters = config.n_clusters;
+        workers[w].ctx_config.max_iterations = config.max_iterations;
+        workers[w].ctx_config.n_threads = config.n_threads;
+        workers[w].ctx_config.schedule = SCHEDULE_STATIC;
+        if (config.engine == ENGINE_OMP) {
+            workers[w].ctx = kmeans_context_create(&workers[w].ctx_config);
+        }
+#ifdef WITH_OPENCL
+        if (config.engine == ENGINE_GPU) {
+            if (w == 0) {
+                gpu_engine_init(&workers[w].engine, device, precision, 0);
+                printf("[+] Device: ");
+                cl_describe_device(workers[w].engine.device, stdout);
+            } else {
+                gpu_engine_clone(&workers[w].engine, &workers[0].engine, 0);
+            }
+        }
+#endif
+    }
+
+    int listen_fd = listen_socket(socket_path);
+    if (listen_fd < 0) {
+        fprintf(stderr, "[!] Can't listen on %s: %s\n", socket_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // without SA_RESTART, so a signal gets accept out of its wait
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int w = 0; w < n_workers; w++) {
+        pthread_create(&workers[w].thread, NULL, worker_main, &workers[w]);
+    }
+
+    printf("[+] Listening on %s: %s engine, %d workers x %d threads, %d queue slots\n", socket_path,
+           config.engine == ENGINE_GPU ? "gpu" : "omp", n_workers, config.n_threads, queue_capacity);
+    fflush(stdout);
+
+    double start_time = omp_get_wtime();
+    struct timeval timeout = { HEADER_TIMEOUT_S, 0 };
+
+    while (!stop_requested) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        daemon_job_t job;
+        job.fd = fd;
+        job.accepted = omp_get_wtime();
+
+        if (!daemon_read_full(fd, &job.request, sizeof(daemon_request_t)) || job.request.magic != DAEMON_MAGIC) {
+            close(fd);
+            continue;
+        }
+
+        daemon_reply_t reply;
+
+        if (job.request.type == DAEMON_STATS) {
+            char text[2048];
+            daemon_reply_init(&reply, DAEMON_OK);
+            reply.payload_bytes = format_stats(&queue, &config, n_workers, omp_get_wtime() - start_time, text, sizeof(text));
+            daemon_send_reply(fd, &reply, text);
+            close(fd);
+            continue;
+        }
+
+        if (!valid_request(&job.request, &config)) {
+            daemon_reply_init(&reply, DAEMON_ERROR);
+            daemon_send_reply(fd, &reply, NULL);
+            close(fd);
+            continue;
+        }
+
+        // Backpressure: a full queue turns the job away before its payload is sent
+        if (!queue_reserve(&queue)) {
+            daemon_reply_init(&reply, DAEMON_BUSY);
+            reply.queue_depth = queue_capacity;
+            daemon_send_reply(fd, &reply, NULL);
+            close(fd);
+            continue;
+        }
+
+        // the reply goes out before a worker owns the fd, which it may close and the next job reuse
+        daemon_reply_init(&reply, DAEMON_ACCEPTED);
+        if (!daemon_send_reply(fd, &reply, NULL)) {
+            queue_cancel(&queue);
+            close(fd);
+            continue;
+        }
+        queue_push(&queue, &job);
+    }
+
+    // Drain: the queued jobs still run, then the workers exit
+    close(listen_fd);
+    unlink(socket_path);
+
+    pthread_mutex_lock(&queue.lock);
+    queue.stopping = 1;
+    pthread_cond_broadcast(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+
+    for (int w = 0; w < n_workers; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+
+    printf("[+] Stopped after %ld jobs (%ld failed, %ld turned away)\n", queue.completed + queue.failed, queue.failed, queue.rejected);
+
+    for (int w = n_workers - 1; w >= 0; w--) {
+        if (workers[w].ctx) {
+            kmeans_context_destroy(workers[w].ctx);
+        }
+#ifdef WITH_OPENCL
+        if (config.engine == ENGINE_GPU) {
+            gpu_engine_release(&workers[w].engine);
+            free(workers[w].ring);
+        }
+#endif
+    }
+
+    queue_destroy(&queue);
+    free(workers);
+
+    return EXIT_SUCCESS;
+}
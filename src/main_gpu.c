@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
@@ -7,10 +8,12 @@
 
 #include "image_io.h"
 #include "compression.h"
+#include "cl_device.h"
 
 #define DEFAULT_N_CLUSTERS 4
 #define DEFAULT_MAX_ITERATIONS 150
 #define DEFAULT_OUT_PATH "result.jpg"
+#define DEFAULT_RESIDENT_ITERATIONS 0
 
 int main(int argc, char **argv)
 {
@@ -21,12 +24,48 @@ int main(int argc, char **argv)
     int max_iterations = DEFAULT_MAX_ITERATIONS;
 
     int seed = time(NULL);
+
+    int autotune = 0;
+
+    gpu_options_t options;
+    options.resident_iterations = DEFAULT_RESIDENT_ITERATIONS;
+    options.fused = -1;
+    options.device = NULL;
+    options.zero_copy = 0;
+    options.palette = 0;
+    options.precision = 0;
+    options.fission = NULL;
+    options.slab_pixels = 0;
+    options.trace = NULL;
+    options.seeding = SEEDING_RANDOM;
     
     // Parse arguments and optional parameters
     char optchar;
-    while ((optchar = getopt(argc, argv, "k:m:o:s:h")) != -1) {
+    while ((optchar = getopt(argc, argv, "d:i:k:m:o:r:s:w:F:P:T:aflpzh")) != -1) {
         switch (optchar)
         {
+        case 'a':
+            autotune = 1;
+            break;
+        case 'd':
+            options.device = optarg;
+            break;
+        case 'l':
+            cl_list_devices(stdout);
+            exit(EXIT_SUCCESS);
+            break;
+        case 'i':
+            if (strcmp(optarg, "kmeans++") == 0) {
+                options.seeding = SEEDING_KMEANSPP;
+            } else if (strcmp(optarg, "parallel") == 0) {
+                options.seeding = SEEDING_PARALLEL;
+            } else if (strcmp(optarg, "random") == 0) {
+                options.seeding = SEEDING_RANDOM;
+            } else {
+                fprintf(stderr, "INPUT ERROR: << Unknown seeding '%s', expected random, kmeans++ or parallel >> \n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 'k':
             n_clusters = strtol(optarg, NULL, 10);
             break;
@@ -36,9 +75,33 @@ int main(int argc, char **argv)
         case 'o':
             out_path = optarg;
             break;
+        case 'f':
+            options.fused = 1;
+            break;
+        case 'p':
+            options.palette = 1;
+            break;
+        case 'z':
+            options.zero_copy = 1;
+            break;
+        case 'r':
+            options.resident_iterations = strtol(optarg, NULL, 10);
+            break;
         case 's':
             seed = strtol(optarg, NULL, 10);
             break;
+        case 'w':
+            options.precision = strtol(optarg, NULL, 10);
+            break;
+        case 'F':
+            options.fission = optarg;
+            break;
+        case 'P':
+            options.trace = optarg;
+            break;
+        case 'T':
+            options.slab_pixels = strtol(optarg, NULL, 10);
+            break;
         case 'h':
         default:
             // TODO @blarc print_usage(argv[0])
@@ -66,18 +129,43 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);    
     }
 
+    if (options.resident_iterations < 0) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of resident iterations >> \n");
+        exit(EXIT_FAILURE);    
+    }
+
     // Initialise the random seed
     srand(seed);
 
     // Scan input image
     int width, height, n_channels;
-    byte_t *data = img_load(in_path, &width, &height, &n_channels);
+    // zero-copy wants page-aligned pixels, which the arena's mapping provides
+    arena_t arena;
+    arena_init(&arena);
+    byte_t *data;
+    if (options.zero_copy) {
+        img_info(in_path, &width, &height, &n_channels);
+        arena_reserve(&arena, ARENA_ALIGN((size_t)width * height * n_channels));
+        data = img_load_arena(in_path, &arena, &width, &height, &n_channels);
+    } else {
+        data = img_load(in_path, &width, &height, &n_channels);
+    }
+
+    // Tune the kernels on this image instead of compressing it
+    if (autotune) {
+        kmeans_autotune_gpu(data, width, height, n_channels, n_clusters, &options);
+        if (!options.zero_copy) {
+            free(data);
+        }
+        arena_destroy(&arena);
+        return EXIT_SUCCESS;
+    }
 
     // Execute k-means compression
     printf("Starting...\n");
     fflush(stdout);
     double start_time = omp_get_wtime();
-    kmeans_compression_gpu(data, width, height, n_channels, n_clusters, max_iterations);
+    kmeans_compression_gpu(data, width, height, n_channels, n_clusters, max_iterations, &options);
     double execution_time = omp_get_wtime() - start_time;
 
     // Save the result
@@ -86,7 +174,10 @@ int main(int argc, char **argv)
     printf("Output: %s\n", out_path);
     printf("Execution time: %f\n", execution_time);
 
-    free(data);
+    if (!options.zero_copy) {
+        free(data);
+    }
+    arena_destroy(&arena);
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
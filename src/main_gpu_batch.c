@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <omp.h>
+
+#include "image_io.h"
+#include "compression.h"
+#include "cl_device.h"
+#include "percentile.h"
+
+#define DEFAULT_N_CLUSTERS 4
+#define DEFAULT_MAX_ITERATIONS 150
+#define DEFAULT_N_QUEUES 3
+#define DEFAULT_RESIDENT_ITERATIONS 8
+#define MAX_IMAGES 1024
+
+int main(int argc, char **argv)
+{
+    char *out_dir = NULL;
+
+    int n_clusters = DEFAULT_N_CLUSTERS;
+    int max_iterations = DEFAULT_MAX_ITERATIONS;
+    int n_queues = DEFAULT_N_QUEUES;
+    int reuse = 1;
+
+    int seed = time(NULL);
+
+    gpu_options_t options;
+    options.resident_iterations = DEFAULT_RESIDENT_ITERATIONS;
+    options.fused = -1;
+    options.device = NULL;
+    options.zero_copy = 0;
+    options.palette = 0;
+    options.precision = 0;
+    options.fission = NULL;
+    options.slab_pixels = 0;
+    options.trace = NULL;
+    options.seeding = SEEDING_RANDOM;
+
+    // Parse arguments and optional parameters
+    char optchar;
+    while ((optchar = getopt(argc, argv, "d:k:m:o:q:r:s:w:fnph")) != -1) {
+        switch (optchar)
+        {
+        case 'd':
+            options.device = optarg;
+            break;
+        case 'k':
+            n_clusters = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            max_iterations = strtol(optarg, NULL, 10);
+            break;
+        case 'o':
+            out_dir = optarg;
+            break;
+        case 'q':
+            n_queues = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            options.resident_iterations = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            options.precision = strtol(optarg, NULL, 10);
+            break;
+        case 'f':
+            options.fused = 1;
+            break;
+        case 'n':
+            reuse = 0;
+            break;
+        case 'p':
+            options.palette = 1;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-d device] [-k clusters] [-m iterations] [-o out_dir] [-q queues] [-r resident] [-s seed] [-w 32|64] [-f] [-n] [-p] image...\n", argv[0]);
+            exit(EXIT_FAILURE);
+            break;
+        }
+    }
+
+    int n_images = argc - optind;
+    if (n_images < 1 || n_images > MAX_IMAGES) {
+        fprintf(stderr, "INPUT ERROR: << Expected between 1 and %d images >> \n", MAX_IMAGES);
+        exit(EXIT_FAILURE);
+    }
+
+    if (n_clusters < 2) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of clusters >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (max_iterations < 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid maximum number of iterations >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (n_queues < 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of queues >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialise the random seed
+    srand(seed);
+
+    // Load every image before the clock starts, the batch only measures the device side
+    byte_t **images = malloc(n_images * sizeof(byte_t *));
+    int *widths = malloc(n_images * sizeof(int));
+    int *heights = malloc(n_images * sizeof(int));
+    int *channels = malloc(n_images * sizeof(int));
+    long n_pixels = 0;
+
+    for (int i = 0; i < n_images; i++) {
+        images[i] = img_load(argv[optind + i], &widths[i], &heights[i], &channels[i]);
+        n_pixels += (long) widths[i] * heights[i];
+    }
+
+    gpu_batch_stats_t stats;
+    stats.latencies = malloc(n_images * sizeof(double));
+
+    printf("Starting...\n");
+    fflush(stdout);
+    kmeans_batch_gpu(images, widths, heights, channels, n_images, n_clusters, max_iterations, n_queues, reuse, &options, &stats);
+
+    // Save the results under their input names
+    if (out_dir != NULL) {
+        for (int i = 0; i < n_images; i++) {
+            const char *name = strrchr(argv[optind + i], '/');
+            name = name ? name + 1 : argv[optind + i];
+
+            char out_path[4096];
+            snprintf(out_path, sizeof(out_path), "%s/%s", out_dir, name);
+            img_save(out_path, images[i], widths[i], heights[i], channels[i]);
+        }
+    }
+
+    qsort(stats.latencies, n_images, sizeof(double), compare_doubles);
+
+    printf("[+] Batch: %d images, %.1f Mpixels, %s\n", n_images, n_pixels / 1e6,
+           reuse ? "one context and program" : "a context and program per image");
+    printf("\t[+] queues: %d\n", reuse ? n_queues : 1);
+    printf("\t[+] setup_time: %f\n", stats.setup_time);
+    printf("\t[+] execution_time: %f\n", stats.time);
+    printf("\t[+] throughput: %.2f images/s (%.2f Mpixels/s)\n", n_images / stats.time, n_pixels / stats.time / 1e6);
+    printf("\t[+] latency: p50 %f, p99 %f, max %f\n", percentile(stats.latencies, n_images, 50), percentile(stats.latencies, n_images, 99), stats.latencies[n_images - 1]);
+    printf("\t[+] iterations: %.1f per image\n", (double) stats.iterations / n_images);
+
+    for (int i = 0; i < n_images; i++) {
+        free(images[i]);
+    }
+    free(stats.latencies);
+    free(channels);
+    free(heights);
+    free(widths);
+    free(images);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <omp.h>
+
+#include "image_io.h"
+#include "compression.h"
+#include "cl_device.h"
+
+#define DEFAULT_N_CLUSTERS 8
+#define DEFAULT_MAX_ITERATIONS 150
+#define DEFAULT_OUT_PATH "result.jpg"
+#define DEFAULT_N_THREADS 2
+#define DEFAULT_DEVICE_SHARE 0.5
+
+int main(int argc, char **argv)
+{
+    char *in_path = NULL;
+    char *out_path = DEFAULT_OUT_PATH;
+
+    int n_clusters = DEFAULT_N_CLUSTERS;
+    int max_iterations = DEFAULT_MAX_ITERATIONS;
+
+    int seed = time(NULL);
+
+    hybrid_options_t options;
+    options.gpu.resident_iterations = 0;
+    options.gpu.fused = -1;
+    options.gpu.device = NULL;
+    options.gpu.zero_copy = 0;
+    options.gpu.palette = 0;
+    options.gpu.precision = 0;
+    options.gpu.fission = NULL;
+    options.gpu.slab_pixels = 0;
+    options.gpu.trace = NULL;
+    options.gpu.seeding = SEEDING_RANDOM;
+    options.n_threads = DEFAULT_N_THREADS;
+    options.device_share = DEFAULT_DEVICE_SHARE;
+    options.rebalance = 1;
+
+    // Parse arguments and optional parameters
+    char optchar;
+    while ((optchar = getopt(argc, argv, "d:k:m:o:s:t:w:x:lnh")) != -1) {
+        switch (optchar)
+        {
+        case 'd':
+            options.gpu.device = optarg;
+            break;
+        case 'l':
+            cl_list_devices(stdout);
+            exit(EXIT_SUCCESS);
+            break;
+        case 'k':
+            n_clusters = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            max_iterations = strtol(optarg, NULL, 10);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 's':
+            seed = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            options.n_threads = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            options.gpu.precision = strtol(optarg, NULL, 10);
+            break;
+        case 'x':
+            options.device_share = strtod(optarg, NULL);
+            break;
+        case 'n':
+            options.rebalance = 0;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [-d device] [-k clusters] [-m iterations] [-o out_path] [-s seed] [-t threads] [-w 32|64] [-x device_share] [-n] [-l] image\n", argv[0]);
+            exit(EXIT_FAILURE);
+            break;
+        }
+    }
+
+    in_path = argv[optind];
+
+    // Validate input parameters
+    if (in_path == NULL) {
+        fprintf(stderr, "INPUT ERROR: << Parameter 'in_path' not defined >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (n_clusters < 2) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of clusters >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (max_iterations < 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid maximum number of iterations >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (options.n_threads < 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of threads >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (options.device_share < 0 || options.device_share > 1) {
+        fprintf(stderr, "INPUT ERROR: << Device share must be between 0 and 1 >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialise the random seed
+    srand(seed);
+
+    // Scan input image
+    int width, height, n_channels;
+    byte_t *data = img_load(in_path, &width, &height, &n_channels);
+
+    // Execute k-means compression
+    printf("Starting...\n");
+    fflush(stdout);
+    hybrid_stats_t stats;
+    double start_time = omp_get_wtime();
+    kmeans_compression_hybrid(data, width, height, n_channels, n_clusters, max_iterations, &options, &stats);
+    double execution_time = omp_get_wtime() - start_time;
+
+    // Save the result
+    img_save(out_path, data, width, height, n_channels);
+
+    // one iteration of either side alone over the whole image, from the rates it showed on its share
+    int n_pixels = width * height;
+    double device_alone = stats.device_rate > 0 ? n_pixels / stats.device_rate : 0;
+    double cpu_alone = stats.cpu_rate > 0 ? n_pixels / stats.cpu_rate : 0;
+    double device_part = stats.device_rate > 0 ? stats.split / stats.device_rate : 0;
+    double cpu_part = stats.cpu_rate > 0 ? (n_pixels - stats.split) / stats.cpu_rate : 0;
+    double hybrid = device_part > cpu_part ? device_part : cpu_part;
+
+    printf("[+] Split: %.1f%% of the pixels on the device (%d of %d), %d rebalances\n",
+           100 * stats.device_share, stats.split, n_pixels, stats.rebalances);
+    printf("\t[+] iterations: %d\n", stats.iterations);
+    printf("\t[+] device_time: %f\n", stats.device_time);
+    printf("\t[+] cpu_time: %f (%d threads)\n", stats.cpu_time, options.n_threads);
+    printf("\t[+] merge_time: %f\n", stats.merge_time);
+    printf("\t[+] loop_time: %f\n", stats.loop_time);
+    printf("\t[+] rates: device %.2f, cpu %.2f Mpixels/s\n", stats.device_rate / 1e6, stats.cpu_rate / 1e6);
+    if (hybrid > 0 && device_alone > 0 && cpu_alone > 0) {
+        printf("\t[+] speedup per iteration: %.2fx over the device alone, %.2fx over the CPU alone (estimated from the rates)\n",
+               device_alone / hybrid, cpu_alone / hybrid);
+    }
+    printf("Input: %s\n", in_path);
+    printf("Output: %s\n", out_path);
+    printf("Execution time: %f\n", execution_time);
+
+    free(data);
+
+    return EXIT_SUCCESS;
+}
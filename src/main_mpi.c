@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <mpi.h>
+
+#include "image_io.h"
+#include "compression.h"
+
+#define DEFAULT_N_CLUSTERS 8
+#define DEFAULT_MAX_ITERATIONS 150
+#define DEFAULT_OUT_PATH "result.jpg"
+#define DEFAULT_N_THREADS 2
+
+int main(int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    char *in_path = NULL;
+    char *out_path = DEFAULT_OUT_PATH;
+
+    int n_clusters = DEFAULT_N_CLUSTERS;
+    int max_iterations = DEFAULT_MAX_ITERATIONS;
+
+    int seed = time(NULL);
+    int n_threads = DEFAULT_N_THREADS;
+    int verbose = 0;
+
+    // Parse arguments and optional parameters, every rank gets the same ones
+    char optchar;
+    while ((optchar = getopt(argc, argv, "k:m:o:s:t:vh")) != -1) {
+        switch (optchar)
+        {
+        case 'k':
+            n_clusters = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            max_iterations = strtol(optarg, NULL, 10);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 's':
+            seed = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            n_threads = strtol(optarg, NULL, 10);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+        default:
+            if (rank == 0) {
+                fprintf(stderr, "Usage: %s [-k clusters] [-m iterations] [-o out_path] [-s seed] [-t threads per rank] [-v] image\n", argv[0]);
+            }
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+            break;
+        }
+    }
+
+    in_path = argv[optind];
+
+    // Validate input parameters
+    if (in_path == NULL) {
+        fprintf(stderr, "INPUT ERROR: << Parameter 'in_path' not defined >> \n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    if (n_clusters < 2) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of clusters >> \n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    if (max_iterations < 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid maximum number of iterations >> \n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    if (n_threads < 1) {
+        fprintf(stderr, "INPUT ERROR: << Invalid number of threads >> \n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    // Initialise the random seed, only the root picks initial centers
+    srand(seed);
+
+    // Scan input image on the root, the other ranks only ever hold their slab
+    int width = 0, height = 0, n_channels = 0;
+    byte_t *data = NULL;
+    if (rank == 0) {
+        data = img_load(in_path, &width, &height, &n_channels);
+    }
+
+    mpi_stats_t stats;
+    stats.iteration_compute = malloc(max_iterations * sizeof(double));
+    stats.iteration_comm = malloc(max_iterations * sizeof(double));
+
+    // Execute k-means compression
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start_time = MPI_Wtime();
+    kmeans_compression_mpi(data, width, height, n_channels, n_clusters, max_iterations, n_threads, &stats);
+    double execution_time = MPI_Wtime() - start_time;
+
+    if (rank == 0) {
+        // Save the result
+        img_save(out_path, data, width, height, n_channels);
+
+        printf("[+] Ranks: %d x %d threads, slabs of up to %d rows\n", stats.n_ranks, n_threads, stats.slab_rows);
+        if (verbose) {
+            printf("\t%9s %12s %12s %7s\n", "iteration", "compute_ms", "comm_ms", "comm%");
+            for (int i = 0; i < stats.iterations; i++) {
+                double total = stats.iteration_compute[i] + stats.iteration_comm[i];
+                printf("\t%9d %12.3f %12.3f %6.1f%%\n", i + 1, stats.iteration_compute[i] * 1e3, stats.iteration_comm[i] * 1e3,
+                       total > 0 ? 100 * stats.iteration_comm[i] / total : 0);
+            }
+        }
+        printf("[+] Printing times: \n");
+        printf("\t[+] scatter_time: %f\n", stats.scatter_time);
+        printf("\t[+] compute_time: %f (%f per iteration)\n", stats.compute_time, stats.compute_time / stats.iterations);
+        printf("\t[+] comm_time: %f (%f per iteration, %.1f%% of the loop)\n", stats.comm_time, stats.comm_time / stats.iterations,
+               stats.compute_time + stats.comm_time > 0 ? 100 * stats.comm_time / (stats.compute_time + stats.comm_time) : 0);
+        printf("\t[+] gather_time: %f\n", stats.gather_time);
+        printf("\t[+] loop_time: %f\n", stats.loop_time);
+        printf("\t[+] iterations: %d\n", stats.iterations);
+        printf("Input: %s\n", in_path);
+        printf("Output: %s\n", out_path);
+        printf("Execution time: %f\n", execution_time);
+
+        free(data);
+    }
+
+    free(stats.iteration_comm);
+    free(stats.iteration_compute);
+
+    MPI_Finalize();
+
+    return EXIT_SUCCESS;
+}
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
@@ -7,6 +8,7 @@
 
 #include "image_io.h"
 #include "compression.h"
+#include "thread_count.h"
 
 #define DEFAULT_N_CLUSTERS 8
 #define DEFAULT_MAX_ITERATIONS 150
@@ -23,10 +25,11 @@ int main(int argc, char **argv)
 
     int seed = time(NULL);
     int n_threads = DEFAULT_N_THREADS;
+    int schedule = SCHEDULE_STATIC;
     
     // Parse arguments and optional parameters
     char optchar;
-    while ((optchar = getopt(argc, argv, "k:m:o:s:t:h")) != -1) {
+    while ((optchar = getopt(argc, argv, "k:m:o:s:t:wph")) != -1) {
         switch (optchar)
         {
         case 'k':
@@ -42,7 +45,14 @@ int main(int argc, char **argv)
             seed = strtol(optarg, NULL, 10);
             break;
         case 't':
-            n_threads = strtol(optarg, NULL, 10);
+            // "auto" (or 0) picks the thread count from the cpu budget and a cost model
+            n_threads = strcmp(optarg, "auto") == 0 ? 0 : strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            schedule = SCHEDULE_TILES;
+            break;
+        case 'p':
+            schedule = SCHEDULE_PSTL;
             break;
         case 'h':
         default:
@@ -71,7 +81,7 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);    
     }
 
-    if (n_threads < 2) {
+    if (n_threads < 0) {
         fprintf(stderr, "INPUT ERROR: << Invalid number of threads >> \n");
         exit(EXIT_FAILURE);    
     }
@@ -79,13 +89,36 @@ int main(int argc, char **argv)
     // Initialise the random seed
     srand(seed);
 
-    // Scan input image
+    // Reserve one arena for the pixels and every buffer of the run
     int width, height, n_channels;
-    byte_t *data = img_load(in_path, &width, &height, &n_channels);
+    img_info(in_path, &width, &height, &n_channels);
+
+    // In auto mode the workspace is sized for every cpu we may use, the model picks fewer later
+    int max_threads = n_threads ? n_threads : affinity_cpu_count();
+
+    arena_t arena;
+    arena_init(&arena);
+    arena_reserve(&arena, ARENA_ALIGN((size_t)width * height * n_channels) + kmeans_workspace_size_omp(width, height, n_channels, n_clusters, max_threads));
+
+    // Scan input image
+    byte_t *data = img_load_arena(in_path, &arena, &width, &height, &n_channels);
+
+    thread_model_t model;
+    int model_used = n_threads == 0;
+    if (model_used) {
+        n_threads = choose_thread_count(data, width * height, n_channels, n_clusters, &model);
+        char quota[32] = "none";
+        if (model.cpu_quota > 0) {
+            snprintf(quota, sizeof(quota), "%.2f cpus", model.cpu_quota);
+        }
+        printf("Threads: auto -> %d of %d (affinity %d cpus, cgroup quota %s, predicted %f s/iteration)\n",
+               n_threads, model.max_threads, model.affinity_cpus, quota, model.predicted_time);
+    }
 
     // Execute k-means compression
+    kmeans_stats_t stats;
     double start_time = omp_get_wtime();
-    kmeans_compression_omp(data, width, height, n_channels, n_clusters, max_iterations, n_threads);
+    kmeans_compression_omp(&arena, data, width, height, n_channels, n_clusters, max_iterations, n_threads, schedule, &stats);
     double execution_time = omp_get_wtime() - start_time;
 
     // Save the result
@@ -93,8 +126,12 @@ int main(int argc, char **argv)
     printf("Input: %s\n", in_path);
     printf("Output: %s\n", out_path);
     printf("Execution time: %f\n", execution_time);
+    if (model_used) {
+        printf("Predicted vs measured: %f vs %f s/iteration\n", model.predicted_time, (stats.assign_pixels_time + stats.update_centers_time) / stats.iterations);
+    }
+    printf("Arena peak: %zu bytes (%s)\n", arena.peak, arena.huge_pages == 1 ? "huge pages" : arena.huge_pages == 2 ? "transparent huge pages" : "regular pages");
 
-    free(data);
+    arena_destroy(&arena);
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
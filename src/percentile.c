@@ -0,0 +1,26 @@
+#include <math.h>
+
+#include "percentile.h"
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+double percentile(const double *sorted, int n, double p)
+{
+    // rank ceil(p / 100 * n), computed as p * n / 100 so whole percentiles of whole counts stay exact
+    int rank = (int) ceil(p * n / 100);
+
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > n) {
+        rank = n;
+    }
+
+    return sorted[rank - 1];
+}
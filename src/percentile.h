@@ -0,0 +1,10 @@
+#ifndef PERCENTILE_H
+#define PERCENTILE_H
+
+// qsort comparator of doubles, ascending
+int compare_doubles(const void *a, const void *b);
+// nearest-rank percentile of n > 0 sorted values: the smallest value with at least p percent of the
+// values at or below it
+double percentile(const double *sorted, int n, double p);
+
+#endif
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#include "program_cache.h"
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static unsigned long long fnv1a(unsigned long long hash, const void *bytes, size_t size)
+{
+    const unsigned char *p = bytes;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static unsigned long long hash_device_info(unsigned long long hash, cl_device_id device, cl_device_info param)
+{
+    char value[1024] = "";
+
+    clGetDeviceInfo(device, param, sizeof(value) - 1, value, NULL);
+
+    // include the terminator, so neighbouring fields can't run into each other
+    return fnv1a(hash, value, strlen(value) + 1);
+}
+
+unsigned long long program_cache_device_hash(cl_device_id device)
+{
+    unsigned long long hash = FNV_OFFSET_BASIS;
+    hash = hash_device_info(hash, device, CL_DEVICE_NAME);
+    hash = hash_device_info(hash, device, CL_DEVICE_VENDOR);
+    hash = hash_device_info(hash, device, CL_DEVICE_VERSION);
+    hash = hash_device_info(hash, device, CL_DRIVER_VERSION);
+
+    return hash;
+}
+
+int program_cache_dir(char *dir, size_t size)
+{
+    const char *env = getenv(PROGRAM_CACHE_ENV);
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (env && *env) {
+        snprintf(dir, size, "%s", env);
+    } else if (xdg && *xdg) {
+        snprintf(dir, size, "%s/%s", xdg, PROGRAM_CACHE_DIR);
+    } else if (home && *home) {
+        snprintf(dir, size, "%s/.cache/%s", home, PROGRAM_CACHE_DIR);
+    } else {
+        return 0;
+    }
+
+    // create the missing components one by one
+    for (char *p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+
+    return mkdir(dir, 0755) == 0 || errno == EEXIST;
+}
+
+static unsigned char *read_binary(const char *path, size_t *size)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    unsigned char *binary = length > 0 ? malloc(length) : NULL;
+    if (binary && fread(binary, 1, length, fp) != (size_t)length) {
+        free(binary);
+        binary = NULL;
+    }
+    fclose(fp);
+
+    *size = length;
+    return binary;
+}
+
+static int write_binary(cl_program program, const char *path)
+{
+    size_t size = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL) != CL_SUCCESS || size == 0) {
+        return 0;
+    }
+
+    unsigned char *binary = malloc(size);
+    unsigned char *binaries[1] = { binary };
+    int written = 0;
+
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) == CL_SUCCESS) {
+        // write next to the final name and rename, so a concurrent run never sees half a file
+        char tmp_path[4096 + 32];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+
+        FILE *fp = fopen(tmp_path, "wb");
+        if (fp) {
+            written = fwrite(binary, 1, size, fp) == size;
+            written &= fclose(fp) == 0;
+            written = written && rename(tmp_path, path) == 0;
+
+            if (!written) {
+                unlink(tmp_path);
+            }
+        }
+    }
+
+    free(binary);
+    return written;
+}
+
+cl_program program_cache_build(cl_context context, cl_device_id device, const char *source, size_t source_size,
+                               const char *options, cl_int *status, program_cache_info_t *info)
+{
+    double start_time = omp_get_wtime();
+    cl_program program = NULL;
+    const char *build_options = options ? options : "";
+
+    info->hit = 0;
+    info->stored = 0;
+    info->path[0] = '\0';
+
+    // the key: everything that makes a compiled binary invalid
+    unsigned long long key = program_cache_device_hash(device);
+    key = fnv1a(key, build_options, strlen(build_options) + 1);
+    key = fnv1a(key, source, source_size);
+
+    char dir[4096 - 32];
+    int have_dir = program_cache_dir(dir, sizeof(dir));
+    if (have_dir) {
+        snprintf(info->path, sizeof(info->path), "%s/%016llx.bin", dir, key);
+
+        size_t binary_size;
+        unsigned char *binary = read_binary(info->path, &binary_size);
+
+        if (binary) {
+            cl_int binary_status;
+            program = clCreateProgramWithBinary(context, 1, &device, &binary_size, (const unsigned char **)&binary, &binary_status, status);
+
+            if (*status == CL_SUCCESS && binary_status == CL_SUCCESS) {
+                *status = clBuildProgram(program, 1, &device, build_options, NULL, NULL);
+            }
+
+            // a stale or foreign binary: drop it and compile from source
+            if (*status != CL_SUCCESS) {
+                if (program) {
+                    clReleaseProgram(program);
+                }
+                program = NULL;
+                unlink(info->path);
+            } else {
+                info->hit = 1;
+            }
+
+            free(binary);
+        }
+    }
+
+    if (!program) {
+        program = clCreateProgramWithSource(context, 1, &source, &source_size, status);
+        *status = clBuildProgram(program, 1, &device, build_options, NULL, NULL);
+
+        if (*status == CL_SUCCESS && have_dir) {
+            info->stored = write_binary(program, info->path);
+        }
+    }
+
+    info->build_time = omp_get_wtime() - start_time;
+    return program;
+}
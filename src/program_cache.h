@@ -0,0 +1,28 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include <CL/cl.h>
+
+// cache directory: $KMEANS_CL_CACHE, else $XDG_CACHE_HOME/kmeans-cl, else ~/.cache/kmeans-cl
+#define PROGRAM_CACHE_ENV "KMEANS_CL_CACHE"
+#define PROGRAM_CACHE_DIR "kmeans-cl"
+
+typedef struct {
+    int hit;                // built from a cached binary
+    int stored;             // a new binary was written to the cache
+    double build_time;
+    char path[4096];
+} program_cache_info_t;
+
+// builds source for device, reusing a binary compiled earlier for the same device, driver,
+// options and source; the build status is returned in status, the build log is left to the caller
+cl_program program_cache_build(cl_context context, cl_device_id device, const char *source, size_t source_size,
+                               const char *options, cl_int *status, program_cache_info_t *info);
+
+// creates the cache directory if needed, 0 when there is nowhere to put it
+int program_cache_dir(char *dir, size_t size);
+
+// FNV-1a of the device name, vendor, version and driver version
+unsigned long long program_cache_device_hash(cl_device_id device);
+
+#endif
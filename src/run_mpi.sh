@@ -0,0 +1,11 @@
+#!/usr/bin/env bash
+
+ranks=${1:-2}
+threads=${2:-2}
+
+# Multithreading inside every rank
+export OMP_PLACES=cores
+export OMP_PROC_BIND=TRUE
+export OMP_NUM_THREADS=$threads
+
+srun --reservation=fri --mpi=pmix --ntasks=$ranks --cpus-per-task=$threads ./main_mpi ${3:-"../imgs/input/bear_large.jpg"} -o ${4:-"../imgs/output/result.jpg"} -t $threads
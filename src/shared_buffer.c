@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shared_buffer.h"
+
+static int map_buffer(shared_buffer_t *buffer, int fd, size_t size)
+{
+    buffer->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (buffer->data == MAP_FAILED) {
+        close(fd);
+        buffer->data = NULL;
+        return 0;
+    }
+
+    buffer->size = size;
+    buffer->fd = fd;
+
+    return 1;
+}
+
+int shared_buffer_create(shared_buffer_t *buffer, size_t size)
+{
+    int fd = memfd_create("kmeans-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return 0;
+    }
+
+    // sealed against shrinking, so whoever maps it can trust the size for as long as it's mapped
+    if (ftruncate(fd, size) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+        close(fd);
+        return 0;
+    }
+
+    return map_buffer(buffer, fd, size);
+}
+
+int shared_buffer_create_named(shared_buffer_t *buffer, const char *name, size_t size)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return 0;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return 0;
+    }
+
+    return map_buffer(buffer, fd, size);
+}
+
+int shared_buffer_map_fd(shared_buffer_t *buffer, int fd, size_t size)
+{
+    // a smaller object than the caller claims would fault on access instead of failing here, and one
+    // the sender can still shrink would fault later, so only sealed memfds are mapped
+    struct stat info;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &info) < 0 || (size_t) info.st_size < size) {
+        close(fd);
+        return 0;
+    }
+
+    return map_buffer(buffer, fd, size);
+}
+
+int shared_buffer_open(shared_buffer_t *buffer, const char *name, size_t size)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return 0;
+    }
+
+    // named objects can't be sealed; only the mapping process's own user, who could kill it anyway, may
+    // hand one over
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_uid != geteuid() || (size_t) info.st_size < size) {
+        close(fd);
+        return 0;
+    }
+
+    return map_buffer(buffer, fd, size);
+}
+
+void shared_buffer_release(shared_buffer_t *buffer)
+{
+    if (buffer->data) {
+        munmap(buffer->data, buffer->size);
+    }
+    if (buffer->fd >= 0) {
+        close(buffer->fd);
+    }
+
+    memset(buffer, 0, sizeof(shared_buffer_t));
+    buffer->fd = -1;
+}
@@ -0,0 +1,28 @@
+#ifndef SHARED_BUFFER_H
+#define SHARED_BUFFER_H
+
+#include <stddef.h>
+
+// memory another process can map: a memfd whose descriptor is handed over a Unix socket, or a named
+// POSIX shared memory object for callers that can't pass descriptors
+typedef struct {
+    void *data;
+    size_t size;
+    int fd;                   // the memfd or shared memory object, -1 after release
+} shared_buffer_t;
+
+// an anonymous memfd of size bytes, sealed against shrinking and mapped; 0 on failure
+int shared_buffer_create(shared_buffer_t *buffer, size_t size);
+// a named POSIX shared memory object ("/name") of size bytes, mapped; 0 on failure
+int shared_buffer_create_named(shared_buffer_t *buffer, const char *name, size_t size);
+
+// maps a memfd received from another process, which has to be sealed against shrinking and hold at least
+// size bytes, or a name created by a process of the same user, which is trusted not to truncate it while
+// it's mapped; 0 on failure
+int shared_buffer_map_fd(shared_buffer_t *buffer, int fd, size_t size);
+int shared_buffer_open(shared_buffer_t *buffer, const char *name, size_t size);
+
+// unmaps and closes, the memory goes away once no process maps it any more (named objects need shm_unlink)
+void shared_buffer_release(shared_buffer_t *buffer);
+
+#endif
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+#include <sched.h>
+#include <omp.h>
+
+#include "image_io.h"
+#include "thread_count.h"
+
+#define CALIBRATION_PIXELS 16384
+#define CALIBRATION_REGIONS 64
+
+// parallel regions per iteration: assign_pixels and the partial sums of update_centers
+#define REGIONS_PER_ITERATION 2
+
+// the process's own cgroup in the hierarchy with the cpu controller: the v1 one that lists "cpu", else
+// the v2 one ("0::/path"); 0 if /proc/self/cgroup has neither
+static int own_cgroup(char *path, size_t size, int *v1)
+{
+    char line[PATH_MAX + 64];
+    int found = 0;
+
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    if (!fp) {
+        return 0;
+    }
+
+    // "<id>:<controllers>:<path>"
+    while (fgets(line, sizeof(line), fp)) {
+        char *controllers = strchr(line, ':');
+        char *cgroup = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (!cgroup) {
+            continue;
+        }
+        *controllers++ = '\0';
+        *cgroup++ = '\0';
+        cgroup[strcspn(cgroup, "\n")] = '\0';
+
+        int has_cpu = 0;
+        char *saveptr;
+        for (char *controller = strtok_r(controllers, ",", &saveptr); controller; controller = strtok_r(NULL, ",", &saveptr)) {
+            has_cpu |= strcmp(controller, "cpu") == 0;
+        }
+
+        if (has_cpu || (!found && strcmp(line, "0") == 0 && controllers[0] == '\0')) {
+            snprintf(path, size, "%s", cgroup);
+            *v1 = has_cpu;
+            found = 1;
+        }
+        if (has_cpu) {
+            break;
+        }
+    }
+
+    fclose(fp);
+    return found;
+}
+
+static double read_quota(const char *dir, int v1)
+{
+    char file[PATH_MAX + 64];
+    long quota = -1, period = 0;
+    char max[32];
+
+    if (!v1) {
+        // cgroup v2: "<quota> <period>" or "max <period>"
+        snprintf(file, sizeof(file), "%s/cpu.max", dir);
+        FILE *fp = fopen(file, "r");
+        if (fp) {
+            if (fscanf(fp, "%31s %ld", max, &period) == 2 && max[0] != 'm') {
+                quota = strtol(max, NULL, 10);
+            }
+            fclose(fp);
+        }
+    } else {
+        snprintf(file, sizeof(file), "%s/cpu.cfs_quota_us", dir);
+        FILE *fp = fopen(file, "r");
+        if (fp) {
+            if (fscanf(fp, "%ld", &quota) != 1) {
+                quota = -1;
+            }
+            fclose(fp);
+        }
+
+        snprintf(file, sizeof(file), "%s/cpu.cfs_period_us", dir);
+        fp = fopen(file, "r");
+        if (fp) {
+            if (fscanf(fp, "%ld", &period) != 1) {
+                period = 0;
+            }
+            fclose(fp);
+        }
+    }
+
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+
+    return (double)quota / period;
+}
+
+double cgroup_cpu_quota(void)
+{
+    char cgroup[PATH_MAX], dir[PATH_MAX + 32];
+    int v1 = 0;
+
+    // in a cgroup namespace the process's own cgroup is the root, "/"
+    if (!own_cgroup(cgroup, sizeof(cgroup), &v1)) {
+        snprintf(cgroup, sizeof(cgroup), "/");
+    }
+
+    const char *root = v1 ? "/sys/fs/cgroup/cpu" : "/sys/fs/cgroup";
+    size_t root_length = strlen(root);
+    snprintf(dir, sizeof(dir), "%s%s", root, cgroup);
+
+    // the tightest quota of the cgroup and its ancestors applies
+    double limit = 0;
+    for (;;) {
+        double quota = read_quota(dir, v1);
+        if (quota > 0 && (limit == 0 || quota < limit)) {
+            limit = quota;
+        }
+
+        char *slash = strrchr(dir, '/');
+        if (!slash || (size_t) (slash - dir) < root_length) {
+            break;
+        }
+        *slash = '\0';
+    }
+
+    return limit;
+}
+
+int affinity_cpu_count(void)
+{
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return omp_get_num_procs();
+    }
+
+    return CPU_COUNT(&set);
+}
+
+double predict_iteration_time(thread_model_t *model, int n_pixels, int n_channels, int n_clusters, int n_threads)
+{
+    double work = (double)n_pixels * n_clusters * n_channels * model->assign_cost
+        + (double)n_pixels * n_channels * model->accumulate_cost;
+
+    return work / n_threads + REGIONS_PER_ITERATION * n_threads * model->thread_cost;
+}
+
+// time the two hot loops serially on a sample of the image
+static void calibrate_work(byte_t *data, int n_pixels, int n_channels, int n_clusters, thread_model_t *model)
+{
+    int n_sample = n_pixels < CALIBRATION_PIXELS ? n_pixels : CALIBRATION_PIXELS;
+    int stride = n_pixels / n_sample;
+
+    double *centers = malloc(n_clusters * n_channels * sizeof(double));
+    double *sums = calloc(n_clusters * n_channels, sizeof(double));
+    int *labels = malloc(n_sample * sizeof(int));
+
+    for (int cluster = 0; cluster < n_clusters; cluster++) {
+        for (int channel = 0; channel < n_channels; channel++) {
+            centers[cluster * n_channels + channel] = data[(cluster * stride) % n_pixels * n_channels + channel];
+        }
+    }
+
+    double start_time = omp_get_wtime();
+    for (int i = 0; i < n_sample; i++) {
+        int pixel = i * stride;
+        double min_distance = DBL_MAX;
+
+        for (int cluster = 0; cluster < n_clusters; cluster++) {
+            double distance = 0;
+
+            for (int channel = 0; channel < n_channels; channel++) {
+                double tmp = (double)(data[pixel * n_channels + channel] - centers[cluster * n_channels + channel]);
+                distance += (tmp * tmp);
+            }
+
+            if (distance < min_distance) {
+                min_distance = distance;
+                labels[i] = cluster;
+            }
+        }
+    }
+    model->assign_cost = (omp_get_wtime() - start_time) / ((double)n_sample * n_clusters * n_channels);
+
+    start_time = omp_get_wtime();
+    for (int i = 0; i < n_sample; i++) {
+        for (int channel = 0; channel < n_channels; channel++) {
+            sums[labels[i] * n_channels + channel] += data[i * stride * n_channels + channel];
+        }
+    }
+    model->accumulate_cost = (omp_get_wtime() - start_time) / ((double)n_sample * n_channels);
+
+    free(labels);
+    free(sums);
+    free(centers);
+}
+
+// fork/join cost of an empty parallel region, per thread
+static void calibrate_threads(thread_model_t *model)
+{
+    int n_threads = model->max_threads;
+    int sink = 0;
+
+    // the first region starts the threads, which is paid once and not per iteration
+    #pragma omp parallel num_threads(n_threads)
+    {
+        #pragma omp atomic
+        sink++;
+    }
+
+    double start_time = omp_get_wtime();
+    for (int i = 0; i < CALIBRATION_REGIONS; i++) {
+        #pragma omp parallel num_threads(n_threads)
+        {
+            #pragma omp atomic
+            sink++;
+        }
+    }
+
+    model->thread_cost = (omp_get_wtime() - start_time) / CALIBRATION_REGIONS / n_threads;
+}
+
+int choose_thread_count(byte_t *data, int n_pixels, int n_channels, int n_clusters, thread_model_t *model)
+{
+    model->affinity_cpus = affinity_cpu_count();
+    model->cpu_quota = cgroup_cpu_quota();
+
+    // never run more threads than the cpus we may use or the quota pays for
+    model->max_threads = model->affinity_cpus;
+    if (model->cpu_quota > 0 && ceil(model->cpu_quota) < model->max_threads) {
+        model->max_threads = (int)ceil(model->cpu_quota);
+    }
+    if (model->max_threads < 1) {
+        model->max_threads = 1;
+    }
+
+    calibrate_work(data, n_pixels, n_channels, n_clusters, model);
+    calibrate_threads(model);
+
+    model->threads = 1;
+    model->predicted_time = predict_iteration_time(model, n_pixels, n_channels, n_clusters, 1);
+
+    for (int n_threads = 2; n_threads <= model->max_threads; n_threads++) {
+        double time = predict_iteration_time(model, n_pixels, n_channels, n_clusters, n_threads);
+
+        if (time < model->predicted_time) {
+            model->threads = n_threads;
+            model->predicted_time = time;
+        }
+    }
+
+    return model->threads;
+}
@@ -0,0 +1,24 @@
+#ifndef THREAD_COUNT_H
+#define THREAD_COUNT_H
+
+#include "image_io.h"
+
+// calibrated cost of one k-means iteration: work / threads + per-thread fork/join overhead
+typedef struct {
+    int affinity_cpus;
+    double cpu_quota;
+    int max_threads;
+    double assign_cost;
+    double accumulate_cost;
+    double thread_cost;
+    int threads;
+    double predicted_time;
+} thread_model_t;
+
+// cpus granted by the cpu quota of the process's cgroup or its ancestors, 0 if there is no limit
+double cgroup_cpu_quota(void);
+int affinity_cpu_count(void);
+int choose_thread_count(byte_t *data, int n_pixels, int n_channels, int n_clusters, thread_model_t *model);
+double predict_iteration_time(thread_model_t *model, int n_pixels, int n_channels, int n_clusters, int n_threads);
+
+#endif
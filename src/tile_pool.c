@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <omp.h>
+
+#include "tile_pool.h"
+
+tile_pool_t *tile_pool_create(int n_workers, int width, int height, int tile_width, int tile_height)
+{
+    tile_pool_t *pool = calloc(1, sizeof(tile_pool_t));
+
+    pool->n_workers = n_workers;
+    pool->deques = malloc(n_workers * sizeof(tile_deque_t));
+    pool->worker_busy = calloc(n_workers, sizeof(double));
+    pool->worker_steals = calloc(n_workers, sizeof(long));
+
+    for (int worker = 0; worker < n_workers; worker++) {
+        omp_init_lock(&pool->deques[worker].lock);
+    }
+
+    tile_pool_resize(pool, width, height, tile_width, tile_height);
+
+    return pool;
+}
+
+void tile_pool_resize(tile_pool_t *pool, int width, int height, int tile_width, int tile_height)
+{
+    int tiles_x = (width - 1) / tile_width + 1;
+    int tiles_y = (height - 1) / tile_height + 1;
+
+    pool->width = width;
+    pool->height = height;
+    pool->n_tiles = tiles_x * tiles_y;
+
+    // the tile array only ever grows, so same-sized or smaller images reuse it
+    if (pool->n_tiles > pool->tiles_capacity) {
+        free(pool->tiles);
+        pool->tiles = malloc(pool->n_tiles * sizeof(tile_t));
+        pool->tiles_capacity = pool->n_tiles;
+    }
+
+    // tiles are numbered row by row, so a contiguous range of tiles is a horizontal band of the image
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            tile_t *tile = &pool->tiles[ty * tiles_x + tx];
+            tile->x0 = tx * tile_width;
+            tile->y0 = ty * tile_height;
+            tile->x1 = (tile->x0 + tile_width < width) ? tile->x0 + tile_width : width;
+            tile->y1 = (tile->y0 + tile_height < height) ? tile->y0 + tile_height : height;
+        }
+    }
+}
+
+void tile_pool_destroy(tile_pool_t *pool)
+{
+    for (int worker = 0; worker < pool->n_workers; worker++) {
+        omp_destroy_lock(&pool->deques[worker].lock);
+    }
+
+    free(pool->worker_steals);
+    free(pool->worker_busy);
+    free(pool->deques);
+    free(pool->tiles);
+    free(pool);
+}
+
+int tile_pool_add_phase(tile_pool_t *pool, const char *name)
+{
+    if (pool->n_phases == TILE_POOL_MAX_PHASES) {
+        fprintf(stderr, "TILE POOL ERROR: << Too many phases >> \n");
+        exit(EXIT_FAILURE);
+    }
+
+    pool->phases[pool->n_phases].name = name;
+
+    return pool->n_phases++;
+}
+
+// owner takes tiles from the front of its own range
+static int pop_tile(tile_deque_t *deque)
+{
+    int tile = -1;
+
+    omp_set_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        tile = deque->head++;
+    }
+    omp_unset_lock(&deque->lock);
+
+    return tile;
+}
+
+// thieves take tiles from the back, away from where the owner is working
+static int steal_tile(tile_deque_t *deque)
+{
+    int tile = -1;
+
+    omp_set_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        tile = --deque->tail;
+    }
+    omp_unset_lock(&deque->lock);
+
+    return tile;
+}
+
+void tile_pool_run(tile_pool_t *pool, int phase, tile_func_t func, void *arg)
+{
+    int n_workers = pool->n_workers;
+
+    // hand every worker an equal contiguous band of tiles, like schedule(static) would
+    for (int worker = 0; worker < n_workers; worker++) {
+        pool->deques[worker].head = (int)((long)pool->n_tiles * worker / n_workers);
+        pool->deques[worker].tail = (int)((long)pool->n_tiles * (worker + 1) / n_workers);
+        pool->worker_busy[worker] = 0;
+        pool->worker_steals[worker] = 0;
+    }
+
+    int n_active = n_workers;
+    double start_time = omp_get_wtime();
+
+    #pragma omp parallel num_threads(n_workers)
+    {
+        int worker = omp_get_thread_num();
+        long steals = 0;
+
+        #pragma omp single nowait
+        n_active = omp_get_num_threads();
+
+        int tile;
+        while ((tile = pop_tile(&pool->deques[worker])) >= 0) {
+            func(&pool->tiles[tile], worker, arg);
+        }
+
+        // own band is done, go around the other workers and steal from their tails
+        for (int i = 1; i < n_workers; i++) {
+            tile_deque_t *victim = &pool->deques[(worker + i) % n_workers];
+
+            while ((tile = steal_tile(victim)) >= 0) {
+                func(&pool->tiles[tile], worker, arg);
+                steals++;
+            }
+        }
+
+        pool->worker_busy[worker] = omp_get_wtime() - start_time;
+        pool->worker_steals[worker] = steals;
+    }
+
+    // statistics of this run
+    tile_phase_stats_t *stats = &pool->phases[phase];
+    double busy_sum = 0;
+    double busy_max = 0;
+
+    for (int worker = 0; worker < n_active; worker++) {
+        busy_sum += pool->worker_busy[worker];
+        stats->steals += pool->worker_steals[worker];
+
+        if (pool->worker_busy[worker] > busy_max) {
+            busy_max = pool->worker_busy[worker];
+        }
+    }
+
+    stats->runs++;
+    stats->wall_time += omp_get_wtime() - start_time;
+    stats->busy_mean_sum += busy_sum / n_active;
+    stats->busy_max_sum += busy_max;
+}
+
+void tile_pool_report(tile_pool_t *pool, FILE *out)
+{
+    fprintf(out, "[+] Load imbalance (%d workers, %d tiles): \n", pool->n_workers, pool->n_tiles);
+    fprintf(out, "\t%-16s %6s %10s %10s %10s\n", "phase", "runs", "time", "imbalance", "steals");
+
+    for (int phase = 0; phase < pool->n_phases; phase++) {
+        tile_phase_stats_t *stats = &pool->phases[phase];
+
+        // max / mean busy time of the workers, 1.00 means perfectly balanced
+        double imbalance = stats->busy_mean_sum > 0 ? stats->busy_max_sum / stats->busy_mean_sum : 1;
+
+        fprintf(out, "\t%-16s %6d %10.4f %10.2f %10ld\n", stats->name, stats->runs, stats->wall_time, imbalance, stats->steals);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef TILE_POOL_H
+#define TILE_POOL_H
+
+#include <stdio.h>
+#include <omp.h>
+
+#define TILE_WIDTH 64
+#define TILE_HEIGHT 64
+#define TILE_POOL_MAX_PHASES 8
+
+typedef struct {
+    int x0, y0;
+    int x1, y1;
+} tile_t;
+
+// called once per tile by the worker that popped (or stole) it
+typedef void (*tile_func_t)(const tile_t *tile, int worker, void *arg);
+
+// [head, tail) range of tile indices owned by one worker, padded against false sharing
+typedef struct {
+    omp_lock_t lock;
+    int head;
+    int tail;
+    char pad[64];
+} tile_deque_t;
+
+typedef struct {
+    const char *name;
+    int runs;
+    long steals;
+    double wall_time;
+    double busy_mean_sum;
+    double busy_max_sum;
+} tile_phase_stats_t;
+
+typedef struct {
+    int n_workers;
+    int width;
+    int height;
+    int n_tiles;
+    int tiles_capacity;
+    tile_t *tiles;
+    tile_deque_t *deques;
+    double *worker_busy;
+    long *worker_steals;
+    int n_phases;
+    tile_phase_stats_t phases[TILE_POOL_MAX_PHASES];
+} tile_pool_t;
+
+tile_pool_t *tile_pool_create(int n_workers, int width, int height, int tile_width, int tile_height);
+void tile_pool_resize(tile_pool_t *pool, int width, int height, int tile_width, int tile_height);
+void tile_pool_destroy(tile_pool_t *pool);
+int tile_pool_add_phase(tile_pool_t *pool, const char *name);
+void tile_pool_run(tile_pool_t *pool, int phase, tile_func_t func, void *arg);
+void tile_pool_report(tile_pool_t *pool, FILE *out);
+
+#endif